@@ -1,6 +1,7 @@
 // Copyright 2016
 
 #include <ws2tcpip.h>
+#include "raspi_jpeg.h"
 
 RasPiCamera::RasPiStatus RasPiCamera::Connect() {
   if (debug_)
@@ -37,6 +38,19 @@ RasPiCamera::RasPiStatus RasPiCamera::Connect() {
       status_ = kError;
       return kError;
     }
+    // Set before connecting, so that the TCP window scale can grow to it.
+    if (socket_receive_buffer_ > 0 &&
+        setsockopt(socket_, SOL_SOCKET, SO_RCVBUF,
+                   reinterpret_cast<char*>(&socket_receive_buffer_),
+                   sizeof(socket_receive_buffer_)) == SOCKET_ERROR) {
+      fprintf_s(stderr, kErrorMessageFor, "setsockopt", "SO_RCVBUF",
+                WSAGetLastError());
+      closesocket(socket_);
+      socket_ = INVALID_SOCKET;
+      freeaddrinfo(getaddrinfo_result);
+      status_ = kError;
+      return kError;
+    }
     result = connect(socket_, ptr->ai_addr, static_cast<int>(ptr->ai_addrlen));
     if (result == SOCKET_ERROR) {
       closesocket(socket_);
@@ -79,6 +93,18 @@ RasPiCamera::RasPiStatus RasPiCamera::Connect() {
     status_ = kError;
     return kError;
   }
+  // Serial requests are small and latency bound, so they must not wait for
+  // the acknowledgement of the previous segment.
+  BOOL no_delay = TRUE;
+  setsockopt_result = setsockopt(
+      socket_, IPPROTO_TCP, TCP_NODELAY,
+      reinterpret_cast<char*>(&no_delay), sizeof(no_delay));
+  if (setsockopt_result == SOCKET_ERROR) {
+    fprintf_s(stderr, kErrorMessageFor, "setsockopt",
+            "TCP_NODELAY", WSAGetLastError());
+    status_ = kError;
+    return kError;
+  }
   return kOK;
 }
 
@@ -116,11 +142,20 @@ RasPiCamera::RasPiStatus RasPiCamera::Configure() {
     std::cerr << "file_size = " << file_size.QuadPart << "\n";
   std::string config_string;
   if (Read(config_file, &config_string) != kOK) return kError;
-  RequestProtocol req;
-  FillRequestProtocol(kConfigure, file_size.LowPart, &req);
+  // Servers that do not know the line ignore it and keep sending version 1
+  // headers, so the version is only offered, never required.
+  if (protocol_version_ >= 2) {
+    if (!config_string.empty() &&
+        config_string[config_string.size() - 1] != '\n')
+      config_string += '\n';
+    config_string += kProtocolVersion2Line;
+  }
+  UINT32 config_size = static_cast<UINT32>(config_string.size());
+  MessageHeader req;
+  FillRequestProtocol(kConfigure, config_size, &req);
   RasPiStatus send_result = kError;
   if (Send(reinterpret_cast<char*>(&req), sizeof(req)) == kOK)
-    if (Send(config_string.c_str(), file_size.LowPart) == kOK)
+    if (Send(config_string.c_str(), config_size) == kOK)
       send_result = kOK;
   if (CloseHandle(config_file) == 0) {
     fprintf(stderr, kErrorMessage, "CloseHandle", GetLastError());
@@ -132,16 +167,52 @@ RasPiCamera::RasPiStatus RasPiCamera::Configure() {
 }
 
 void RasPiCamera::FillRequestProtocol(UINT32 header, UINT32 data_length,
-                                      RequestProtocol* req) {
+                                      MessageHeader* req) {
   req->header = htonl(header);
-  req->data_length = htonl(data_length);
+  req->length = htonl(data_length);
 }
 
-void RasPiCamera::AnalyzeReceiveProtocol(ReceiveProtocol* recv) {
+void RasPiCamera::AnalyzeReceiveProtocol(MessageHeader* recv) {
   UINT32 header = recv->header;
-  UINT32 image_size = recv->image_size;
+  UINT32 length = recv->length;
   recv->header = ntohl(header);
-  recv->image_size = ntohl(image_size);
+  recv->length = ntohl(length);
+}
+
+void RasPiCamera::AnalyzeFrameInfo(FrameInfo* info) {
+  info->version = ntohs(info->version);
+  info->header_size = ntohs(info->header_size);
+  // ntohll needs Windows 8, so 64-bit fields are swapped by NetworkToHost64.
+  info->sequence = NetworkToHost64(info->sequence);
+  info->capture_time = NetworkToHost64(info->capture_time);
+}
+
+RasPiCamera::RasPiStatus RasPiCamera::ReceiveFrameInfo(FrameInfo* info) {
+  if (Recv(reinterpret_cast<char*>(info), sizeof(*info)) != kOK)
+    return kError;
+  AnalyzeFrameInfo(info);
+  int header_size = sizeof(MessageHeader) + sizeof(FrameInfo);
+  if (info->version < 2 || info->header_size < header_size ||
+      info->header_size > kMaxFrameHeaderSize) {
+    fprintf_s(stderr, "Bad frame header version %u of %u bytes.\n",
+              info->version, info->header_size);
+    status_ = kError;
+    return kError;
+  }
+  char extension[kMaxFrameHeaderSize];
+  if (info->header_size > header_size)
+    return Recv(extension, info->header_size - header_size);
+  return kOK;
+}
+
+LONGLONG RasPiCamera::GetUnixTime() {
+  FILETIME now;
+  GetSystemTimeAsFileTime(&now);
+  ULARGE_INTEGER ticks;
+  ticks.LowPart = now.dwLowDateTime;
+  ticks.HighPart = now.dwHighDateTime;
+  // FILETIME counts 100 ns from 1601-01-01, 11644473600 s before 1970.
+  return static_cast<LONGLONG>(ticks.QuadPart / 10) - 11644473600000000LL;
 }
 
 RasPiCamera::RasPiStatus RasPiCamera::Read(HANDLE config_file,
@@ -191,88 +262,345 @@ RasPiCamera::RasPiStatus RasPiCamera::Send(const char* buf, int len) {
 RasPiCamera::RasPiStatus RasPiCamera::Recv(char* buf, int len) {
   if (debug_)
     std::cerr << "Recv(" << static_cast<void*>(buf) << ", " << len << ")\n";
-  int recv_result;
-  int timedout = 0;
-  do {
-    if (debug_)
-      std::cerr << "recv(" << socket_ << ", " << static_cast<void*>(buf)
-          << ", " << len << ", " << 0 << ")\n";
-    recv_result = recv(socket_, buf, len, 0);
-    if (debug_)
-      std::cerr << "recv_result = " << recv_result << "\n";
-    if (recv_result == SOCKET_ERROR) {
-      int error = WSAGetLastError();
-      if (error == WSAETIMEDOUT) {
-        fputs("recv timeout keep occured.\n", stderr);
-      } else {
-        fprintf_s(stderr, kErrorMessage, "recv", error);
-      }
-      status_ = kError;
+  int copied = receive_ring_.Read(buf, len);
+  buf += copied;
+  len -= copied;
+  // Large parts skip the extra copy through the ring.
+  while (len >= receive_ring_.get_capacity()) {
+    int received;
+    if (RecvSome(buf, len, &received) != kOK)
       return kError;
-    } else if (recv_result == 0) {
-      fputs("Connection closed by peer.\n", stderr);
+    buf += received;
+    len -= received;
+  }
+  if (len == 0)
+    return kOK;
+  if (Fill(len) != kOK)
+    return kError;
+  receive_ring_.Read(buf, len);
+  return kOK;
+}
+
+RasPiCamera::RasPiStatus RasPiCamera::Fill(int len) {
+  while (receive_ring_.get_size() < len) {
+    int free_size;
+    char* free_space = receive_ring_.GetFreeSpace(&free_size);
+    if (free_space == NULL) {
+      fputs("Failed to allocate the receive buffer.\n", stderr);
       status_ = kError;
       return kError;
     }
-    len -= recv_result;
-    buf += recv_result;
-  } while (len > 0);
+    int received;
+    if (RecvSome(free_space, free_size, &received) != kOK)
+      return kError;
+    receive_ring_.Commit(received);
+  }
+  return kOK;
+}
+
+RasPiCamera::RasPiStatus RasPiCamera::RecvSome(char* buf, int len,
+                                               int* received) {
+  if (debug_)
+    std::cerr << "recv(" << socket_ << ", " << static_cast<void*>(buf)
+        << ", " << len << ", " << 0 << ")\n";
+  int recv_result = recv(socket_, buf, len, 0);
+  if (debug_)
+    std::cerr << "recv_result = " << recv_result << "\n";
+  InterlockedIncrement64(&recv_calls_);
+  if (recv_result == SOCKET_ERROR) {
+    int error = WSAGetLastError();
+    if (error == WSAETIMEDOUT) {
+      fputs("recv timeout keep occured.\n", stderr);
+    } else {
+      fprintf_s(stderr, kErrorMessage, "recv", error);
+    }
+    status_ = kError;
+    return kError;
+  } else if (recv_result == 0) {
+    fputs("Connection closed by peer.\n", stderr);
+    status_ = kError;
+    return kError;
+  }
+  InterlockedExchangeAdd64(&bytes_received_, recv_result);
+  *received = recv_result;
   return kOK;
 }
 
-void RasPiCamera::ReleaseImage(int index) {
+void RasPiCamera::PublishImage() {
   if (debug_)
-    std::cerr << "ReleaseImage(" << index << ")\n";
-  if (images_[index] != NULL)
-    cvReleaseMat(&images_[index]);
+    std::cerr << "PublishImage(" << fill_slot_ << ")\n";
+  // The exchange is a full memory barrier, so the image and its sequence
+  // number are completely written before the consumer can take the slot.
+  LONGLONG sequence = frame_pool_.get_sequence(fill_slot_);
+  LONG previous = InterlockedExchange(&shared_slot_, fill_slot_ | kFreshSlot);
+  fill_slot_ = previous & kSlotIndexMask;
+  if (previous & kFreshSlot)
+    InterlockedIncrement64(&frames_overwritten_);
+  InterlockedExchange64(&ready_sequence_, sequence);
+  WakeWaiters();
 }
 
-RasPiCamera::RasPiStatus
-RasPiCamera::SetImageStatus(int index, ImageStatus status) {
+int RasPiCamera::AcquireFreshestImage() {
   if (debug_)
-    std::cerr << "SetImageStatus(" << index << ", " << status << ")\n";
-  if (index < 0 || index >= kNumberOfImageSlots)
-    return kIndexOutOfBounds;
-  EnterCriticalSection(&critical_section_);
-  image_status_[index] = status;
-  LeaveCriticalSection(&critical_section_);
-  return kOK;
+    std::cerr << "AcquireFreshestImage()\n";
+  // Only image_thread_ can set kFreshSlot, and only the consumer clears it,
+  // so a stale read merely delays the swap until the next call.
+  if (shared_slot_ & kFreshSlot) {
+    LONG previous = InterlockedExchange(&shared_slot_, use_slot_);
+    use_slot_ = previous & kSlotIndexMask;
+  }
+  return use_slot_;
+}
+
+void RasPiCamera::DecodeFreshestImage() {
+  int index = AcquireFreshestImage();
+  CvMat* matrix = frame_pool_.Get(index);
+  // No images are ready yet.
+  if (matrix == NULL)
+    return;
+  LONGLONG sequence = frame_pool_.get_sequence(index);
+  if (cached_frame_ != NULL && cached_frame_->get_sequence() == sequence)
+    return;
+  if (sequence == failed_sequence_)
+    return;
+  // Decode the image matrix. image_thread_ cannot touch use_slot_, so the
+  // matrix stays valid during the decoding process.
+  RasPiFrame* frame = Decode(matrix, sequence);
+  if (frame == NULL) {
+    failed_sequence_ = sequence;
+    return;
+  }
+  frame->set_capture_time(frame_pool_.get_capture_time(index));
+  if (cached_frame_ != NULL)
+    cached_frame_->Release();
+  cached_frame_ = frame;
+  cached_frame_read_ = false;
 }
 
-int RasPiCamera::FindImageToFill() {
+RasPiFrame* RasPiCamera::Decode(const CvMat* matrix, LONGLONG sequence) {
+  LONGLONG start = LatencyHistogram::GetTicks();
+  RasPiFrame* frame = DecodeFrame(matrix, decode_scale_, decode_ycbcr_,
+                                  sequence);
+  decode_latency_.AddSince(start);
+  if (frame == NULL)
+    InterlockedIncrement64(&decode_failures_);
+  return frame;
+}
+
+void RasPiCamera::PublishFrame(RasPiFrame* frame) {
   if (debug_)
-    std::cerr << "FindImageToFill()\n";
-  int index;
-  EnterCriticalSection(&critical_section_);
-  // Look for a free slot and mark it as busy.
-  for (index = 0; index < kNumberOfImageSlots; ++index) {
-    if (index == image_to_use_)
-      continue;
-    if (image_status_[index] == kFree) {
-      image_status_[index] = kBusy;
+    std::cerr << "PublishFrame(" << frame->get_sequence() << ")\n";
+  EnterCriticalSection(&decode_lock_);
+  // Decode threads may finish out of order. Never go back to an older frame.
+  if (cached_frame_ != NULL &&
+      cached_frame_->get_sequence() > frame->get_sequence()) {
+    LeaveCriticalSection(&decode_lock_);
+    frame->Release();
+    InterlockedIncrement64(&frames_overwritten_);
+    return;
+  }
+  if (cached_frame_ != NULL) {
+    if (!cached_frame_read_)
+      InterlockedIncrement64(&frames_overwritten_);
+    cached_frame_->Release();
+  }
+  cached_frame_ = frame;
+  cached_frame_read_ = false;
+  InterlockedExchange64(&ready_sequence_, frame->get_sequence());
+  LeaveCriticalSection(&decode_lock_);
+  WakeWaiters();
+}
+
+int RasPiCamera::AcquireDecodeBuffer() {
+  EnterCriticalSection(&decode_queue_lock_);
+  // There are decode_thread_count_ + 2 buffers. At most one per decode
+  // thread plus pending_decode_ can be in use, so one is always free.
+  int index = free_buffers_[--free_buffer_count_];
+  LeaveCriticalSection(&decode_queue_lock_);
+  return index;
+}
+
+void RasPiCamera::QueueDecode(int index) {
+  EnterCriticalSection(&decode_queue_lock_);
+  if (pending_decode_ != kNone) {
+    if (debug_)
+      std::cerr << "Dropping undecoded frame "
+          << frame_pool_.get_sequence(pending_decode_) << "\n";
+    free_buffers_[free_buffer_count_++] = pending_decode_;
+    InterlockedIncrement64(&frames_overwritten_);
+  }
+  pending_decode_ = index;
+  LeaveCriticalSection(&decode_queue_lock_);
+  WakeConditionVariable(&decode_ready_);
+}
+
+DWORD RasPiCamera::DecodeLoop(LPVOID lpParam) {
+  RasPiCamera* rpic = static_cast<RasPiCamera*>(lpParam);
+  if (rpic->debug_)
+    std::cerr << "DecodeLoop(" << lpParam << ")\n";
+  EnterCriticalSection(&rpic->decode_queue_lock_);
+  while (TRUE) {
+    while (rpic->pending_decode_ == kNone && !rpic->decode_stopping_)
+      SleepConditionVariableCS(&rpic->decode_ready_,
+                               &rpic->decode_queue_lock_, INFINITE);
+    if (rpic->decode_stopping_)
       break;
+    int index = rpic->pending_decode_;
+    rpic->pending_decode_ = kNone;
+    LeaveCriticalSection(&rpic->decode_queue_lock_);
+    // The buffer belongs to this thread until it is put back on the free
+    // list, so it is decoded without holding any lock.
+    LONGLONG sequence = rpic->frame_pool_.get_sequence(index);
+    RasPiFrame* frame = rpic->Decode(rpic->frame_pool_.Get(index), sequence);
+    if (frame != NULL)
+      frame->set_capture_time(rpic->frame_pool_.get_capture_time(index));
+    else
+      rpic->MarkTaken(sequence);
+    EnterCriticalSection(&rpic->decode_queue_lock_);
+    rpic->free_buffers_[rpic->free_buffer_count_++] = index;
+    if (frame != NULL) {
+      LeaveCriticalSection(&rpic->decode_queue_lock_);
+      rpic->PublishFrame(frame);
+      EnterCriticalSection(&rpic->decode_queue_lock_);
     }
   }
-  LeaveCriticalSection(&critical_section_);
-  return index;
+  LeaveCriticalSection(&rpic->decode_queue_lock_);
+  return TRUE;
+}
+
+void RasPiCamera::WakeWaiters() {
+  // Full barrier so that a waiter either sees the new sequence number or
+  // status, or is counted in waiters_ before we read it.
+  MemoryBarrier();
+  if (waiters_ == 0)
+    return;
+  // Taking the lock waits until the waiter is actually asleep.
+  AcquireSRWLockExclusive(&wait_lock_);
+  ReleaseSRWLockExclusive(&wait_lock_);
+  WakeAllConditionVariable(&frame_ready_);
+}
+
+void RasPiCamera::MarkTaken(LONGLONG sequence) {
+  if (playback_ == NULL)
+    return;
+  AcquireSRWLockExclusive(&wait_lock_);
+  if (sequence > taken_sequence_)
+    taken_sequence_ = sequence;
+  ReleaseSRWLockExclusive(&wait_lock_);
+  WakeAllConditionVariable(&frame_taken_);
+}
+
+bool RasPiCamera::WaitUntilTaken(LONGLONG sequence) {
+  AcquireSRWLockExclusive(&wait_lock_);
+  // The timeout notices the destructor changing status_.
+  while (status_ == kOK && taken_sequence_ < sequence)
+    SleepConditionVariableSRW(&frame_taken_, &wait_lock_, kMaxPlaybackSleep,
+                              0);
+  bool taken = taken_sequence_ >= sequence;
+  ReleaseSRWLockExclusive(&wait_lock_);
+  return taken;
 }
 
-void RasPiCamera::SetImageToUse(int index) {
+DWORD RasPiCamera::ImageThread(LPVOID lpParam) {
+  RasPiCamera* rpic = static_cast<RasPiCamera*>(lpParam);
+  DWORD result = ImageLoop(lpParam);
+  rpic->WakeWaiters();
+  return result;
+}
+
+RasPiCamera::RasPiStatus RasPiCamera::ReceiveFrame(int index) {
+  MessageHeader rec;
+  RasPiStatus recv_result = Recv(reinterpret_cast<char*>(&rec), sizeof(rec));
+  if (recv_result != kOK) return kError;
+  AnalyzeReceiveProtocol(&rec);
+  FrameInfo info;
+  info.capture_time = 0;
+  if (rec.header == kReceiveImageV2) {
+    if (ReceiveFrameInfo(&info) != kOK) return kError;
+  } else if (rec.header != kReceiveImage) {
+    status_ = kError;
+    return kError;
+  }
+  UINT32 length = rec.length;
   if (debug_)
-    std::cerr << "SetImageToUse(" << index << ")\n";
-  EnterCriticalSection(&critical_section_);
-  // Mark the status of index as free.
-  image_status_[index] = kFree;
-  // Set the image_to_use_ to be index.
-  image_to_use_ = index;
-  LeaveCriticalSection(&critical_section_);
+    std::cerr << "image_size = " << length << "\n";
+  if (length == 0)
+    return kEnd;
+  CvMat* image_to_fill = frame_pool_.Reserve(index, length);
+  if (image_to_fill == NULL) {
+    if (length > frame_pool_.get_max_frame_size())
+      fprintf_s(stderr, "Frame of %u bytes exceeds the maximum of %u.\n",
+                length, frame_pool_.get_max_frame_size());
+    else
+      fputs("Failed to allocate the frame buffer.\n", stderr);
+    status_ = kError;
+    return kError;
+  }
+  if (Recv(reinterpret_cast<char*>(image_to_fill->data.ptr), length) != kOK)
+    return kError;
+  LONGLONG capture_time = static_cast<LONGLONG>(info.capture_time);
+  frame_pool_.set_capture_time(index, capture_time);
+  if (rec.header == kReceiveImageV2) {
+    if (sender_sequence_ != 0 && info.sequence > sender_sequence_ + 1)
+      InterlockedExchangeAdd64(
+          &sender_skipped_frames_,
+          static_cast<LONGLONG>(info.sequence - sender_sequence_ - 1));
+    sender_sequence_ = info.sequence;
+    capture_latency_.Add(GetUnixTime() - capture_time);
+  }
+  return kOK;
+}
+
+RasPiCamera::RasPiStatus RasPiCamera::PlayFrame(int index) {
+  // The sequence number of the previous frame is playback_index_. Ending
+  // before the last frame is taken would keep GetNextImage from returning it.
+  if (playback_index_ == playback_->get_frame_count()) {
+    WaitUntilTaken(playback_index_);
+    return kEnd;
+  }
+  if (!playback_paced_ && !WaitUntilTaken(playback_index_))
+    return kEnd;
+  const RecordedFrame& recorded = playback_->get_frame(playback_index_);
+  LARGE_INTEGER ticks, frequency;
+  QueryPerformanceCounter(&ticks);
+  QueryPerformanceFrequency(&frequency);
+  if (playback_index_ == 0)
+    playback_start_ = ticks.QuadPart;
+  if (playback_paced_) {
+    // Microseconds of the recording the frame comes after the first one.
+    LONGLONG offset = recorded.timestamp - playback_->get_frame(0).timestamp;
+    while (status_ == kOK) {
+      LONGLONG elapsed = (ticks.QuadPart - playback_start_) * 1000000 /
+                         frequency.QuadPart;
+      if (elapsed >= offset)
+        break;
+      Sleep(static_cast<DWORD>(MIN((offset - elapsed) / 1000 + 1,
+                                   kMaxPlaybackSleep)));
+      QueryPerformanceCounter(&ticks);
+    }
+    if (status_ != kOK)
+      return kEnd;
+  }
+  CvMat* image_to_fill = frame_pool_.Reserve(index, recorded.size);
+  if (image_to_fill == NULL) {
+    fprintf_s(stderr, "Recorded frame %lld of %u bytes cannot be played.\n",
+              recorded.sequence, recorded.size);
+    status_ = kError;
+    return kError;
+  }
+  CvMat data;
+  playback_->GetFrameData(playback_index_, &data);
+  memcpy(image_to_fill->data.ptr, data.data.ptr, recorded.size);
+  frame_pool_.set_capture_time(index, 0);
+  ++playback_index_;
+  return kOK;
 }
 
 DWORD RasPiCamera::ImageLoop(LPVOID lpParam) {
   RasPiCamera* rpic = static_cast<RasPiCamera*>(lpParam);
   if (rpic->debug_)
     std::cerr << "ImageLoop(" << lpParam << ")\n";
-  int index_to_fill = kNone;
+  LONGLONG sequence = 0;
   while (rpic->status_ != kError) {
     // Check whether the object is in destruction.
     if (rpic->status_ == kEnd) {
@@ -280,65 +608,163 @@ DWORD RasPiCamera::ImageLoop(LPVOID lpParam) {
         std::cerr << "Status set to kEnd. Exiting loop.\n";
       break;
     }
-    index_to_fill = rpic->FindImageToFill();
-    if (index_to_fill < 0 || index_to_fill > 2) {
-      rpic->status_ = kIndexOutOfBounds;
-      return FALSE;
-    }
+    // The buffer is owned by this thread, so nobody can be decoding the
+    // buffer overwritten here.
+    int index_to_fill = rpic->decode_thread_count_ > 0 ?
+        rpic->AcquireDecodeBuffer() : rpic->fill_slot_;
     if (rpic->debug_)
       std::cerr << "index_to_fill = " << index_to_fill << "\n";
-    rpic->ReleaseImage(index_to_fill);
-    ReceiveProtocol rec;
-    RasPiStatus recv_result = rpic->Recv(reinterpret_cast<char*>(&rec),
-                                         sizeof(rec));
-    if (recv_result != kOK) return FALSE;
-    rpic->AnalyzeReceiveProtocol(&rec);
-    if (rec.header != rpic->kReceiveImage) {
-      rpic->status_ = kError;
-      return FALSE;
-    }
-    UINT32 length = rec.image_size;
-    if (rpic->debug_)
-      std::cerr << "image_size = " << length << "\n";
-    if (length == 0) {
+    LONGLONG receive_start = LatencyHistogram::GetTicks();
+    RasPiStatus frame_result = rpic->playback_ != NULL ?
+        rpic->PlayFrame(index_to_fill) : rpic->ReceiveFrame(index_to_fill);
+    if (frame_result == kEnd) {
       rpic->status_ = kEnd;
       return kEnd;
     }
-    CvMat* image_to_fill = cvCreateMat(1, length, CV_8UC1);
-    recv_result = rpic->Recv(reinterpret_cast<char*>(image_to_fill->data.ptr),
-                             length);
-    if (recv_result != kOK) return FALSE;
-    rpic->images_[index_to_fill] = image_to_fill;
-    rpic->SetImageToUse(index_to_fill);
+    if (frame_result != kOK) return FALSE;
+    rpic->receive_latency_.AddSince(receive_start);
+    InterlockedIncrement64(&rpic->frames_received_);
+    rpic->frame_pool_.set_sequence(index_to_fill, ++sequence);
+    // Only copies the frame. The file is written by the recorder's thread.
+    if (rpic->recorder_ != NULL)
+      rpic->recorder_->Append(rpic->frame_pool_.Get(index_to_fill), sequence);
+    InterlockedExchange64(&rpic->latest_sequence_, sequence);
+    if (rpic->decode_thread_count_ > 0)
+      rpic->QueueDecode(index_to_fill);
+    else
+      rpic->PublishImage();
   }
   return TRUE;
 }
 
-RasPiCamera::RasPiCamera(const char* address, const char* port, bool debug) {
+RasPiCamera::Options::Options() {
+  max_frame_size = kDefaultMaxFrameSize;
+  decode_threads = 0;
+  decode_scale = 1;
+  decode_ycbcr = false;
+  record_file = NULL;
+  playback_file = NULL;
+  playback_paced = true;
+  protocol_version = kProtocolVersion;
+  receive_buffer_size = ReceiveRing::kDefaultCapacity;
+  socket_receive_buffer = 0;
+  collapse_steering = false;
+}
+
+RasPiCamera::RasPiCamera(const char* address, const char* port, bool debug,
+                         const Options& options)
+    : frame_pool_(options.decode_threads > 0 ? options.decode_threads + 2 :
+                                               kNumberOfImageSlots,
+                  options.max_frame_size),
+      receive_ring_(options.receive_buffer_size) {
   strncpy_s(address_, address, sizeof(address_) / sizeof(address_[0]));
   strncpy_s(port_, port, sizeof(port_) / sizeof(port_[0]));
   debug_ = debug;
   status_ = kOK;
-  if (Connect() != kOK) return;
-  if (Configure() != kOK) return;
-  // Initiallize images_, image_status_, and image_to_use_.
-  for (int index = 0; index < kNumberOfImageSlots; ++index) {
-    images_[index] = NULL;
-    image_status_[index] = kFree;
-  }
-  image_to_use_ = kNone;
-  if (!InitializeCriticalSectionAndSpinCount(&critical_section_, 0)) {
-    status_ = kError;
-    fprintf_s(stderr, kErrorMessage, "InitializeCriticalSectionAndSpinCount",
-            GetLastError());
-    return;
+  image_thread_ = NULL;
+  // Initiallize the triple buffer slots.
+  fill_slot_ = 0;
+  shared_slot_ = 1;
+  use_slot_ = 2;
+  latest_sequence_ = 0;
+  ready_sequence_ = 0;
+  cached_frame_ = NULL;
+  cached_frame_read_ = false;
+  failed_sequence_ = 0;
+  bytes_received_ = 0;
+  recv_calls_ = 0;
+  frames_received_ = 0;
+  frames_overwritten_ = 0;
+  decode_failures_ = 0;
+  sender_skipped_frames_ = 0;
+  requests_queued_ = 0;
+  requests_collapsed_ = 0;
+  requests_dropped_ = 0;
+  request_batches_ = 0;
+  InitializeCriticalSection(&decode_lock_);
+  waiters_ = 0;
+  InitializeSRWLock(&wait_lock_);
+  InitializeConditionVariable(&frame_ready_);
+  taken_sequence_ = 0;
+  InitializeConditionVariable(&frame_taken_);
+  decode_scale_ = options.decode_scale;
+  if (decode_scale_ != 2 && decode_scale_ != 4 && decode_scale_ != 8)
+    decode_scale_ = 1;
+  decode_ycbcr_ = options.decode_ycbcr;
+  // Initialize the decode queue. Every buffer starts free.
+  decode_thread_count_ = MAX(options.decode_threads, 0);
+  decode_threads_ = NULL;
+  InitializeCriticalSection(&decode_queue_lock_);
+  InitializeConditionVariable(&decode_ready_);
+  free_buffer_count_ = frame_pool_.get_count();
+  free_buffers_ = new int[free_buffer_count_];
+  for (int index = 0; index < free_buffer_count_; ++index)
+    free_buffers_[index] = index;
+  pending_decode_ = kNone;
+  decode_stopping_ = false;
+  socket_ = INVALID_SOCKET;
+  send_thread_ = NULL;
+  InitializeCriticalSection(&send_lock_);
+  InitializeConditionVariable(&send_ready_);
+  send_queue_ticks_ = 0;
+  queued_steering_ = std::string::npos;
+  collapse_steering_ = options.collapse_steering;
+  send_stopping_ = false;
+  recorder_ = NULL;
+  playback_ = NULL;
+  playback_paced_ = options.playback_paced;
+  playback_index_ = 0;
+  playback_start_ = 0;
+  protocol_version_ = options.protocol_version;
+  socket_receive_buffer_ = options.socket_receive_buffer;
+  sender_sequence_ = 0;
+  if (options.playback_file != NULL) {
+    playback_ = new Recording(options.playback_file);
+    if (!playback_->is_open()) {
+      status_ = kError;
+      return;
+    }
+  } else {
+    if (Connect() != kOK) return;
+    if (Configure() != kOK) return;
+    // From now on only send_thread_ writes to the socket.
+    send_thread_ = CreateThread(
+        NULL, 0, (LPTHREAD_START_ROUTINE)SendLoop, this, 0, NULL);
+    if (send_thread_ == NULL) {
+      fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+      status_ = kError;
+      return;
+    }
+  }
+  if (options.record_file != NULL) {
+    recorder_ = new FrameRecorder(options.record_file,
+                                  FrameRecorder::kDefaultMaxPendingBytes);
+    if (!recorder_->is_open()) {
+      status_ = kError;
+      return;
+    }
+  }
+  // Start decoding images.
+  if (decode_thread_count_ > 0) {
+    decode_threads_ = new HANDLE[decode_thread_count_];
+    for (int index = 0; index < decode_thread_count_; ++index) {
+      decode_threads_[index] = CreateThread(
+          NULL, 0, (LPTHREAD_START_ROUTINE)DecodeLoop, this, 0, NULL);
+      if (decode_threads_[index] == NULL) {
+        fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+        // Only the threads created so far are waited for.
+        decode_thread_count_ = index;
+        status_ = kError;
+        return;
+      }
+    }
   }
   // Start receiving images.
   DWORD thread_id;
   image_thread_ = CreateThread(
     NULL,         // default security attirubtes
     0,            // default stack size
-    (LPTHREAD_START_ROUTINE)ImageLoop,
+    (LPTHREAD_START_ROUTINE)ImageThread,
     this,
     0,            // default creation flags
     &thread_id);  // receive thread identifier
@@ -352,45 +778,269 @@ RasPiCamera::RasPiCamera(const char* address, const char* port, bool debug) {
 
 RasPiCamera::~RasPiCamera() {
   status_ = kEnd;   // terminate the loop running on image_thread_
-  if (debug_)
-    std::cerr << "WaitingForSingleObject(image_thread_, INFINITE)\n";
-  WaitForSingleObject(image_thread_, INFINITE);
-  if (debug_)
-    std::cerr << "CloseHandle(image_thread_)\n";
-  CloseHandle(image_thread_);
-  DeleteCriticalSection(&critical_section_);
-  closesocket(socket_);
-  WSACleanup();
-  for (int index = 0; index < kNumberOfImageSlots; ++index)
-    ReleaseImage(index);
+  if (send_thread_ != NULL) {
+    EnterCriticalSection(&send_lock_);
+    send_stopping_ = true;
+    LeaveCriticalSection(&send_lock_);
+    WakeConditionVariable(&send_ready_);
+    WaitForSingleObject(send_thread_, INFINITE);
+    CloseHandle(send_thread_);
+  }
+  if (image_thread_ != NULL) {
+    if (debug_)
+      std::cerr << "WaitingForSingleObject(image_thread_, INFINITE)\n";
+    WaitForSingleObject(image_thread_, INFINITE);
+    if (debug_)
+      std::cerr << "CloseHandle(image_thread_)\n";
+    CloseHandle(image_thread_);
+  }
+  if (decode_threads_ != NULL) {
+    EnterCriticalSection(&decode_queue_lock_);
+    decode_stopping_ = true;
+    LeaveCriticalSection(&decode_queue_lock_);
+    WakeAllConditionVariable(&decode_ready_);
+    for (int index = 0; index < decode_thread_count_; ++index) {
+      WaitForSingleObject(decode_threads_[index], INFINITE);
+      CloseHandle(decode_threads_[index]);
+    }
+    delete[] decode_threads_;
+  }
+  if (playback_ == NULL) {
+    closesocket(socket_);
+    WSACleanup();
+  }
+  // Written after image_thread_ has ended, so no frame is appended anymore.
+  delete recorder_;
+  delete playback_;
+  if (cached_frame_ != NULL)
+    cached_frame_->Release();
+  delete[] free_buffers_;
+  DeleteCriticalSection(&send_lock_);
+  DeleteCriticalSection(&decode_queue_lock_);
+  DeleteCriticalSection(&decode_lock_);
 }
 
 RasPiCamera::RasPiStatus RasPiCamera::RequestSerial(const char* data, int len) {
   if (debug_)
     std::cerr << "RequestSerial(" << *data << "P, " << len << ")\n";
-  RequestProtocol req;
-  FillRequestProtocol(kRequestSerial, len, &req);
-  RasPiStatus send_result = Send(reinterpret_cast<char*>(&req), sizeof(req));
-  if (send_result != kOK)
-    return send_result;
-  return Send(data, len);
+  if (playback_ != NULL)
+    return kOK;
+  if (status_ != kOK)
+    return kError;
+  bool steering = collapse_steering_ && IsSteeringRequest(data, len);
+  RasPiStatus result = kOK;
+  EnterCriticalSection(&send_lock_);
+  if (steering && queued_steering_ != std::string::npos) {
+    // The previous direction has not left yet. The new one takes its place.
+    send_queue_[queued_steering_] = data[0];
+    InterlockedIncrement64(&requests_collapsed_);
+  } else if (send_queue_.size() + sizeof(MessageHeader) + len >
+             kMaxPendingRequests) {
+    InterlockedIncrement64(&requests_dropped_);
+    result = kError;
+  } else {
+    if (send_queue_.empty())
+      send_queue_ticks_ = LatencyHistogram::GetTicks();
+    // Header and data leave in the same send.
+    MessageHeader req;
+    FillRequestProtocol(kRequestSerial, len, &req);
+    send_queue_.append(reinterpret_cast<char*>(&req), sizeof(req));
+    queued_steering_ = steering ? send_queue_.size() : std::string::npos;
+    send_queue_.append(data, len);
+  }
+  LeaveCriticalSection(&send_lock_);
+  if (result != kOK)
+    return result;
+  InterlockedIncrement64(&requests_queued_);
+  WakeConditionVariable(&send_ready_);
+  return kOK;
+}
+
+DWORD RasPiCamera::SendLoop(LPVOID lpParam) {
+  RasPiCamera* rpic = static_cast<RasPiCamera*>(lpParam);
+  // Swapped with send_queue_, so both keep their capacity.
+  std::string batch;
+  EnterCriticalSection(&rpic->send_lock_);
+  while (TRUE) {
+    while (!rpic->send_stopping_ && rpic->send_queue_.empty())
+      SleepConditionVariableCS(&rpic->send_ready_, &rpic->send_lock_,
+                               INFINITE);
+    if (rpic->send_stopping_)
+      break;
+    batch.swap(rpic->send_queue_);
+    LONGLONG queued_ticks = rpic->send_queue_ticks_;
+    rpic->queued_steering_ = std::string::npos;
+    LeaveCriticalSection(&rpic->send_lock_);
+    RasPiStatus result =
+        rpic->Send(batch.data(), static_cast<int>(batch.size()));
+    InterlockedIncrement64(&rpic->request_batches_);
+    if (result != kOK) {
+      // Send has set the status. Consumers waiting for frames learn it now.
+      rpic->WakeWaiters();
+      return FALSE;
+    }
+    rpic->request_latency_.AddSince(queued_ticks);
+    batch.clear();
+    EnterCriticalSection(&rpic->send_lock_);
+  }
+  LeaveCriticalSection(&rpic->send_lock_);
+  return TRUE;
+}
+
+bool RasPiCamera::IsSteeringRequest(const char* data, int len) {
+  if (len != 1)
+    return false;
+  switch (data[0]) {
+    case 'a':
+    case 'b':
+    case 'd':
+    case 'f':
+      return true;
+    default:
+      return false;
+  }
+}
+
+RasPiFrame* RasPiCamera::GetFrame(void) {
+  if (debug_)
+    std::cerr << "GetFrame()\n";
+  EnterCriticalSection(&decode_lock_);
+  if (decode_thread_count_ == 0)
+    DecodeFreshestImage();
+  RasPiFrame* frame = cached_frame_;
+  if (frame != NULL) {
+    frame->AddRef();
+    cached_frame_read_ = true;
+  }
+  LONGLONG taken = failed_sequence_;
+  LeaveCriticalSection(&decode_lock_);
+  if (frame != NULL)
+    taken = MAX(taken, frame->get_sequence());
+  MarkTaken(taken);
+  return frame;
+}
+
+void RasPiCamera::GetMetrics(Metrics* metrics) {
+  // A plain 64-bit read is not atomic on 32-bit targets.
+  metrics->bytes_received = InterlockedCompareExchange64(&bytes_received_,
+                                                         0, 0);
+  metrics->recv_calls = InterlockedCompareExchange64(&recv_calls_, 0, 0);
+  metrics->frames_received = InterlockedCompareExchange64(&frames_received_,
+                                                          0, 0);
+  metrics->frames_overwritten = InterlockedCompareExchange64(
+      &frames_overwritten_, 0, 0);
+  metrics->decode_failures = InterlockedCompareExchange64(&decode_failures_,
+                                                          0, 0);
+  metrics->sender_skipped_frames = InterlockedCompareExchange64(
+      &sender_skipped_frames_, 0, 0);
+  metrics->requests_queued = InterlockedCompareExchange64(&requests_queued_,
+                                                          0, 0);
+  metrics->requests_collapsed = InterlockedCompareExchange64(
+      &requests_collapsed_, 0, 0);
+  metrics->requests_dropped = InterlockedCompareExchange64(&requests_dropped_,
+                                                           0, 0);
+  metrics->request_batches = InterlockedCompareExchange64(&request_batches_,
+                                                          0, 0);
+  receive_latency_.GetSnapshot(&metrics->receive_latency);
+  decode_latency_.GetSnapshot(&metrics->decode_latency);
+  capture_latency_.GetSnapshot(&metrics->capture_latency);
+  decision_latency_.GetSnapshot(&metrics->decision_latency);
+  request_latency_.GetSnapshot(&metrics->request_latency);
+}
+
+void RasPiCamera::ReportDecision(RasPiFrame* frame) {
+  if (frame->get_capture_time() != 0)
+    decision_latency_.Add(GetUnixTime() - frame->get_capture_time());
+}
+
+void RasPiCamera::WriteMetrics(void* context, FILE* file) {
+  Metrics metrics;
+  static_cast<RasPiCamera*>(context)->GetMetrics(&metrics);
+  fprintf(file, "camera.bytes_received %lld\n", metrics.bytes_received);
+  fprintf(file, "camera.recv_calls %lld\n", metrics.recv_calls);
+  fprintf(file, "camera.frames_received %lld\n", metrics.frames_received);
+  fprintf(file, "camera.frames_overwritten %lld\n",
+          metrics.frames_overwritten);
+  fprintf(file, "camera.decode_failures %lld\n", metrics.decode_failures);
+  fprintf(file, "camera.sender_skipped_frames %lld\n",
+          metrics.sender_skipped_frames);
+  fprintf(file, "camera.requests_queued %lld\n", metrics.requests_queued);
+  fprintf(file, "camera.requests_collapsed %lld\n",
+          metrics.requests_collapsed);
+  fprintf(file, "camera.requests_dropped %lld\n", metrics.requests_dropped);
+  fprintf(file, "camera.request_batches %lld\n", metrics.request_batches);
+  WriteHistogram(file, "camera.receive", metrics.receive_latency);
+  WriteHistogram(file, "camera.decode", metrics.decode_latency);
+  WriteHistogram(file, "camera.capture", metrics.capture_latency);
+  WriteHistogram(file, "camera.decision", metrics.decision_latency);
+  WriteHistogram(file, "camera.request", metrics.request_latency);
 }
 
 IplImage* RasPiCamera::GetImage(void) {
   if (debug_)
     std::cerr << "GetImage()\n";
-  int index;
-  EnterCriticalSection(&critical_section_);
-  index = image_to_use_;
-  // Mark as busy during the decoding process.
-  if (index != kNone)
-    image_status_[index] = kBusy;
-  LeaveCriticalSection(&critical_section_);
+  RasPiFrame* frame = GetFrame();
   // No images are ready yet.
-  if (index == kNone)
+  if (frame == NULL)
     return NULL;
-  // Decode the image matrix.
-  IplImage* image = cvDecodeImage(images_[index], 1);
-  SetImageStatus(index, kFree);
+  IplImage* image = cvCloneImage(frame->get_image());
+  frame->Release();
   return image;
 }
+
+LONGLONG RasPiCamera::GetSequence(void) {
+  // A plain 64-bit read is not atomic on 32-bit targets.
+  return InterlockedCompareExchange64(&latest_sequence_, 0, 0);
+}
+
+RasPiFrame* RasPiCamera::GetNextImage(LONGLONG after_sequence, DWORD timeout) {
+  if (debug_)
+    std::cerr << "GetNextImage(" << after_sequence << ", " << timeout << ")\n";
+  ULONGLONG deadline = GetTickCount64() + timeout;
+  // The value ready_sequence_ must exceed. Raised past frames that turn out
+  // not to decode.
+  LONGLONG wait_sequence = after_sequence;
+  while (TRUE) {
+    bool ready = false;
+    LONGLONG ready_sequence = 0;
+    AcquireSRWLockExclusive(&wait_lock_);
+    InterlockedIncrement(&waiters_);
+    while (status_ == kOK) {
+      ready_sequence = InterlockedCompareExchange64(&ready_sequence_, 0, 0);
+      if (ready_sequence > wait_sequence) {
+        ready = true;
+        break;
+      }
+      DWORD remaining = INFINITE;
+      if (timeout != INFINITE) {
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline)
+          break;
+        remaining = static_cast<DWORD>(deadline - now);
+      }
+      if (!SleepConditionVariableSRW(&frame_ready_, &wait_lock_, remaining,
+                                     0) &&
+          GetLastError() != ERROR_TIMEOUT) {
+        fprintf_s(stderr, kErrorMessage, "SleepConditionVariableSRW",
+                  GetLastError());
+        break;
+      }
+    }
+    InterlockedDecrement(&waiters_);
+    ReleaseSRWLockExclusive(&wait_lock_);
+    if (!ready)
+      return NULL;
+    RasPiFrame* frame = GetFrame();
+    if (frame != NULL && frame->get_sequence() > after_sequence)
+      return frame;
+    // Without decode threads, a frame that fails to decode leaves an older
+    // frame cached. Returning it would make the caller spin on it.
+    if (frame != NULL)
+      frame->Release();
+    wait_sequence = ready_sequence;
+  }
+}
+
+RasPiFrame* RasPiCamera::WaitForNextImage(DWORD timeout) {
+  return GetNextImage(GetSequence(), timeout);
+}
@@ -19,44 +19,160 @@ static const char* kErrorMessageFor = "%s for %s failed with error: 0x%08x\n";
 class RasPiCamera {
  public:
   enum RasPiStatus { kOK, kError, kIndexOutOfBounds, kEnd };
-  enum ImageStatus { kFree, kBusy };
+
+  // Optional settings of RasPiCamera. The constructor sets every field to its
+  // default value.
+  struct Options {
+    Options();
+    // Frames larger than this many bytes are regarded as an error, so that a
+    // corrupt header cannot trigger a huge allocation.
+    UINT32 max_frame_size;
+    // Number of threads decoding frames as soon as they are received. If 0,
+    // frames are decoded on demand by the thread calling GetFrame.
+    int decode_threads;
+    // Frames are decoded at 1/decode_scale of their width and height, which
+    // skips most of the decoding work. 1, 2, 4 or 8; other values decode at
+    // full size.
+    int decode_scale;
+    // If true, frames are decoded into the Y, Cb and Cr planes they are
+    // stored as (see RasPiFrame::get_plane), and BGR images are only made
+    // when RasPiFrame::get_image is called.
+    bool decode_ycbcr;
+    // If not NULL, every received frame is appended to this recording file
+    // (see FrameRecorder), which is replaced if it exists.
+    const char* record_file;
+    // If not NULL, frames are played from this recording file instead of
+    // being received, and no connection is made. The status becomes kEnd
+    // once the last frame has been returned by GetFrame or has failed to
+    // decode, and serial requests are ignored.
+    const char* playback_file;
+    // If true, recorded frames are played at the pace they were received.
+    // Otherwise each frame is played once the previous one has been returned
+    // by GetFrame or has failed to decode, so that none is overwritten.
+    bool playback_paced;
+    // Frame header version asked of the Raspberry Pi. With 2, a
+    // "protocol_version=2" line is appended to the configuration, and
+    // servers that know it send version 2 headers carrying their sequence
+    // number and the capture time. Servers that do not keep sending version
+    // 1 headers, which are still accepted. With 1, the configuration is
+    // sent unchanged.
+    int protocol_version;
+    // Capacity in bytes of the ring buffer the socket is read into. Headers
+    // and the frames smaller than it arrive through the ring, several per
+    // recv call when they are sent back to back; larger frames are received
+    // straight into their buffer.
+    int receive_buffer_size;
+    // SO_RCVBUF of the socket in bytes, or 0 to keep the system default. A
+    // larger buffer lets the Raspberry Pi send ahead while this side is
+    // busy.
+    int socket_receive_buffer;
+    // If true, a steering request ('a', 'b', 'd' or 'f') replaces the
+    // steering request queued right before it when that one has not been
+    // sent yet, so that only the newest direction goes out after a slow
+    // send. Only correct if every steering request supersedes the previous
+    // one.
+    bool collapse_steering;
+  };
+
+  // Counters and latencies of a RasPiCamera since its construction. Frames
+  // are lost where frames_overwritten grows; time goes where the latencies
+  // grow.
+  struct Metrics {
+    // bytes received from the Raspberry Pi, headers included
+    LONGLONG bytes_received;
+    // recv calls made to receive them
+    LONGLONG recv_calls;
+    // frames received from the Raspberry Pi or played from a recording
+    LONGLONG frames_received;
+    // frames replaced by a newer one before any consumer read them, either
+    // still encoded or already decoded
+    LONGLONG frames_overwritten;
+    // frames that could not be decoded
+    LONGLONG decode_failures;
+    // frames the Raspberry Pi skipped, from the gaps in the sequence numbers
+    // of version 2 headers
+    LONGLONG sender_skipped_frames;
+    // serial requests accepted by RequestSerial, those of them replaced by a
+    // newer steering request before being sent, and the requests refused
+    // because the queue was full
+    LONGLONG requests_queued;
+    LONGLONG requests_collapsed;
+    LONGLONG requests_dropped;
+    // sends of queued requests, each carrying every request queued by then
+    LONGLONG request_batches;
+    // time spent blocked in Recv per frame, from waiting for the header to
+    // the last byte of the image
+    HistogramSnapshot receive_latency;
+    // time spent decoding per frame, by decode threads or consumers
+    HistogramSnapshot decode_latency;
+    // age of the frames once received, from the capture time of version 2
+    // headers. Only meaningful if both clocks are synchronized, e.g. by NTP.
+    HistogramSnapshot capture_latency;
+    // age of the frames when ReportDecision is called for them, measured
+    // as capture_latency
+    HistogramSnapshot decision_latency;
+    // time from the queueing of the oldest request of a batch until the
+    // batch is sent
+    HistogramSnapshot request_latency;
+  };
 
   // Constructor. address and port are address and port for connection with
   // Raspberry Pi, respectively. address and port both MUST NOT be NULL.
   // If debug is set to true, debug messages will be printed.
-  RasPiCamera(const char* address, const char* port, bool debug);
+  RasPiCamera(const char* address, const char* port, bool debug,
+              const Options& options = Options());
   // Destructor. Waits for the thread to end. Free all the images.
   ~RasPiCamera();
   // Returns the current status.
   RasPiStatus get_status() { return status_; }
   // Request the Raspberry Pi to send len characters from data through its
-  // serial output. data MUST NOT be NULL. When error occurs, set status_
-  // to be kError and return kError. Otherwise return kOK.
+  // serial output. data MUST NOT be NULL. The request is queued for a
+  // sender thread, which sends every queued request in one call, so this
+  // call never blocks on the socket. Returns kError if the status is not kOK or
+  // if kMaxPendingRequests bytes are already queued; the request is dropped
+  // then. Otherwise return kOK. Does nothing and returns kOK while playing a
+  // recording. Can be called from any thread.
   RasPiStatus RequestSerial(const char* data, int len);
-  // Returns a pointer to the IplImage object of the freshest image.
-  // If image_to_use_ is kNone, returns NULL.
+  // Returns a new reference to the decoded freshest frame, which the caller
+  // MUST Release. Each received frame is decoded at most once; callers asking
+  // again before a new frame arrives share the same RasPiFrame. If no image
+  // has been decoded yet, returns NULL. Can be called from any thread.
+  RasPiFrame* GetFrame(void);
+  // Returns a pointer to a copy of the IplImage object of the freshest image,
+  // which the caller MUST release. If no image has been received yet,
+  // returns NULL. Can be called from any thread.
   IplImage* GetImage(void);
+  // Returns the sequence number of the freshest received frame. Frames are
+  // numbered from 1 in the order they are received. Returns 0 if no frame has
+  // been received yet. Can be called from any thread.
+  LONGLONG GetSequence(void);
+  // Blocks until a frame with a sequence number greater than after_sequence
+  // is ready, then returns GetFrame(). The consumer is woken as soon as the
+  // frame is published, or decoded when decode threads are used. Returns NULL
+  // if timeout milliseconds pass first (timeout may be INFINITE), or if the
+  // status is no longer kOK. Can be called from any thread.
+  RasPiFrame* GetNextImage(LONGLONG after_sequence, DWORD timeout);
+  // Blocks until a frame newer than the freshest frame at the time of the
+  // call has been received. Same as GetNextImage(GetSequence(), timeout).
+  RasPiFrame* WaitForNextImage(DWORD timeout);
+  // Copies the counters of the receive buffer pool to stats. stats MUST NOT
+  // be NULL. Can be called from any thread.
+  void GetFramePoolStats(FramePoolStats* stats) { frame_pool_.GetStats(stats); }
+  // Copies the metrics to metrics, which MUST NOT be NULL. Always enabled;
+  // collecting them costs a few interlocked operations per frame. Can be
+  // called from any thread.
+  void GetMetrics(Metrics* metrics);
+  // Records that the decision based on frame was taken now, into the
+  // decision latency. Does nothing if the capture time of frame is unknown.
+  // Can be called from any thread.
+  void ReportDecision(RasPiFrame* frame);
+  // MetricsDumper::Writer writing the metrics of the RasPiCamera context.
+  static void WriteMetrics(void* context, FILE* file);
 
  private:
-#pragma pack(push, 1)
-   struct RequestProtocol {
-     UINT32 header;
-     UINT32 data_length;
-   };
-   struct ReceiveProtocol {
-     UINT32 header;
-     UINT32 image_size;
-   };
-#pragma pack(pop)
+  // The messages and their headers are those of raspi_protocol.h.
   enum {
-    // header for configuration. the speed of light.
-    kConfigure = 299792458,
-    // header for receiving image. the first ten digits of pi
-    kReceiveImage = 3141592653,
-    // header for sending serial requests.
-    // the first ten digits of Euler's number
-    kRequestSerial = 2718281828,
-    // value of image_to_use when no images are ready
+    // value of image indices when no images are ready
     kNone = -1,
     // timedout value for the sockets in milliseconds (10 seconds)
     kTimedout = 10000,
@@ -65,8 +181,21 @@ class RasPiCamera {
     kMaxTimedout = 30,
     // number of image slots
     kNumberOfImageSlots = 3,
+    // bit of shared_slot_ set while the slot it names holds an image the
+    // consumer has not taken yet
+    kFreshSlot = 4,
+    // bits of shared_slot_ holding the slot index
+    kSlotIndexMask = 3,
     // number of characters read at once in Config()
-    kReadChunk = 1024
+    kReadChunk = 1024,
+    // default value of Options::max_frame_size (16 MiB)
+    kDefaultMaxFrameSize = 16 * 1024 * 1024,
+    // longest sleep in milliseconds while waiting for the time of a recorded
+    // frame or for the consumer to take one, so that destruction is never
+    // delayed for long
+    kMaxPlaybackSleep = 100,
+    // most bytes of serial requests waiting for send_thread_
+    kMaxPendingRequests = 64 * 1024
   };
   // Connects to the Raspberry Pi. When error occurs, sets status_ to be kError
   // and return kError. Otherwise return kOK.
@@ -76,13 +205,21 @@ class RasPiCamera {
   // When error occurs, sets status_ to be kError and return kError. Otherwise
   // return kOK.
   RasPiStatus Configure();
-  // Fill the input RequestProtocol req with the corresponding header and
+  // Fill the input MessageHeader req with the corresponding header and
   // data_length in network byte order.
   void FillRequestProtocol(UINT32 header, UINT32 data_length,
-                           RequestProtocol* req);
-  // Change the header and data_length of input ReceiveProtocol recv to host
-  // byte order.
-  void AnalyzeReceiveProtocol(ReceiveProtocol* recv);
+                           MessageHeader* req);
+  // Change the header and length of input MessageHeader recv to host byte
+  // order.
+  void AnalyzeReceiveProtocol(MessageHeader* recv);
+  // Change the fields of input FrameInfo info to host byte order.
+  void AnalyzeFrameInfo(FrameInfo* info);
+  // Receives the FrameInfo following a kReceiveImageV2 header into info,
+  // skipping the fields of later versions. When error occurs, sets status_
+  // to be kError and returns kError. Otherwise returns kOK.
+  RasPiStatus ReceiveFrameInfo(FrameInfo* info);
+  // Returns the current time in microseconds since 1970-01-01 UTC.
+  static LONGLONG GetUnixTime();
   // Read from config_file and write it on config_string. Sets status_ to
   // kError and returns kError when error occurs. Otherwise return kOK.
   RasPiStatus Read(HANDLE config_file, std::string* config_string);
@@ -91,30 +228,84 @@ class RasPiCamera {
   // When error occurs, set status_ to be kError and return kError.
   // Otherwise return kOK.
   RasPiStatus Send(const char* buf, int len);
-  // Receives len characters and stores at buf. Wrapper function of recv.
-  // Keeps on calling recv until all of the data is received.
-  // buf MUST NOT be NULL. When error occurs, set status_ to be kError
-  // and return kError. Otherwise return kOK.
-  RasPiStatus Recv(char* buf, int len);
-  // Calls cvReleaseMat on images_[index].
-  // If images_[index] is NULL, nothing happens.
-  void ReleaseImage(int index);
-  // Safely sets the value of image_status_[index] to be status within
-  // critical section. When error occurs, set status_ to be kError and
-  // return kError. Otherwise return kOK.
-  RasPiStatus SetImageStatus(int index, ImageStatus status);
-  // Safely searches for a image to fill within critical section. The image
-  // must not be the freshest nor busy. Set index_to_fill to be the index to
-  // the image. When error occurs, set status_ to be kError and return kError.
-  // Otherwise return kOK. index_to_fill MUST NOT be NULL.
-  int FindImageToFill();
-  // Safely sets the value of image_to_use_ to be index within critical
-  // section. When error occurs, set status_ to be kError and return kError.
+  // Receives len characters and stores at buf, taking the characters
+  // already in receive_ring_ first. The rest is received through
+  // receive_ring_ if it fits, otherwise straight into buf. buf MUST NOT be
+  // NULL. When error occurs, set status_ to be kError and return kError.
   // Otherwise return kOK.
-  void SetImageToUse(int index);
+  RasPiStatus Recv(char* buf, int len);
+  // Calls recv until receive_ring_ holds at least len characters, which
+  // MUST be less than its capacity. Each call takes as much as fits. When
+  // error occurs, set status_ to be kError and return kError. Otherwise
+  // return kOK.
+  RasPiStatus Fill(int len);
+  // Calls recv once for at most len characters into buf, and sets
+  // *received to the number received. When error occurs, set status_ to be
+  // kError and return kError. Otherwise return kOK.
+  RasPiStatus RecvSome(char* buf, int len, int* received);
+  // Called by image_thread_. Receives the next frame from the Raspberry Pi
+  // into frame_pool_ buffer index, with either header version, and sets its
+  // capture time. Returns kEnd if the Raspberry Pi ended
+  // the stream. When error occurs, sets status_ to be kError and returns
+  // kError. Otherwise returns kOK.
+  RasPiStatus ReceiveFrame(int index);
+  // Called by image_thread_. Copies the next frame of playback_ into
+  // frame_pool_ buffer index, waiting for its time first if playback_paced_
+  // is set, or for the previous frame to be taken otherwise. Returns kEnd
+  // once the last frame has been taken, or if the object is being destroyed
+  // while waiting. When error occurs, sets status_ to be kError
+  // and returns kError. Otherwise returns kOK.
+  RasPiStatus PlayFrame(int index);
+  // Called by image_thread_ after frame_pool_ buffer fill_slot_ is filled.
+  // Atomically swaps fill_slot_ with shared_slot_, marking it fresh, and
+  // takes the previously shared slot as the next slot to fill. Never blocks.
+  void PublishImage();
+  // Called by the consumer within decode_lock_. If shared_slot_ holds a fresh
+  // image, atomically swaps it with use_slot_. Returns use_slot_. Never blocks.
+  int AcquireFreshestImage();
+  // Called by the consumer within decode_lock_ when no decode threads are
+  // used. Decodes the freshest image into cached_frame_ unless it is already
+  // cached.
+  void DecodeFreshestImage();
+  // Decodes the frame held by matrix at 1/decode_scale_ of its size, into
+  // planes if decode_ycbcr_ is set. Returns a new RasPiFrame with sequence,
+  // or NULL if the frame cannot be decoded.
+  RasPiFrame* Decode(const CvMat* matrix, LONGLONG sequence);
+  // Replaces cached_frame_ with frame and wakes the waiting consumers, unless
+  // cached_frame_ is already newer. Takes over the reference to frame.
+  void PublishFrame(RasPiFrame* frame);
+  // Called by image_thread_ when decode threads are used. Returns the index
+  // of a free frame_pool_ buffer to receive into.
+  int AcquireDecodeBuffer();
+  // Called by image_thread_ when decode threads are used. Hands the filled
+  // buffer index to the decode threads. If an older frame is still waiting
+  // for a decode thread, it is dropped in favor of index.
+  void QueueDecode(int index);
+  // Function called by decode_threads_. Decodes queued frames and publishes
+  // them until decode_stopping_ is set.
+  static DWORD WINAPI DecodeLoop(LPVOID lpParam);
+  // Wakes the threads blocked in GetNextImage, if there are any. Called after
+  // a frame is published or the status changes.
+  void WakeWaiters();
+  // Called by the consumer while playing a recording, after the frame of
+  // sequence has been returned by GetFrame or has failed to decode. Raises
+  // taken_sequence_ and wakes image_thread_.
+  void MarkTaken(LONGLONG sequence);
+  // Called by image_thread_. Waits until the frame of sequence has been
+  // taken. Returns false if the status changed first.
+  bool WaitUntilTaken(LONGLONG sequence);
+  // Function called by send_thread_. Sends the queued serial requests, all
+  // of them in one call, until send_stopping_ is set or a send fails.
+  static DWORD WINAPI SendLoop(LPVOID lpParam);
+  // Returns true if the request of len characters from data is a steering
+  // request, which Options::collapse_steering may replace.
+  static bool IsSteeringRequest(const char* data, int len);
+  // Entry point of image_thread_. Runs ImageLoop and wakes the waiting
+  // consumers once it ends.
+  static DWORD WINAPI ImageThread(LPVOID lpParam);
   // Function called by image_thread_. Returns FALSE when error occurs.
-  // Keeps on receiving images from the Raspberry Pi and update image_status_
-  // and image_to_use_.
+  // Keeps on receiving images from the Raspberry Pi into fill_slot_ and
+  // publishing them.
   static DWORD WINAPI ImageLoop(LPVOID lpParam);
 
   char address_[40];
@@ -124,18 +315,123 @@ class RasPiCamera {
   // The current status of the object. If an error occurs, this is set to
   // kError. Before destruction, it is set to kEnd. Otherwise it is set to kOK.
   RasPiStatus status_;
-  // A critical section for thread safety.
-  CRITICAL_SECTION critical_section_;
   HANDLE image_thread_;
-  // Index to the freshest image. It is originally set to be kNone.
-  // The value must be handled only within critical section.
-  int image_to_use_;
-  // image_status_[i] keeps track on the status of images_[i].
-  // If either image_thread_ or the main thread is working on the image, it is
-  // marked kBusy. Otherwise it is marked kFree.
-  // The value must be handled only within critical section.
-  ImageStatus image_status_[3];
-  CvMat* images_[3];
+  // Without decode threads, the frame_pool_ buffers form a triple buffer. At
+  // any time each slot is owned by exactly one of image_thread_ (fill_slot_),
+  // the consumer (use_slot_), or neither (the slot named by shared_slot_).
+  // Ownership only changes through InterlockedExchange on shared_slot_, so no
+  // locks are taken on the frame path and image_thread_ never touches the
+  // slot being decoded.
+  // Slot index and kFreshSlot flag of the slot in the middle.
+  volatile LONG shared_slot_;
+  // The slot image_thread_ is filling. Only used by image_thread_.
+  int fill_slot_;
+  // The slot the consumer is decoding. Only used within decode_lock_.
+  int use_slot_;
+  // Sequence number of the last received frame.
+  volatile LONGLONG latest_sequence_;
+  // Sequence number of the last frame GetNextImage may return. Without decode
+  // threads this is latest_sequence_, otherwise the last decoded frame.
+  volatile LONGLONG ready_sequence_;
+  // Guards use_slot_ and cached_frame_. image_thread_ never enters it, so
+  // without decode threads it only serializes consumers.
+  CRITICAL_SECTION decode_lock_;
+  // The last decoded frame, or NULL. Holds a reference.
+  RasPiFrame* cached_frame_;
+  // Set once cached_frame_ has been returned by GetFrame.
+  bool cached_frame_read_;
+  // Sequence number of the last image that failed to decode, so that it is
+  // not decoded again by every GetFrame. Only used within decode_lock_.
+  LONGLONG failed_sequence_;
+  // With decode threads, each frame_pool_ buffer is either free, being
+  // received into, waiting in pending_decode_, or being decoded.
+  // Options::decode_scale, or 1 if it is not supported.
+  int decode_scale_;
+  bool decode_ycbcr_;
+  // Number of decode threads. 0 if frames are decoded on demand.
+  int decode_thread_count_;
+  HANDLE* decode_threads_;
+  // Guards the fields below.
+  CRITICAL_SECTION decode_queue_lock_;
+  // Signaled when pending_decode_ is set or decode_stopping_ becomes true.
+  CONDITION_VARIABLE decode_ready_;
+  // Indices of the free buffers.
+  int* free_buffers_;
+  int free_buffer_count_;
+  // Index of the buffer waiting for a decode thread, or kNone.
+  int pending_decode_;
+  // Set by the destructor to stop decode_threads_.
+  bool decode_stopping_;
+  // Number of threads in GetNextImage. Lets image_thread_ skip wait_lock_
+  // entirely while nobody waits.
+  volatile LONG waiters_;
+  // Protects the sleep in GetNextImage against missed wake ups.
+  SRWLOCK wait_lock_;
+  // Signaled by image_thread_ when a frame is published or it exits.
+  CONDITION_VARIABLE frame_ready_;
+  // Sequence number of the last frame taken by the consumer while playing a
+  // recording. Guarded by wait_lock_.
+  LONGLONG taken_sequence_;
+  // Signaled by MarkTaken when taken_sequence_ is raised.
+  CONDITION_VARIABLE frame_taken_;
+  // Sends the serial requests. NULL while playing a recording.
+  HANDLE send_thread_;
+  // Guards the fields below.
+  CRITICAL_SECTION send_lock_;
+  // Signaled when a request is queued or send_stopping_ becomes true.
+  CONDITION_VARIABLE send_ready_;
+  // Serial requests waiting for send_thread_, in wire format.
+  std::string send_queue_;
+  // LatencyHistogram::GetTicks() when the oldest request of send_queue_ was
+  // queued.
+  LONGLONG send_queue_ticks_;
+  // Offset in send_queue_ of the character of its last request if that is a
+  // steering request, otherwise std::string::npos.
+  size_t queued_steering_;
+  // Options::collapse_steering.
+  bool collapse_steering_;
+  // Set by the destructor to stop send_thread_. Requests still queued are
+  // dropped.
+  bool send_stopping_;
+  // Writes the received frames to Options::record_file, or NULL.
+  FrameRecorder* recorder_;
+  // The recording frames are played from, or NULL when receiving from the
+  // Raspberry Pi.
+  Recording* playback_;
+  bool playback_paced_;
+  // Index of the next frame of playback_. Only used by image_thread_.
+  int playback_index_;
+  // QueryPerformanceCounter when the first frame of playback_ was played.
+  LONGLONG playback_start_;
+  // Options::protocol_version.
+  int protocol_version_;
+  // Options::socket_receive_buffer.
+  int socket_receive_buffer_;
+  // Sequence number of the last version 2 header, or 0 before the first.
+  // Only used by image_thread_.
+  UINT64 sender_sequence_;
+  // Fields of Metrics, updated with interlocked operations.
+  volatile LONGLONG bytes_received_;
+  volatile LONGLONG recv_calls_;
+  volatile LONGLONG frames_received_;
+  volatile LONGLONG frames_overwritten_;
+  volatile LONGLONG decode_failures_;
+  volatile LONGLONG sender_skipped_frames_;
+  volatile LONGLONG requests_queued_;
+  volatile LONGLONG requests_collapsed_;
+  volatile LONGLONG requests_dropped_;
+  volatile LONGLONG request_batches_;
+  LatencyHistogram receive_latency_;
+  LatencyHistogram decode_latency_;
+  LatencyHistogram capture_latency_;
+  LatencyHistogram decision_latency_;
+  LatencyHistogram request_latency_;
+  // Receive buffers. One per slot without decode threads, otherwise
+  // decode_thread_count_ + 2. Buffers keep their capacity across frames.
+  FramePool frame_pool_;
+  // Data received from the socket and not parsed yet. Only used by
+  // image_thread_.
+  ReceiveRing receive_ring_;
 };
 
 #endif  // RASPICAMERA_RASPI_CAMERA_H_
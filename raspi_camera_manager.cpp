@@ -0,0 +1,265 @@
+// Copyright 2016
+
+#include "raspi_camera_manager.h"
+#include <opencv/cv.h>
+#include <opencv/cxcore.h>
+#include "raspi_jpeg.h"
+
+CameraManager::Options::Options() {
+  loop_count = 1;
+  worker_count = 2;
+  decode_scale = 1;
+  decode_ycbcr = false;
+  results = ProcessContext::kAllResults;
+  mask_file = NULL;
+  edge_mode = ProcessContext::kFixedPointEdges;
+}
+
+CameraManager::CameraManager(const std::vector<std::string>& endpoints,
+                             const std::string& configuration,
+                             ResultHandler handler, void* context,
+                             const Options& options) {
+  open_ = true;
+  handler_ = handler;
+  context_ = context;
+  decode_scale_ = options.decode_scale;
+  decode_ycbcr_ = options.decode_ycbcr;
+  results_ = options.results;
+  next_camera_ = 0;
+  stopping_ = false;
+  InitializeCriticalSection(&lock_);
+  InitializeConditionVariable(&frame_ready_);
+  for (int index = 0; index < MAX(options.loop_count, 1); ++index) {
+    loops_.push_back(new EventLoop());
+    open_ = open_ && loops_.back()->is_open();
+  }
+  // Every camera is complete before the workers and its connection start.
+  std::vector<std::string> addresses, ports;
+  for (size_t index = 0; index < endpoints.size(); ++index) {
+    size_t colon = endpoints[index].rfind(':');
+    if (colon == std::string::npos) {
+      fprintf_s(stderr, "Expected address:port, got %s.\n",
+                endpoints[index].c_str());
+      open_ = false;
+      continue;
+    }
+    addresses.push_back(endpoints[index].substr(0, colon));
+    ports.push_back(endpoints[index].substr(colon + 1));
+    Camera* camera = new Camera;
+    camera->manager = this;
+    camera->index = static_cast<int>(cameras_.size());
+    camera->name = endpoints[index];
+    camera->stream = NULL;
+    camera->process_context = new ProcessContext(
+        options.mask_file, options.edge_mode, NULL);
+    camera->result_image = NULL;
+    for (int buffer = 0; buffer < kBuffersPerCamera; ++buffer) {
+      camera->buffers[buffer].sequence = 0;
+      camera->buffers[buffer].capture_time = 0;
+      camera->buffers[buffer].receive_ticks = 0;
+    }
+    camera->fill_buffer = 0;
+    camera->pending_buffer = kNone;
+    camera->work_buffer = 1;
+    camera->busy = false;
+    camera->frames_processed = 0;
+    camera->frames_dropped = 0;
+    camera->decode_failures = 0;
+    cameras_.push_back(camera);
+  }
+  for (int index = 0; index < MAX(options.worker_count, 1); ++index) {
+    HANDLE worker = CreateThread(
+        NULL, 0, (LPTHREAD_START_ROUTINE)WorkerLoop, this, 0, NULL);
+    if (worker == NULL) {
+      fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+      open_ = false;
+      break;
+    }
+    workers_.push_back(worker);
+  }
+  for (size_t index = 0; index < cameras_.size(); ++index) {
+    cameras_[index]->stream = new FrameStream(
+        loops_[index % loops_.size()], addresses[index].c_str(),
+        ports[index].c_str(), configuration, OnFrame, cameras_[index],
+        options.stream);
+  }
+}
+
+CameraManager::~CameraManager() {
+  // No frame arrives once the streams are gone.
+  for (size_t index = 0; index < cameras_.size(); ++index)
+    delete cameras_[index]->stream;
+  EnterCriticalSection(&lock_);
+  stopping_ = true;
+  LeaveCriticalSection(&lock_);
+  WakeAllConditionVariable(&frame_ready_);
+  for (size_t index = 0; index < workers_.size(); ++index) {
+    WaitForSingleObject(workers_[index], INFINITE);
+    CloseHandle(workers_[index]);
+  }
+  for (size_t index = 0; index < loops_.size(); ++index)
+    delete loops_[index];
+  for (size_t index = 0; index < cameras_.size(); ++index) {
+    delete cameras_[index]->process_context;
+    cvReleaseImage(&cameras_[index]->result_image);
+    delete cameras_[index];
+  }
+  DeleteCriticalSection(&lock_);
+}
+
+void CameraManager::GetStatus(int camera_index, CameraStatus* status) {
+  Camera* camera = cameras_[camera_index];
+  status->status = camera->stream->get_status();
+  camera->stream->GetStats(&status->stream);
+  // A plain 64-bit read is not atomic on 32-bit targets.
+  status->frames_processed = InterlockedCompareExchange64(
+      &camera->frames_processed, 0, 0);
+  status->frames_dropped = InterlockedCompareExchange64(
+      &camera->frames_dropped, 0, 0);
+  status->decode_failures = InterlockedCompareExchange64(
+      &camera->decode_failures, 0, 0);
+  EnterCriticalSection(&lock_);
+  status->pending = camera->pending_buffer != kNone;
+  status->busy = camera->busy;
+  LeaveCriticalSection(&lock_);
+  camera->queue_latency.GetSnapshot(&status->queue_latency);
+  camera->process_latency.GetSnapshot(&status->process_latency);
+}
+
+bool CameraManager::RequestSerial(int camera, const char* data, int len) {
+  return cameras_[camera]->stream->RequestSerial(data, len);
+}
+
+void CameraManager::WriteMetrics(void* context, FILE* file) {
+  CameraManager* manager = static_cast<CameraManager*>(context);
+  for (int index = 0; index < manager->get_camera_count(); ++index) {
+    CameraStatus status;
+    manager->GetStatus(index, &status);
+    fprintf(file, "camera%d.name %s\n", index,
+            manager->get_name(index).c_str());
+    fprintf(file, "camera%d.status %d\n", index, status.status);
+    fprintf(file, "camera%d.bytes_received %lld\n", index,
+            status.stream.bytes_received);
+    fprintf(file, "camera%d.recv_calls %lld\n", index,
+            status.stream.recv_calls);
+    fprintf(file, "camera%d.frames_received %lld\n", index,
+            status.stream.frames_received);
+    fprintf(file, "camera%d.frames_in_place %lld\n", index,
+            status.stream.frames_in_place);
+    fprintf(file, "camera%d.frames_processed %lld\n", index,
+            status.frames_processed);
+    fprintf(file, "camera%d.frames_dropped %lld\n", index,
+            status.frames_dropped);
+    fprintf(file, "camera%d.decode_failures %lld\n", index,
+            status.decode_failures);
+    fprintf(file, "camera%d.sender_skipped_frames %lld\n", index,
+            status.stream.sender_skipped_frames);
+    fprintf(file, "camera%d.stalls %lld\n", index, status.stream.stalls);
+    fprintf(file, "camera%d.stalled_ms %lld\n", index,
+            status.stream.stalled_milliseconds);
+    char name[32];
+    snprintf(name, sizeof(name), "camera%d.queue", index);
+    WriteHistogram(file, name, status.queue_latency);
+    snprintf(name, sizeof(name), "camera%d.process", index);
+    WriteHistogram(file, name, status.process_latency);
+  }
+}
+
+void CameraManager::OnFrame(void* context, const StreamFrame& frame) {
+  Camera* camera = static_cast<Camera*>(context);
+  CameraManager* manager = camera->manager;
+  // The fill buffer belongs to the loop thread, so the copy takes no lock.
+  // Its capacity is kept across frames.
+  Buffer* buffer = &camera->buffers[camera->fill_buffer];
+  const UINT8* data = frame.data->data.ptr;
+  buffer->data.assign(data, data + frame.data->cols);
+  buffer->sequence = frame.sequence;
+  buffer->capture_time = frame.capture_time;
+  buffer->receive_ticks = LatencyHistogram::GetTicks();
+  EnterCriticalSection(&manager->lock_);
+  if (camera->pending_buffer != kNone) {
+    // The workers are behind. The older frame is dropped.
+    int dropped = camera->pending_buffer;
+    camera->pending_buffer = camera->fill_buffer;
+    camera->fill_buffer = dropped;
+    InterlockedIncrement64(&camera->frames_dropped);
+  } else {
+    // The buffers are numbered 0, 1 and 2, so the free one is the rest.
+    int free_buffer = 0 + 1 + 2 - camera->fill_buffer - camera->work_buffer;
+    camera->pending_buffer = camera->fill_buffer;
+    camera->fill_buffer = free_buffer;
+  }
+  bool idle = !camera->busy;
+  LeaveCriticalSection(&manager->lock_);
+  // A busy camera is taken again by its worker when it is done.
+  if (idle)
+    WakeConditionVariable(&manager->frame_ready_);
+}
+
+DWORD CameraManager::WorkerLoop(LPVOID lpParam) {
+  CameraManager* manager = static_cast<CameraManager*>(lpParam);
+  EnterCriticalSection(&manager->lock_);
+  while (TRUE) {
+    Camera* camera = NULL;
+    while (!manager->stopping_ &&
+           (camera = manager->TakeNextCamera()) == NULL)
+      SleepConditionVariableCS(&manager->frame_ready_, &manager->lock_,
+                               INFINITE);
+    if (camera == NULL)
+      break;
+    LeaveCriticalSection(&manager->lock_);
+    manager->ProcessFrame(camera);
+    EnterCriticalSection(&manager->lock_);
+    camera->busy = false;
+  }
+  LeaveCriticalSection(&manager->lock_);
+  return TRUE;
+}
+
+CameraManager::Camera* CameraManager::TakeNextCamera() {
+  int count = static_cast<int>(cameras_.size());
+  for (int offset = 0; offset < count; ++offset) {
+    Camera* camera = cameras_[(next_camera_ + offset) % count];
+    if (camera->busy || camera->pending_buffer == kNone)
+      continue;
+    // The scan resumes after this camera, so every camera with a pending
+    // frame is served before this one is served again.
+    next_camera_ = (camera->index + 1) % count;
+    camera->work_buffer = camera->pending_buffer;
+    camera->pending_buffer = kNone;
+    camera->busy = true;
+    camera->queue_latency.AddSince(
+        camera->buffers[camera->work_buffer].receive_ticks);
+    return camera;
+  }
+  return NULL;
+}
+
+void CameraManager::ProcessFrame(Camera* camera) {
+  LONGLONG start = LatencyHistogram::GetTicks();
+  const Buffer& buffer = camera->buffers[camera->work_buffer];
+  CvMat matrix = cvMat(1, static_cast<int>(buffer.data.size()), CV_8UC1,
+                       const_cast<UINT8*>(&buffer.data[0]));
+  RasPiFrame* frame = DecodeFrame(&matrix, decode_scale_, decode_ycbcr_,
+                                  buffer.sequence);
+  if (frame == NULL) {
+    InterlockedIncrement64(&camera->decode_failures);
+    return;
+  }
+  frame->set_capture_time(buffer.capture_time);
+  // Planes are not converted to BGR unless results are drawn.
+  CvSize size = frame->get_size();
+  if (camera->result_image == NULL ||
+      camera->result_image->width != size.width ||
+      camera->result_image->height != size.height) {
+    cvReleaseImage(&camera->result_image);
+    camera->result_image = cvCreateImage(size, IPL_DEPTH_8U, 3);
+  }
+  camera->process_context->Process(frame, results_, camera->result_image);
+  if (handler_ != NULL)
+    handler_(context_, camera->index, frame, camera->process_context,
+             camera->result_image);
+  frame->Release();
+  camera->process_latency.AddSince(start);
+  InterlockedIncrement64(&camera->frames_processed);
+}
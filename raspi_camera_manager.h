@@ -0,0 +1,177 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_CAMERA_MANAGER_H_
+#define RASPICAMERA_RASPI_CAMERA_MANAGER_H_
+
+#include <string>
+#include <vector>
+#include "raspi_metrics.h"
+#include "raspi_process.h"
+#include "raspi_transport.h"
+
+// Counters and state of one camera of a CameraManager.
+struct CameraStatus {
+  FrameStream::Status status;
+  // Counters of the connection.
+  StreamStats stream;
+  // frames decoded and processed
+  LONGLONG frames_processed;
+  // frames replaced by a newer one before a worker took them, because the
+  // workers were behind
+  LONGLONG frames_dropped;
+  // frames that could not be decoded
+  LONGLONG decode_failures;
+  // true while a frame waits for a worker, and while a worker processes one
+  bool pending;
+  bool busy;
+  // time from the reception of a frame until a worker takes it
+  HistogramSnapshot queue_latency;
+  // time a worker takes to decode and process a frame
+  HistogramSnapshot process_latency;
+};
+
+// Receives, decodes and processes the frames of several cameras in one
+// process. The connections are spread over a few EventLoop threads, and
+// decoding and processing run on a shared pool of workers. Every camera
+// holds at most one frame waiting for a worker, and the newest frame
+// replaces it, so memory stays bounded and a slow pool drops frames instead
+// of falling behind. The workers take the waiting frames in round-robin
+// order, one frame per camera at a time, so a fast camera cannot starve the
+// others and each camera keeps its frame order and its own ProcessContext.
+// Linux only, like raspi_transport.
+class CameraManager {
+ public:
+  // Function called on a worker thread after frame of camera has been
+  // processed into result_image by process_context. context is passed
+  // through from the constructor. frame is only valid during the call. Calls
+  // for one camera never overlap. As ProcessContext::Process, result_image
+  // is not filled from a frame decoded as YCbCr unless results are drawn.
+  typedef void (*ResultHandler)(void* context, int camera, RasPiFrame* frame,
+                                ProcessContext* process_context,
+                                IplImage* result_image);
+
+  // Optional settings of CameraManager. The constructor sets every field to
+  // its default value.
+  struct Options {
+    Options();
+    // Number of EventLoop threads the connections are spread over.
+    int loop_count;
+    // Number of worker threads decoding and processing frames.
+    int worker_count;
+    // As RasPiCamera::Options::decode_scale and decode_ycbcr.
+    int decode_scale;
+    bool decode_ycbcr;
+    // Bit set of ProcessContext::Result computed for every frame.
+    int results;
+    // Passed to the ProcessContext of each camera.
+    const char* mask_file;
+    ProcessContext::EdgeMode edge_mode;
+    // Options of every connection.
+    FrameStream::Options stream;
+  };
+
+  // Constructor. Connects to every endpoint, "address:port", and sends
+  // configuration to each. handler, which may be NULL, is called with
+  // context for every processed frame. On error, is_open() returns false;
+  // the failure of a connection only shows in its CameraStatus.
+  CameraManager(const std::vector<std::string>& endpoints,
+                const std::string& configuration, ResultHandler handler,
+                void* context, const Options& options = Options());
+  // Destructor. Closes the connections and waits for the workers to finish
+  // the frames they are processing.
+  ~CameraManager();
+  // Returns true if every thread was started and every endpoint parsed.
+  bool is_open() { return open_; }
+  // Returns the number of cameras, one per endpoint.
+  int get_camera_count() { return static_cast<int>(cameras_.size()); }
+  // Returns the endpoint of camera.
+  const std::string& get_name(int camera) {
+    return cameras_[camera]->name;
+  }
+  // Copies the state of camera to status, which MUST NOT be NULL. Can be
+  // called from any thread.
+  void GetStatus(int camera, CameraStatus* status);
+  // Queues a serial request to the Raspberry Pi of camera, as
+  // FrameStream::RequestSerial. Never blocks. Can be called from any
+  // thread, the ResultHandler included.
+  bool RequestSerial(int camera, const char* data, int len);
+  // MetricsDumper::Writer writing the status of every camera of the
+  // CameraManager context.
+  static void WriteMetrics(void* context, FILE* file);
+
+ private:
+  enum {
+    // Index of the receive buffer of a camera that is not in use.
+    kNone = -1,
+    // Receive buffers per camera: the one being filled, the one waiting for
+    // a worker, and the one being processed.
+    kBuffersPerCamera = 3
+  };
+  // A received frame, copied out of the FrameStream.
+  struct Buffer {
+    std::vector<UINT8> data;
+    LONGLONG sequence;
+    LONGLONG capture_time;
+    // LatencyHistogram::GetTicks() when it was received.
+    LONGLONG receive_ticks;
+  };
+  struct Camera {
+    CameraManager* manager;
+    int index;
+    std::string name;
+    FrameStream* stream;
+    ProcessContext* process_context;
+    IplImage* result_image;
+    Buffer buffers[kBuffersPerCamera];
+    // The buffer the loop thread copies frames into. Only used by the loop
+    // thread.
+    int fill_buffer;
+    // The buffer waiting for a worker, or kNone, and the buffer not in use
+    // or being processed. Guarded by CameraManager::lock_.
+    int pending_buffer;
+    int work_buffer;
+    // Set while a worker processes work_buffer. Guarded by
+    // CameraManager::lock_.
+    bool busy;
+    // Fields of CameraStatus, updated with interlocked operations.
+    volatile LONGLONG frames_processed;
+    volatile LONGLONG frames_dropped;
+    volatile LONGLONG decode_failures;
+    LatencyHistogram queue_latency;
+    LatencyHistogram process_latency;
+  };
+  // FrameStream::FrameHandler. Copies the frame into the fill buffer of the
+  // Camera context and makes it the pending buffer.
+  static void OnFrame(void* context, const StreamFrame& frame);
+  // Function called by workers_. Processes pending frames until stopping_
+  // is set.
+  static DWORD WINAPI WorkerLoop(LPVOID lpParam);
+  // Returns the next camera after next_camera_ with a pending frame and no
+  // worker, or NULL. Called within lock_.
+  Camera* TakeNextCamera();
+  // Decodes and processes the work buffer of camera, then calls handler_.
+  void ProcessFrame(Camera* camera);
+
+  CameraManager(const CameraManager&);
+  void operator=(const CameraManager&);
+
+  bool open_;
+  ResultHandler handler_;
+  void* context_;
+  int decode_scale_;
+  bool decode_ycbcr_;
+  int results_;
+  std::vector<EventLoop*> loops_;
+  std::vector<Camera*> cameras_;
+  std::vector<HANDLE> workers_;
+  // Guards the scheduling fields of cameras_ and the fields below.
+  CRITICAL_SECTION lock_;
+  // Signaled when a frame becomes pending or stopping_ becomes true.
+  CONDITION_VARIABLE frame_ready_;
+  // Index of the camera the round-robin scan starts from.
+  int next_camera_;
+  // Set by the destructor to stop workers_.
+  bool stopping_;
+};
+
+#endif  // RASPICAMERA_RASPI_CAMERA_MANAGER_H_
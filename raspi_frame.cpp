@@ -0,0 +1,58 @@
+// Copyright 2016
+
+RasPiFrame::RasPiFrame(IplImage* image, LONGLONG sequence) {
+  image_ = image;
+  for (int plane = 0; plane < kNumberOfPlanes; ++plane)
+    planes_[plane] = NULL;
+  sequence_ = sequence;
+  capture_time_ = 0;
+  references_ = 1;
+}
+
+RasPiFrame::RasPiFrame(IplImage* const* planes, LONGLONG sequence) {
+  image_ = NULL;
+  for (int plane = 0; plane < kNumberOfPlanes; ++plane)
+    planes_[plane] = planes[plane];
+  sequence_ = sequence;
+  capture_time_ = 0;
+  references_ = 1;
+}
+
+RasPiFrame::~RasPiFrame() {
+  IplImage* image = image_;
+  cvReleaseImage(&image);
+  for (int plane = 0; plane < kNumberOfPlanes; ++plane)
+    cvReleaseImage(&planes_[plane]);
+}
+
+IplImage* RasPiFrame::get_image() {
+  if (image_ != NULL)
+    return image_;
+  // OpenCV orders the channels Y, Cr, Cb.
+  IplImage* ycrcb_image = cvCreateImage(cvGetSize(planes_[kLuma]),
+                                        IPL_DEPTH_8U, 3);
+  cvMerge(planes_[kLuma], planes_[kRedChroma], planes_[kBlueChroma], NULL,
+          ycrcb_image);
+  cvCvtColor(ycrcb_image, ycrcb_image, CV_YCrCb2BGR);
+  // Several threads may convert at once. The first one to finish wins.
+  if (InterlockedCompareExchangePointer(
+          reinterpret_cast<PVOID volatile*>(&image_), ycrcb_image, NULL) !=
+      NULL)
+    cvReleaseImage(&ycrcb_image);
+  return image_;
+}
+
+CvSize RasPiFrame::get_size() {
+  if (planes_[kLuma] != NULL)
+    return cvGetSize(planes_[kLuma]);
+  return cvGetSize(image_);
+}
+
+void RasPiFrame::AddRef() {
+  InterlockedIncrement(&references_);
+}
+
+void RasPiFrame::Release() {
+  if (InterlockedDecrement(&references_) == 0)
+    delete this;
+}
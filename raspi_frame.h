@@ -0,0 +1,64 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_FRAME_H_
+#define RASPICAMERA_RASPI_FRAME_H_
+
+// A decoded image shared by several consumers without copying. A RasPiFrame
+// is created with a reference count of one and deletes itself when the count
+// drops to zero. Holders MUST NOT modify the images.
+class RasPiFrame {
+ public:
+  // Planes of a frame decoded as YCbCr.
+  enum Plane { kLuma, kBlueChroma, kRedChroma, kNumberOfPlanes };
+
+  // Constructor. Takes ownership of image, a BGR image which MUST NOT be
+  // NULL. sequence is the sequence number of the received frame image was
+  // decoded from.
+  RasPiFrame(IplImage* image, LONGLONG sequence);
+  // Constructor. Takes ownership of planes, the Y, Cb and Cr planes of the
+  // frame indexed by Plane, which MUST be 1-channel IPL_DEPTH_8U images of
+  // the same size.
+  RasPiFrame(IplImage* const* planes, LONGLONG sequence);
+  // Returns the BGR image. For frames decoded as YCbCr, the image is
+  // converted from the planes on the first call and kept. Can be called from
+  // any thread.
+  IplImage* get_image();
+  // Returns the BGR image if the frame was decoded as BGR or get_image has
+  // already converted it, or NULL. Never converts.
+  IplImage* get_converted_image() { return image_; }
+  // Returns the size of the frame, without converting it to BGR.
+  CvSize get_size();
+  // Returns the plane of a frame decoded as YCbCr, or NULL for a frame
+  // decoded as BGR.
+  IplImage* get_plane(Plane plane) { return planes_[plane]; }
+  // Returns the sequence number of the frame.
+  LONGLONG get_sequence() { return sequence_; }
+  // Returns the time the Raspberry Pi captured the frame, in microseconds
+  // since 1970-01-01 UTC by its clock, or 0 if it is unknown.
+  LONGLONG get_capture_time() { return capture_time_; }
+  // Sets the capture time. MUST be called before the frame is shared.
+  void set_capture_time(LONGLONG capture_time) {
+    capture_time_ = capture_time;
+  }
+  // Adds a reference. Can be called from any thread.
+  void AddRef();
+  // Drops a reference and deletes the frame when it was the last one.
+  // Can be called from any thread.
+  void Release();
+
+ private:
+  // Destructor. Calls cvReleaseImage on image_ and planes_. Only called by
+  // Release.
+  ~RasPiFrame();
+  RasPiFrame(const RasPiFrame&);
+  void operator=(const RasPiFrame&);
+
+  // Set once, from NULL, by get_image for frames decoded as YCbCr.
+  IplImage* volatile image_;
+  IplImage* planes_[kNumberOfPlanes];
+  LONGLONG sequence_;
+  LONGLONG capture_time_;
+  volatile LONG references_;
+};
+
+#endif  // RASPICAMERA_RASPI_FRAME_H_
@@ -0,0 +1,82 @@
+// Copyright 2016
+
+#include <stdlib.h>
+
+FramePool::FramePool(int count, UINT32 max_frame_size) {
+  count_ = count;
+  max_frame_size_ = max_frame_size;
+  allocations_ = 0;
+  capacity_ = 0;
+  high_water_mark_ = 0;
+  buffers_ = new Buffer[count];
+  for (int index = 0; index < count; ++index) {
+    buffers_[index].data = NULL;
+    buffers_[index].capacity = 0;
+    buffers_[index].matrix.data.ptr = NULL;
+    buffers_[index].sequence = 0;
+    buffers_[index].capture_time = 0;
+  }
+}
+
+FramePool::~FramePool() {
+  for (int index = 0; index < count_; ++index)
+    Free(index);
+  delete[] buffers_;
+}
+
+CvMat* FramePool::Reserve(int index, UINT32 length) {
+  Buffer* buffer = &buffers_[index];
+  buffer->matrix.data.ptr = NULL;
+  if (length == 0 || length > max_frame_size_)
+    return NULL;
+  if (length > buffer->capacity) {
+    // Grow geometrically so that slowly growing frames do not reallocate on
+    // every frame.
+    UINT32 capacity = max_frame_size_;
+    if (buffer->capacity < max_frame_size_ / 2)
+      capacity = buffer->capacity * 2;
+    if (capacity < static_cast<UINT32>(kMinCapacity))
+      capacity = kMinCapacity;
+    if (capacity < length)
+      capacity = length;
+    if (capacity > max_frame_size_)
+      capacity = max_frame_size_;
+    Free(index);
+    buffer->data = static_cast<UINT8*>(malloc(capacity));
+    if (buffer->data == NULL)
+      return NULL;
+    buffer->capacity = capacity;
+    InterlockedIncrement(&allocations_);
+    LONG total = InterlockedExchangeAdd(&capacity_, capacity) + capacity;
+    // Only the thread owning a buffer grows it, but several owners may race
+    // on the mark.
+    LONG mark;
+    while ((mark = high_water_mark_) < total &&
+           InterlockedCompareExchange(&high_water_mark_, total, mark) != mark) {
+    }
+  }
+  cvInitMatHeader(&buffer->matrix, 1, length, CV_8UC1, buffer->data);
+  return &buffer->matrix;
+}
+
+CvMat* FramePool::Get(int index) {
+  if (buffers_[index].matrix.data.ptr == NULL)
+    return NULL;
+  return &buffers_[index].matrix;
+}
+
+void FramePool::GetStats(FramePoolStats* stats) {
+  stats->allocations = allocations_;
+  stats->capacity = capacity_;
+  stats->high_water_mark = high_water_mark_;
+}
+
+void FramePool::Free(int index) {
+  Buffer* buffer = &buffers_[index];
+  if (buffer->data == NULL)
+    return;
+  free(buffer->data);
+  InterlockedExchangeAdd(&capacity_, -static_cast<LONG>(buffer->capacity));
+  buffer->data = NULL;
+  buffer->capacity = 0;
+}
@@ -0,0 +1,86 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_FRAME_POOL_H_
+#define RASPICAMERA_RASPI_FRAME_POOL_H_
+
+// Counters of a FramePool. Safe to read from any thread.
+struct FramePoolStats {
+  // number of heap allocations made by the pool since its construction
+  LONG allocations;
+  // total capacity in bytes currently held by the pool
+  LONG capacity;
+  // the largest value capacity has ever reached
+  LONG high_water_mark;
+};
+
+// A fixed number of receive buffers that keep their capacity across frames.
+// Each buffer is owned by one thread at a time; the pool itself does not lock.
+// Buffers grow geometrically, so after the largest frame has been seen once
+// no more heap allocations happen.
+class FramePool {
+ public:
+  enum {
+    // smallest capacity of a buffer in bytes once it is allocated
+    kMinCapacity = 64 * 1024
+  };
+
+  // Constructor. count is the number of buffers. Frames larger than
+  // max_frame_size bytes are refused by Reserve.
+  FramePool(int count, UINT32 max_frame_size);
+  // Destructor. Frees all the buffers.
+  ~FramePool();
+  // Returns the number of buffers.
+  int get_count() { return count_; }
+  // Returns the largest frame size accepted by Reserve.
+  UINT32 get_max_frame_size() { return max_frame_size_; }
+  // Makes buffers index able to hold length bytes and returns a 1 x length
+  // CV_8UC1 matrix over it. The previous content is discarded. Returns NULL
+  // if length is zero or larger than the maximum frame size, or if the
+  // allocation fails. In that case the buffer is left empty.
+  CvMat* Reserve(int index, UINT32 length);
+  // Returns the matrix returned by the last successful Reserve(index, ...).
+  // Returns NULL if buffer index is empty.
+  CvMat* Get(int index);
+  // Returns the sequence number of the frame in buffer index.
+  LONGLONG get_sequence(int index) { return buffers_[index].sequence; }
+  // Sets the sequence number of the frame in buffer index.
+  void set_sequence(int index, LONGLONG sequence) {
+    buffers_[index].sequence = sequence;
+  }
+  // Returns the capture time of the frame in buffer index, as
+  // RasPiFrame::get_capture_time.
+  LONGLONG get_capture_time(int index) { return buffers_[index].capture_time; }
+  // Sets the capture time of the frame in buffer index.
+  void set_capture_time(int index, LONGLONG capture_time) {
+    buffers_[index].capture_time = capture_time;
+  }
+  // Copies the counters of the pool to stats. stats MUST NOT be NULL.
+  void GetStats(FramePoolStats* stats);
+
+ private:
+  struct Buffer {
+    UINT8* data;
+    UINT32 capacity;
+    // header describing the current frame. matrix.data.ptr is NULL while the
+    // buffer is empty.
+    CvMat matrix;
+    // sequence number of the current frame
+    LONGLONG sequence;
+    // capture time of the current frame, or 0 if it is unknown
+    LONGLONG capture_time;
+  };
+  // Frees buffers_[index] and updates capacity_.
+  void Free(int index);
+
+  FramePool(const FramePool&);
+  void operator=(const FramePool&);
+
+  int count_;
+  UINT32 max_frame_size_;
+  Buffer* buffers_;
+  volatile LONG allocations_;
+  volatile LONG capacity_;
+  volatile LONG high_water_mark_;
+};
+
+#endif  // RASPICAMERA_RASPI_FRAME_POOL_H_
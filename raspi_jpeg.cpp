@@ -0,0 +1,173 @@
+// Copyright 2016
+
+#include <setjmp.h>
+#include <stdio.h>
+// jmorecfg.h defines boolean as int, which windows.h already defines as
+// unsigned char. The library is built with int, so the name is changed
+// instead of the type. basetsd.h already defines INT32.
+#define boolean jpeg_boolean
+#define XMD_H
+extern "C" {
+#include <jpeglib.h>
+}
+#undef boolean
+#include "raspi_jpeg.h"
+
+namespace {
+
+// Error manager jumping back to DecodeScaledJpeg instead of exiting.
+struct JpegError {
+  jpeg_error_mgr manager;
+  jmp_buf jump;
+};
+
+void ExitOnError(j_common_ptr cinfo) {
+  (*cinfo->err->output_message)(cinfo);
+  longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+// Source manager reading the whole image from memory.
+void InitSource(j_decompress_ptr cinfo) {}
+
+jpeg_boolean FillInputBuffer(j_decompress_ptr cinfo) {
+  // The image is truncated. Ends it, so that the rows decoded so far are
+  // kept, as libjpeg does for files.
+  static const JOCTET kEndOfImage[2] = {0xFF, JPEG_EOI};
+  cinfo->src->next_input_byte = kEndOfImage;
+  cinfo->src->bytes_in_buffer = sizeof(kEndOfImage);
+  return TRUE;
+}
+
+void SkipInputData(j_decompress_ptr cinfo, long num_bytes) {
+  if (num_bytes <= 0)
+    return;
+  if (static_cast<size_t>(num_bytes) > cinfo->src->bytes_in_buffer) {
+    FillInputBuffer(cinfo);
+    return;
+  }
+  cinfo->src->next_input_byte += num_bytes;
+  cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+void TermSource(j_decompress_ptr cinfo) {}
+
+// Starts decoding the JPEG image of buffer at 1/scale of its size into
+// color_space. cinfo and source MUST outlive the decoding.
+void StartDecoding(const CvMat* buffer, int scale, J_COLOR_SPACE color_space,
+                   jpeg_decompress_struct* cinfo, jpeg_source_mgr* source) {
+  jpeg_create_decompress(cinfo);
+  source->init_source = InitSource;
+  source->fill_input_buffer = FillInputBuffer;
+  source->skip_input_data = SkipInputData;
+  source->resync_to_restart = jpeg_resync_to_restart;
+  source->term_source = TermSource;
+  source->next_input_byte = buffer->data.ptr;
+  source->bytes_in_buffer = buffer->rows * buffer->cols;
+  cinfo->src = source;
+  jpeg_read_header(cinfo, TRUE);
+  cinfo->out_color_space = color_space;
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = scale;
+  jpeg_start_decompress(cinfo);
+}
+
+// Swaps the red and blue channels of the width pixels of row.
+void SwapRedAndBlue(UINT8* row, int width) {
+  for (int x = 0; x < width; ++x) {
+    UINT8 red = row[3 * x];
+    row[3 * x] = row[3 * x + 2];
+    row[3 * x + 2] = red;
+  }
+}
+
+}  // namespace
+
+IplImage* DecodeScaledJpeg(const CvMat* buffer, int scale) {
+  jpeg_decompress_struct cinfo;
+  JpegError error;
+  jpeg_source_mgr source;
+  // Modified between setjmp and longjmp, so it MUST be volatile.
+  IplImage* volatile image = NULL;
+  cinfo.err = jpeg_std_error(&error.manager);
+  error.manager.error_exit = ExitOnError;
+  if (setjmp(error.jump)) {
+    IplImage* failed_image = image;
+    cvReleaseImage(&failed_image);
+    jpeg_destroy_decompress(&cinfo);
+    return NULL;
+  }
+  StartDecoding(buffer, scale, JCS_RGB, &cinfo, &source);
+  image = cvCreateImage(cvSize(cinfo.output_width, cinfo.output_height),
+                        IPL_DEPTH_8U, 3);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = reinterpret_cast<JSAMPROW>(
+        image->imageData + cinfo.output_scanline * image->widthStep);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    SwapRedAndBlue(row, image->width);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return image;
+}
+
+bool DecodeScaledJpegPlanes(const CvMat* buffer, int scale,
+                            IplImage** planes) {
+  jpeg_decompress_struct cinfo;
+  JpegError error;
+  jpeg_source_mgr source;
+  // Modified between setjmp and longjmp, so they MUST be volatile.
+  IplImage* volatile images[RasPiFrame::kNumberOfPlanes] = {NULL, NULL, NULL};
+  cinfo.err = jpeg_std_error(&error.manager);
+  error.manager.error_exit = ExitOnError;
+  if (setjmp(error.jump)) {
+    for (int plane = 0; plane < RasPiFrame::kNumberOfPlanes; ++plane) {
+      IplImage* failed_image = images[plane];
+      cvReleaseImage(&failed_image);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+  StartDecoding(buffer, scale, JCS_YCbCr, &cinfo, &source);
+  CvSize size = cvSize(cinfo.output_width, cinfo.output_height);
+  for (int plane = 0; plane < RasPiFrame::kNumberOfPlanes; ++plane)
+    images[plane] = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  // Freed by jpeg_destroy_decompress, even after an error.
+  JSAMPARRAY row = (*cinfo.mem->alloc_sarray)(
+      reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE,
+      cinfo.output_width * cinfo.output_components, 1);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    int y = cinfo.output_scanline;
+    jpeg_read_scanlines(&cinfo, row, 1);
+    for (int plane = 0; plane < RasPiFrame::kNumberOfPlanes; ++plane) {
+      UINT8* plane_row = reinterpret_cast<UINT8*>(
+          images[plane]->imageData + y * images[plane]->widthStep);
+      for (int x = 0; x < size.width; ++x)
+        plane_row[x] = row[0][RasPiFrame::kNumberOfPlanes * x + plane];
+    }
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  for (int plane = 0; plane < RasPiFrame::kNumberOfPlanes; ++plane)
+    planes[plane] = images[plane];
+  return true;
+}
+
+RasPiFrame* DecodeFrame(const CvMat* buffer, int scale, bool ycbcr,
+                        LONGLONG sequence) {
+  if (ycbcr) {
+    IplImage* planes[RasPiFrame::kNumberOfPlanes];
+    if (!DecodeScaledJpegPlanes(buffer, scale, planes))
+      return NULL;
+    return new RasPiFrame(planes, sequence);
+  }
+  IplImage* image;
+  if (scale == 1) {
+    image = cvDecodeImage(buffer, 1);
+  } else {
+    // cvDecodeImage only decodes at full size, so libjpeg is used directly.
+    image = DecodeScaledJpeg(buffer, scale);
+  }
+  if (image == NULL)
+    return NULL;
+  return new RasPiFrame(image, sequence);
+}
@@ -0,0 +1,26 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_JPEG_H_
+#define RASPICAMERA_RASPI_JPEG_H_
+
+// Decodes the JPEG image held by buffer, a 1-row CV_8UC1 matrix, into a new
+// 3-channel BGR IplImage the caller MUST release. The image is scaled by
+// 1/scale in the DCT domain, so most of the inverse DCT work is skipped;
+// scale MUST be 1, 2, 4 or 8 and the size is rounded up. Returns NULL if
+// buffer does not hold a valid JPEG image.
+IplImage* DecodeScaledJpeg(const CvMat* buffer, int scale);
+// Same as above, but decodes into the Y, Cb and Cr planes the JPEG image is
+// stored as, and skips the conversion to BGR. Stores three new 1-channel
+// images the caller MUST release to planes, in the order of
+// RasPiFrame::Plane, and returns true. Returns false if buffer does not hold
+// a valid JPEG image.
+bool DecodeScaledJpegPlanes(const CvMat* buffer, int scale,
+                            IplImage** planes);
+// Decodes the JPEG image held by buffer into a new RasPiFrame with sequence,
+// at 1/scale of its size as above. The frame holds the Y, Cb and Cr planes
+// if ycbcr is true, or a BGR image otherwise. Returns NULL if buffer does not
+// hold a valid JPEG image.
+RasPiFrame* DecodeFrame(const CvMat* buffer, int scale, bool ycbcr,
+                        LONGLONG sequence);
+
+#endif  // RASPICAMERA_RASPI_JPEG_H_
@@ -0,0 +1,450 @@
+// Copyright 2016
+
+#include <string.h>
+#include "raspi_kernels.h"
+
+// RASPI_NO_SSE2 selects the scalar kernels, so that they can be tested on
+// SSE2 targets too.
+#if !defined(RASPI_NO_SSE2) && \
+    (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || \
+     defined(__SSE2__))
+#define RASPI_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+enum {
+  // Y = (299 * R + 587 * G + 114 * B) / 1000, rounded.
+  kLumaRed = 299,
+  kLumaGreen = 587,
+  kLumaBlue = 114,
+  kLumaDivisor = 1000,
+  // (x * kDivideMultiplier) >> kDivideShift == x / 1000 for 0 <= x < 2^18.
+  kDivideMultiplier = 268436,
+  kDivideShift = 28,
+  // Cb = ((B - Y) * kBlueScale + kBlueOffset) >> kChromaShift and
+  // Cr = ((R - Y) * kRedScale + kRedOffset) >> kChromaShift equal
+  // cvRound(0.5643 * (B - Y) + 128) and cvRound(0.7132 * (R - Y) + 128) for
+  // every B - Y and R - Y in [-255, 255].
+  kBlueScale = 18491,
+  kBlueOffset = 4210654,
+  kRedScale = 23371,
+  kRedOffset = 4210668,
+  kChromaShift = 15,
+  // Lane pixels have mask values above this.
+  kLaneMaskThreshold = 200,
+  // Fixed-point versions of kLaneDarkness and kLaneEdge for 0 ~ 255 images.
+  // (s / 255)^2 < 0.1 is s <= 80 for integers, and |g| / 255 > 0.2 is
+  // g^2 > 51^2.
+  kLaneMaxSmoothGray = 80,
+  kLaneMinSquaredGradient = 51 * 51
+};
+
+// Lane pixels are darker than kLaneDarkness and on edges stronger than
+// kLaneEdge.
+const double kLaneDarkness = 0.1;
+const double kLaneEdge = 0.2;
+
+// Returns cvRound(0.299 * red + 0.587 * green + 0.114 * blue).
+inline int Luminance(int blue, int green, int red) {
+  int weighted = kLumaRed * red + kLumaGreen * green + kLumaBlue * blue;
+  // When the exact value ends in .5, the result depends on the rounding
+  // errors of the double formula, so it is evaluated as is.
+  if (weighted % kLumaDivisor == kLumaDivisor / 2)
+    return cvRound((0.299 * red) + (0.587 * green) + (0.114 * blue));
+  return (weighted + kLumaDivisor / 2) / kLumaDivisor;
+}
+
+// Returns value clamped to [0, 255].
+inline int Saturate(int value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// Returns the bit set of TrafficLightColor of a BGR pixel.
+inline int ClassifyPixel(int blue, int green, int red,
+                         const ChromaTable& table) {
+  int luminance = Luminance(blue, green, red);
+  int cb = ((blue - luminance) * kBlueScale + kBlueOffset) >> kChromaShift;
+  int cr = ((red - luminance) * kRedScale + kRedOffset) >> kChromaShift;
+  return table.Classify(Saturate(cb), Saturate(cr));
+}
+
+// Returns true if the pixel with the given values is a lane pixel.
+inline bool IsLanePixel(float darkness, float edge, UINT8 mask) {
+  return darkness < kLaneDarkness && edge > kLaneEdge &&
+         mask > kLaneMaskThreshold;
+}
+
+// Returns true if the pixel with the given fixed-point values is a lane
+// pixel.
+inline bool IsLanePixel(UINT8 smooth_gray, short gradient_x, short gradient_y,
+                        UINT8 mask) {
+  return smooth_gray <= kLaneMaxSmoothGray &&
+         gradient_x * gradient_x + gradient_y * gradient_y >
+             kLaneMinSquaredGradient &&
+         mask > kLaneMaskThreshold;
+}
+
+// Paints the pixel at x of the BGR row magenta.
+inline void PaintMagenta(UINT8* row, int x) {
+  row[3 * x] = 255;
+  row[3 * x + 1] = 0;
+  row[3 * x + 2] = 255;
+}
+
+// Paints the pixels at x + i of the BGR row magenta for every bit i set in
+// lanes.
+inline void PaintSixteenPixels(int lanes, UINT8* row, int x) {
+  if (lanes == 0)
+    return;
+  // SSE2 has no byte shuffle to spread the mask over 3-channel pixels, so
+  // the few lane pixels are painted one by one.
+  for (int index = 0; index < 16; ++index) {
+    if (lanes & (1 << index))
+      PaintMagenta(row, x + index);
+  }
+}
+
+// Adds the pixel at (x, y) to the sums of its colors in tile_row.
+inline void AddPixel(int colors, int x, int y, int tile_size,
+                     TileColorSums* tile_row) {
+  TileColorSums* tile = &tile_row[x / tile_size];
+  for (int color = 0; color < kNumberOfColors; ++color) {
+    if (colors & (1 << color)) {
+      tile->colors[color].count++;
+      tile->colors[color].sum_x += x;
+      tile->colors[color].sum_y += y;
+    }
+  }
+}
+
+#ifdef RASPI_SSE2
+
+// Splits 32 interleaved 3-channel pixels in v0..v5 into 16 pixels per
+// register and channel: v0, v1 get the first channel, v2, v3 the second and
+// v4, v5 the third.
+inline void Deinterleave(__m128i* v0, __m128i* v1, __m128i* v2, __m128i* v3,
+                         __m128i* v4, __m128i* v5) {
+  __m128i a0 = _mm_unpacklo_epi8(*v0, *v3);
+  __m128i a1 = _mm_unpackhi_epi8(*v0, *v3);
+  __m128i a2 = _mm_unpacklo_epi8(*v1, *v4);
+  __m128i a3 = _mm_unpackhi_epi8(*v1, *v4);
+  __m128i a4 = _mm_unpacklo_epi8(*v2, *v5);
+  __m128i a5 = _mm_unpackhi_epi8(*v2, *v5);
+  // Every round of unpacking halves the distance between the bytes of a
+  // channel. Five rounds in all gather each channel into two registers.
+  for (int round = 0; round < 3; ++round) {
+    __m128i b0 = _mm_unpacklo_epi8(a0, a3);
+    __m128i b1 = _mm_unpackhi_epi8(a0, a3);
+    __m128i b2 = _mm_unpacklo_epi8(a1, a4);
+    __m128i b3 = _mm_unpackhi_epi8(a1, a4);
+    __m128i b4 = _mm_unpacklo_epi8(a2, a5);
+    __m128i b5 = _mm_unpackhi_epi8(a2, a5);
+    a0 = b0; a1 = b1; a2 = b2; a3 = b3; a4 = b4; a5 = b5;
+  }
+  *v0 = _mm_unpacklo_epi8(a0, a3);
+  *v1 = _mm_unpackhi_epi8(a0, a3);
+  *v2 = _mm_unpacklo_epi8(a1, a4);
+  *v3 = _mm_unpackhi_epi8(a1, a4);
+  *v4 = _mm_unpacklo_epi8(a2, a5);
+  *v5 = _mm_unpackhi_epi8(a2, a5);
+}
+
+// Returns x / 1000 for every 32-bit lane, 0 <= x < 2^18.
+inline __m128i DivideByLumaDivisor(__m128i x) {
+  const __m128i multiplier = _mm_set1_epi32(kDivideMultiplier);
+  __m128i even = _mm_srli_epi64(_mm_mul_epu32(x, multiplier), kDivideShift);
+  __m128i odd = _mm_srli_epi64(
+      _mm_mul_epu32(_mm_srli_epi64(x, 32), multiplier), kDivideShift);
+  return _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+}
+
+// Returns (d * scale + offset) >> kChromaShift for every 16-bit lane.
+inline __m128i Chroma(__m128i difference, int scale, int offset) {
+  const __m128i scale16 = _mm_set1_epi16(static_cast<short>(scale));
+  const __m128i offset32 = _mm_set1_epi32(offset);
+  __m128i low = _mm_mullo_epi16(difference, scale16);
+  __m128i high = _mm_mulhi_epi16(difference, scale16);
+  __m128i chroma_low = _mm_srai_epi32(
+      _mm_add_epi32(_mm_unpacklo_epi16(low, high), offset32), kChromaShift);
+  __m128i chroma_high = _mm_srai_epi32(
+      _mm_add_epi32(_mm_unpackhi_epi16(low, high), offset32), kChromaShift);
+  return _mm_packs_epi32(chroma_low, chroma_high);
+}
+
+// Computes Cb and Cr of 8 pixels given as 16-bit lanes.
+inline void ChromaOfEightPixels(__m128i blue, __m128i green, __m128i red,
+                                __m128i* cb, __m128i* cr) {
+  const __m128i red_green_weights =
+      _mm_set1_epi32((kLumaGreen << 16) | kLumaRed);
+  const __m128i blue_weights =
+      _mm_set1_epi32(((kLumaDivisor / 2) << 16) | kLumaBlue);
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i divisor = _mm_set1_epi32(kLumaDivisor);
+  // 299 * R + 587 * G + 114 * B + 500 as 32-bit lanes.
+  __m128i biased_low = _mm_add_epi32(
+      _mm_madd_epi16(_mm_unpacklo_epi16(red, green), red_green_weights),
+      _mm_madd_epi16(_mm_unpacklo_epi16(blue, one), blue_weights));
+  __m128i biased_high = _mm_add_epi32(
+      _mm_madd_epi16(_mm_unpackhi_epi16(red, green), red_green_weights),
+      _mm_madd_epi16(_mm_unpackhi_epi16(blue, one), blue_weights));
+  __m128i luminance_low = DivideByLumaDivisor(biased_low);
+  __m128i luminance_high = DivideByLumaDivisor(biased_high);
+  __m128i luminance = _mm_packs_epi32(luminance_low, luminance_high);
+  // Exact halves, see Luminance. luminance fits in 16 bits, so madd with
+  // (1000, 0) pairs multiplies it by 1000.
+  __m128i halves = _mm_packs_epi32(
+      _mm_cmpeq_epi32(biased_low, _mm_madd_epi16(luminance_low, divisor)),
+      _mm_cmpeq_epi32(biased_high, _mm_madd_epi16(luminance_high, divisor)));
+  if (_mm_movemask_epi8(halves) != 0) {
+    short blues[8], greens[8], reds[8], luminances[8], is_half[8];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(blues), blue);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(greens), green);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(reds), red);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(luminances), luminance);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(is_half), halves);
+    for (int lane = 0; lane < 8; ++lane) {
+      if (is_half[lane])
+        luminances[lane] = static_cast<short>(
+            Luminance(blues[lane], greens[lane], reds[lane]));
+    }
+    luminance = _mm_loadu_si128(reinterpret_cast<__m128i*>(luminances));
+  }
+  *cb = Chroma(_mm_sub_epi16(blue, luminance), kBlueScale, kBlueOffset);
+  *cr = Chroma(_mm_sub_epi16(red, luminance), kRedScale, kRedOffset);
+}
+
+// Stores Cb and Cr of 16 pixels given as bytes to cb and cr, clamped to
+// [0, 255].
+inline void ChromaOfSixteenPixels(__m128i blue, __m128i green, __m128i red,
+                                  UINT8* cb, UINT8* cr) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i cb_low, cr_low, cb_high, cr_high;
+  ChromaOfEightPixels(_mm_unpacklo_epi8(blue, zero),
+                      _mm_unpacklo_epi8(green, zero),
+                      _mm_unpacklo_epi8(red, zero), &cb_low, &cr_low);
+  ChromaOfEightPixels(_mm_unpackhi_epi8(blue, zero),
+                      _mm_unpackhi_epi8(green, zero),
+                      _mm_unpackhi_epi8(red, zero), &cb_high, &cr_high);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(cb),
+                   _mm_packus_epi16(cb_low, cb_high));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(cr),
+                   _mm_packus_epi16(cr_low, cr_high));
+}
+
+// Returns a mask of the 16 pixels starting at darkness, edge and mask that
+// are lane pixels, one byte per pixel.
+inline __m128i LaneMaskOfSixteenPixels(const float* darkness,
+                                       const float* edge, const UINT8* mask) {
+  // Floats are compared against the double bounds, and no float equals
+  // them, so f < 0.1 is f < 0.1f and f > 0.2 is f >= 0.2f.
+  const __m128i mask_threshold = _mm_set1_epi8(
+      static_cast<char>(kLaneMaskThreshold + 1));
+  const __m128 darkness_bound = _mm_set1_ps(static_cast<float>(kLaneDarkness));
+  const __m128 edge_bound = _mm_set1_ps(static_cast<float>(kLaneEdge));
+  __m128i quarters[4];
+  for (int quarter = 0; quarter < 4; ++quarter) {
+    __m128 lane = _mm_and_ps(
+        _mm_cmplt_ps(_mm_loadu_ps(darkness + 4 * quarter), darkness_bound),
+        _mm_cmpge_ps(_mm_loadu_ps(edge + 4 * quarter), edge_bound));
+    quarters[quarter] = _mm_castps_si128(lane);
+  }
+  __m128i float_mask = _mm_packs_epi16(
+      _mm_packs_epi32(quarters[0], quarters[1]),
+      _mm_packs_epi32(quarters[2], quarters[3]));
+  // mask > 200 is max(mask, 201) == mask for unsigned bytes.
+  __m128i masks = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+  return _mm_and_si128(float_mask, _mm_cmpeq_epi8(
+      _mm_max_epu8(masks, mask_threshold), masks));
+}
+
+// Returns a mask of the 16 pixels starting at smooth_gray, gradient_x,
+// gradient_y and mask that are lane pixels, one byte per pixel.
+inline __m128i LaneMaskOfSixteenPixels(const UINT8* smooth_gray,
+                                       const short* gradient_x,
+                                       const short* gradient_y,
+                                       const UINT8* mask) {
+  const __m128i mask_threshold = _mm_set1_epi8(
+      static_cast<char>(kLaneMaskThreshold + 1));
+  const __m128i max_smooth_gray = _mm_set1_epi8(
+      static_cast<char>(kLaneMaxSmoothGray));
+  const __m128i min_squared_gradient = _mm_set1_epi32(kLaneMinSquaredGradient);
+  __m128i halves[2];
+  for (int half = 0; half < 2; ++half) {
+    __m128i x = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(gradient_x + 8 * half));
+    __m128i y = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(gradient_y + 8 * half));
+    // madd of interleaved (x, y) pairs with themselves is x^2 + y^2, which
+    // fits in 32 bits for 3x3 Sobel results of 8-bit images.
+    __m128i low = _mm_unpacklo_epi16(x, y);
+    __m128i high = _mm_unpackhi_epi16(x, y);
+    halves[half] = _mm_packs_epi32(
+        _mm_cmpgt_epi32(_mm_madd_epi16(low, low), min_squared_gradient),
+        _mm_cmpgt_epi32(_mm_madd_epi16(high, high), min_squared_gradient));
+  }
+  __m128i gradient_mask = _mm_packs_epi16(halves[0], halves[1]);
+  // For unsigned bytes, s <= 80 is min(s, 80) == s and mask > 200 is
+  // max(mask, 201) == mask.
+  __m128i grays = _mm_loadu_si128(
+      reinterpret_cast<const __m128i*>(smooth_gray));
+  __m128i masks = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask));
+  return _mm_and_si128(
+      _mm_and_si128(gradient_mask, _mm_cmpeq_epi8(
+          _mm_min_epu8(grays, max_smooth_gray), grays)),
+      _mm_cmpeq_epi8(_mm_max_epu8(masks, mask_threshold), masks));
+}
+
+#endif  // RASPI_SSE2
+
+}  // namespace
+
+const ChromaRange kDefaultChromaRanges[kNumberOfColors] = {
+  {90, 120, 190, 215},  // kRed
+  {20, 70, 130, 150},   // kYellow
+  {105, 140, 50, 90}    // kGreen
+};
+
+ChromaTable::ChromaTable() {
+  Build(kDefaultChromaRanges);
+}
+
+void ChromaTable::Build(const ChromaRange* ranges) {
+  for (int cb = 0; cb < 256; ++cb) {
+    for (int cr = 0; cr < 256; ++cr) {
+      int colors = 0;
+      for (int color = 0; color < kNumberOfColors; ++color) {
+        if ((ranges[color].min_cb < cb && cb < ranges[color].max_cb) &&
+            (ranges[color].min_cr < cr && cr < ranges[color].max_cr))
+          colors |= 1 << color;
+      }
+      colors_[(cb << 8) | cr] = static_cast<UINT8>(colors);
+    }
+  }
+}
+
+void SumTrafficLightColors(const IplImage* image, int rows, int tile_size,
+                           const ChromaTable& table, TileColorSums* tiles) {
+  SumTrafficLightColors(image, tile_size, table, 0,
+                        CountTiles(rows, tile_size), tiles);
+}
+
+void SumTrafficLightColors(const IplImage* image, int tile_size,
+                           const ChromaTable& table, int first_tile_row,
+                           int last_tile_row, TileColorSums* tiles) {
+  int tile_columns = CountTiles(image->width, tile_size);
+  memset(tiles + first_tile_row * tile_columns, 0,
+         sizeof(*tiles) * (last_tile_row - first_tile_row) * tile_columns);
+  int last_row = MIN(last_tile_row * tile_size, image->height);
+  for (int y = first_tile_row * tile_size; y < last_row; ++y) {
+    const UINT8* row = reinterpret_cast<const UINT8*>(
+        image->imageData + y * image->widthStep);
+    TileColorSums* tile_row = tiles + (y / tile_size) * tile_columns;
+    int x = 0;
+#ifdef RASPI_SSE2
+    UINT8 cb[32], cr[32];
+    for (; x + 32 <= image->width; x += 32) {
+      const __m128i* pixels = reinterpret_cast<const __m128i*>(row + 3 * x);
+      __m128i blue0 = _mm_loadu_si128(pixels);
+      __m128i blue1 = _mm_loadu_si128(pixels + 1);
+      __m128i green0 = _mm_loadu_si128(pixels + 2);
+      __m128i green1 = _mm_loadu_si128(pixels + 3);
+      __m128i red0 = _mm_loadu_si128(pixels + 4);
+      __m128i red1 = _mm_loadu_si128(pixels + 5);
+      Deinterleave(&blue0, &blue1, &green0, &green1, &red0, &red1);
+      ChromaOfSixteenPixels(blue0, green0, red0, cb, cr);
+      ChromaOfSixteenPixels(blue1, green1, red1, cb + 16, cr + 16);
+      for (int index = 0; index < 32; ++index) {
+        int colors = table.Classify(cb[index], cr[index]);
+        if (colors != 0)
+          AddPixel(colors, x + index, y, tile_size, tile_row);
+      }
+    }
+#endif  // RASPI_SSE2
+    for (; x < image->width; ++x) {
+      const UINT8* pixel = row + 3 * x;
+      int colors = ClassifyPixel(pixel[0], pixel[1], pixel[2], table);
+      if (colors != 0)
+        AddPixel(colors, x, y, tile_size, tile_row);
+    }
+  }
+}
+
+void SumTrafficLightColors(const IplImage* blue_chroma,
+                           const IplImage* red_chroma, int tile_size,
+                           const ChromaTable& table, int first_tile_row,
+                           int last_tile_row, TileColorSums* tiles) {
+  int tile_columns = CountTiles(blue_chroma->width, tile_size);
+  memset(tiles + first_tile_row * tile_columns, 0,
+         sizeof(*tiles) * (last_tile_row - first_tile_row) * tile_columns);
+  int last_row = MIN(last_tile_row * tile_size, blue_chroma->height);
+  for (int y = first_tile_row * tile_size; y < last_row; ++y) {
+    const UINT8* cb = reinterpret_cast<const UINT8*>(
+        blue_chroma->imageData + y * blue_chroma->widthStep);
+    const UINT8* cr = reinterpret_cast<const UINT8*>(
+        red_chroma->imageData + y * red_chroma->widthStep);
+    TileColorSums* tile_row = tiles + (y / tile_size) * tile_columns;
+    for (int x = 0; x < blue_chroma->width; ++x) {
+      int colors = table.Classify(cb[x], cr[x]);
+      if (colors != 0)
+        AddPixel(colors, x, y, tile_size, tile_row);
+    }
+  }
+}
+
+void MarkLanePixels(const IplImage* darkness, const IplImage* edge,
+                    const IplImage* mask, int first_row, int last_row,
+                    int top, IplImage* image) {
+  last_row = MIN(last_row, MIN(darkness->height, image->height - top));
+  for (int y = first_row; y < last_row; ++y) {
+    const float* darkness_row = reinterpret_cast<const float*>(
+        darkness->imageData + y * darkness->widthStep);
+    const float* edge_row = reinterpret_cast<const float*>(
+        edge->imageData + y * edge->widthStep);
+    const UINT8* mask_row = reinterpret_cast<const UINT8*>(
+        mask->imageData + y * mask->widthStep);
+    UINT8* row = reinterpret_cast<UINT8*>(
+        image->imageData + (top + y) * image->widthStep);
+    int x = 0;
+#ifdef RASPI_SSE2
+    for (; x + 16 <= darkness->width; x += 16) {
+      PaintSixteenPixels(_mm_movemask_epi8(LaneMaskOfSixteenPixels(
+          darkness_row + x, edge_row + x, mask_row + x)), row, x);
+    }
+#endif  // RASPI_SSE2
+    for (; x < darkness->width; ++x) {
+      if (IsLanePixel(darkness_row[x], edge_row[x], mask_row[x]))
+        PaintMagenta(row, x);
+    }
+  }
+}
+
+void MarkLanePixels(const IplImage* smooth_gray, const IplImage* gradient_x,
+                    const IplImage* gradient_y, const IplImage* mask,
+                    int first_row, int last_row, int top, IplImage* image) {
+  last_row = MIN(last_row, MIN(smooth_gray->height, image->height - top));
+  for (int y = first_row; y < last_row; ++y) {
+    const UINT8* gray_row = reinterpret_cast<const UINT8*>(
+        smooth_gray->imageData + y * smooth_gray->widthStep);
+    const short* x_row = reinterpret_cast<const short*>(
+        gradient_x->imageData + y * gradient_x->widthStep);
+    const short* y_row = reinterpret_cast<const short*>(
+        gradient_y->imageData + y * gradient_y->widthStep);
+    const UINT8* mask_row = reinterpret_cast<const UINT8*>(
+        mask->imageData + y * mask->widthStep);
+    UINT8* row = reinterpret_cast<UINT8*>(
+        image->imageData + (top + y) * image->widthStep);
+    int x = 0;
+#ifdef RASPI_SSE2
+    for (; x + 16 <= smooth_gray->width; x += 16) {
+      PaintSixteenPixels(_mm_movemask_epi8(LaneMaskOfSixteenPixels(
+          gray_row + x, x_row + x, y_row + x, mask_row + x)), row, x);
+    }
+#endif  // RASPI_SSE2
+    for (; x < smooth_gray->width; ++x) {
+      if (IsLanePixel(gray_row[x], x_row[x], y_row[x], mask_row[x]))
+        PaintMagenta(row, x);
+    }
+  }
+}
@@ -0,0 +1,110 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_KERNELS_H_
+#define RASPICAMERA_RASPI_KERNELS_H_
+
+// Pixel kernels of ProcessImage working directly on image rows. When the
+// compiler targets SSE2, 16 or 32 pixels are processed at once; otherwise,
+// or if RASPI_NO_SSE2 is defined, a scalar version with identical results
+// is used.
+
+// Colors of traffic lights.
+enum TrafficLightColor { kRed, kYellow, kGreen, kNumberOfColors };
+
+// Number of pixels of one color inside a tile and the sums of their
+// coordinates.
+struct ColorSum {
+  int count;
+  int sum_x;
+  int sum_y;
+};
+
+// Color sums of one tile, indexed by TrafficLightColor.
+struct TileColorSums {
+  ColorSum colors[kNumberOfColors];
+};
+
+// Cb/Cr window of a traffic light color. A pixel belongs to the color if
+// min_cb < Cb < max_cb and min_cr < Cr < max_cr. Bounds are between 0 and 255.
+struct ChromaRange {
+  int min_cb;
+  int max_cb;
+  int min_cr;
+  int max_cr;
+};
+
+// Windows of the traffic light colors tuned for the test track, indexed by
+// TrafficLightColor.
+extern const ChromaRange kDefaultChromaRanges[kNumberOfColors];
+
+// A 256 x 256 table mapping Cb and Cr to the bit set of TrafficLightColor
+// they belong to, so that classifying a pixel is a single load.
+class ChromaTable {
+ public:
+  // Constructor. Builds the table from kDefaultChromaRanges.
+  ChromaTable();
+  // Rebuilds the table from ranges, indexed by TrafficLightColor. ranges MUST
+  // hold kNumberOfColors entries.
+  void Build(const ChromaRange* ranges);
+  // Returns the bit set of TrafficLightColor of cb and cr, both in [0, 255].
+  int Classify(int cb, int cr) const { return colors_[(cb << 8) | cr]; }
+
+ private:
+  UINT8 colors_[256 * 256];
+};
+
+// Returns the number of tiles of tile_size pixels needed to cover length
+// pixels.
+inline int CountTiles(int length, int tile_size) {
+  return (length + tile_size - 1) / tile_size;
+}
+
+// Classifies every pixel of the tiles covering rows [0, rows) of image into
+// traffic light colors with table and sums them per tile. image MUST be a
+// 3-channel IPL_DEPTH_8U BGR image. Tiles are tile_size x tile_size squares
+// starting at the top-left corner; the last tile row may extend below rows and
+// is only clipped by the image. tiles MUST hold CountTiles(rows, tile_size) x
+// CountTiles(image->width, tile_size) entries and is filled in row-major
+// order. Cb and Cr are computed in fixed point and match
+// cvRound(0.5643 * (B - Y) + 128) and cvRound(0.7132 * (R - Y) + 128), with
+// Y = cvRound(0.299 * R + 0.587 * G + 0.114 * B), for every pixel. They are
+// clamped to [0, 255] before the lookup, which does not change the result
+// for bounds in that range.
+void SumTrafficLightColors(const IplImage* image, int rows, int tile_size,
+                           const ChromaTable& table, TileColorSums* tiles);
+// Same as above, but only fills the tile rows [first_tile_row,
+// last_tile_row) of tiles, so that disjoint tile rows can be filled by
+// different threads.
+void SumTrafficLightColors(const IplImage* image, int tile_size,
+                           const ChromaTable& table, int first_tile_row,
+                           int last_tile_row, TileColorSums* tiles);
+// Same as above, from the Cb and Cr planes of the image, which MUST be
+// 1-channel IPL_DEPTH_8U images of the same size. The planes are looked up
+// in table as they are.
+void SumTrafficLightColors(const IplImage* blue_chroma,
+                           const IplImage* red_chroma, int tile_size,
+                           const ChromaTable& table, int first_tile_row,
+                           int last_tile_row, TileColorSums* tiles);
+
+// Paints the lane pixels in rows [first_row, last_row) of darkness, edge and
+// mask magenta on image. Row y of darkness, edge and mask corresponds to row
+// top + y of image, and a pixel is a lane pixel if darkness < 0.1,
+// edge > 0.2 and mask > 200 there. darkness and edge MUST be
+// 1-channel IPL_DEPTH_32F images and mask a 1-channel IPL_DEPTH_8U image, all
+// of the same size, and image a 3-channel IPL_DEPTH_8U BGR image at least as
+// wide. Rows beyond the bottom of image are ignored.
+void MarkLanePixels(const IplImage* darkness, const IplImage* edge,
+                    const IplImage* mask, int first_row, int last_row,
+                    int top, IplImage* image);
+// Same as above, from the fixed-point images of the lane roi. smooth_gray is
+// the smoothed 0 ~ 255 gray image and gradient_x and gradient_y its 3x3 Sobel
+// derivatives. A pixel is a lane pixel if smooth_gray <= 80,
+// gradient_x^2 + gradient_y^2 > 51^2 and mask > 200 there, which are the
+// bounds of darkness and edge above scaled by 255. smooth_gray and mask MUST
+// be 1-channel IPL_DEPTH_8U images and gradient_x and gradient_y 1-channel
+// IPL_DEPTH_16S images, all of the same size.
+void MarkLanePixels(const IplImage* smooth_gray, const IplImage* gradient_x,
+                    const IplImage* gradient_y, const IplImage* mask,
+                    int first_row, int last_row, int top, IplImage* image);
+
+#endif  // RASPICAMERA_RASPI_KERNELS_H_
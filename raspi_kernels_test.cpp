@@ -0,0 +1,235 @@
+// Copyright 2016
+
+// Checks the pixel kernels of raspi_kernels against the float formulas they
+// stand for. Built twice by "make check": once with the SSE2 kernels and once
+// with RASPI_NO_SSE2, so that both versions are compared. Prints the first
+// mismatch and exits with EXIT_FAILURE if there is one.
+
+#include <math.h>
+#include <string.h>
+#include <vector>
+#include <opencv/cxcore.h>
+#include "raspi_kernels.h"
+
+namespace {
+
+// Odd widths leave a scalar tail after the 16 and 32 pixel blocks.
+const int kWidth = 1001;
+const int kRows = 67;
+const int kTileSize = 40;
+// Number of random chroma tables the traffic light colors are checked with.
+const int kRandomTables = 16;
+
+// Returns a random integer in [low, high].
+int Random(int low, int high) {
+  return low + rand() % (high - low + 1);
+}
+
+// Returns the bit set of TrafficLightColor of a BGR pixel, as documented by
+// SumTrafficLightColors.
+int ReferenceColors(int blue, int green, int red, const ChromaTable& table) {
+  int luminance = cvRound(0.299 * red + 0.587 * green + 0.114 * blue);
+  int cb = cvRound(0.5643 * (blue - luminance) + 128);
+  int cr = cvRound(0.7132 * (red - luminance) + 128);
+  cb = MIN(MAX(cb, 0), 255);
+  cr = MIN(MAX(cr, 0), 255);
+  return table.Classify(cb, cr);
+}
+
+// Sums the colors of image as SumTrafficLightColors documents it.
+void ReferenceSums(const IplImage* image, int tile_size,
+                   const ChromaTable& table,
+                   std::vector<TileColorSums>* tiles) {
+  int tile_columns = CountTiles(image->width, tile_size);
+  tiles->assign(CountTiles(image->height, tile_size) * tile_columns,
+                TileColorSums());
+  for (int y = 0; y < image->height; ++y) {
+    const UINT8* row = reinterpret_cast<const UINT8*>(
+        image->imageData + y * image->widthStep);
+    for (int x = 0; x < image->width; ++x) {
+      int colors = ReferenceColors(row[3 * x], row[3 * x + 1],
+                                   row[3 * x + 2], table);
+      TileColorSums* tile =
+          &(*tiles)[(y / tile_size) * tile_columns + x / tile_size];
+      for (int color = 0; color < kNumberOfColors; ++color) {
+        if (colors & (1 << color)) {
+          tile->colors[color].count++;
+          tile->colors[color].sum_x += x;
+          tile->colors[color].sum_y += y;
+        }
+      }
+    }
+  }
+}
+
+// Returns true if SumTrafficLightColors matches ReferenceSums on image.
+// name identifies the case in the failure message.
+bool CheckTrafficLightColors(const IplImage* image, int tile_size,
+                             const ChromaTable& table, const char* name) {
+  std::vector<TileColorSums> expected;
+  ReferenceSums(image, tile_size, table, &expected);
+  std::vector<TileColorSums> tiles(expected.size());
+  // Filled in two parts, as the tasks of ProcessContext do.
+  int tile_rows = CountTiles(image->height, tile_size);
+  SumTrafficLightColors(image, tile_size, table, 0, tile_rows / 2, &tiles[0]);
+  SumTrafficLightColors(image, tile_size, table, tile_rows / 2, tile_rows,
+                        &tiles[0]);
+  for (size_t index = 0; index < tiles.size(); ++index) {
+    for (int color = 0; color < kNumberOfColors; ++color) {
+      const ColorSum& sum = tiles[index].colors[color];
+      const ColorSum& want = expected[index].colors[color];
+      if (sum.count != want.count || sum.sum_x != want.sum_x ||
+          sum.sum_y != want.sum_y) {
+        fprintf(stderr, "%s: tile %d color %d: count %d sum (%d, %d), "
+                "expected %d (%d, %d)\n", name, static_cast<int>(index),
+                color, sum.count, sum.sum_x, sum.sum_y, want.count,
+                want.sum_x, want.sum_y);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Checks every BGR value with the default table, one pixel per tile, and
+// random images with random tables.
+bool CheckTrafficLights() {
+  ChromaTable table;
+  // 4096 x 64 pixels hold 2^18 values, so 64 images cover all 2^24.
+  IplImage* image = cvCreateImage(cvSize(4096, 64), IPL_DEPTH_8U, 3);
+  for (int blue_high = 0; blue_high < 64; ++blue_high) {
+    for (int y = 0; y < image->height; ++y) {
+      UINT8* row = reinterpret_cast<UINT8*>(
+          image->imageData + y * image->widthStep);
+      for (int x = 0; x < image->width; ++x) {
+        row[3 * x] = static_cast<UINT8>(blue_high * 4 + (x >> 10));
+        row[3 * x + 1] = static_cast<UINT8>(x);
+        row[3 * x + 2] = static_cast<UINT8>(y * 4 + ((x >> 8) & 3));
+      }
+    }
+    if (!CheckTrafficLightColors(image, 1, table, "every color")) {
+      cvReleaseImage(&image);
+      return false;
+    }
+  }
+  cvReleaseImage(&image);
+
+  image = cvCreateImage(cvSize(kWidth, kRows), IPL_DEPTH_8U, 3);
+  for (int round = 0; round < kRandomTables; ++round) {
+    ChromaRange ranges[kNumberOfColors];
+    for (int color = 0; color < kNumberOfColors; ++color) {
+      ranges[color].min_cb = Random(0, 200);
+      ranges[color].max_cb = Random(ranges[color].min_cb, 255);
+      ranges[color].min_cr = Random(0, 200);
+      ranges[color].max_cr = Random(ranges[color].min_cr, 255);
+    }
+    table.Build(ranges);
+    for (int y = 0; y < image->height; ++y) {
+      UINT8* row = reinterpret_cast<UINT8*>(
+          image->imageData + y * image->widthStep);
+      for (int x = 0; x < 3 * image->width; ++x)
+        row[x] = static_cast<UINT8>(Random(0, 255));
+    }
+    if (!CheckTrafficLightColors(image, kTileSize, table, "random colors")) {
+      cvReleaseImage(&image);
+      return false;
+    }
+  }
+  cvReleaseImage(&image);
+  return true;
+}
+
+// Returns true if the magenta pixels of image, from row top on, are exactly
+// those for which is_lane is set. name identifies the case in the failure
+// message.
+bool CheckMagenta(const IplImage* image, int top,
+                  const std::vector<bool>& is_lane, const char* name) {
+  for (int y = 0; y < image->height - top; ++y) {
+    const UINT8* row = reinterpret_cast<const UINT8*>(
+        image->imageData + (top + y) * image->widthStep);
+    for (int x = 0; x < image->width; ++x) {
+      bool magenta = row[3 * x] == 255 && row[3 * x + 1] == 0 &&
+                     row[3 * x + 2] == 255;
+      if (magenta != is_lane[y * image->width + x]) {
+        fprintf(stderr, "%s: pixel (%d, %d) is %smarked\n", name, x, y,
+                magenta ? "wrongly " : "not ");
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Checks both MarkLanePixels against the thresholds of the float edges on
+// values crowded around them.
+bool CheckLanePixels() {
+  // The roi is the lower half of image, as in ProcessContext.
+  int top = kRows;
+  CvSize size = cvSize(kWidth, kRows);
+  IplImage* image = cvCreateImage(cvSize(kWidth, top + kRows), IPL_DEPTH_8U,
+                                  3);
+  IplImage* mask = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  IplImage* darkness = cvCreateImage(size, IPL_DEPTH_32F, 1);
+  IplImage* edge = cvCreateImage(size, IPL_DEPTH_32F, 1);
+  IplImage* smooth_gray = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  IplImage* gradient_x = cvCreateImage(size, IPL_DEPTH_16S, 1);
+  IplImage* gradient_y = cvCreateImage(size, IPL_DEPTH_16S, 1);
+  std::vector<bool> float_lanes(kWidth * kRows);
+  std::vector<bool> fixed_lanes(kWidth * kRows);
+  for (int y = 0; y < kRows; ++y) {
+    for (int x = 0; x < kWidth; ++x) {
+      UINT8 mask_value = static_cast<UINT8>(Random(195, 205));
+      float darkness_value = static_cast<float>(0.1 + Random(-3, 3) * 1e-8);
+      float edge_value = static_cast<float>(0.2 + Random(-3, 3) * 1e-8);
+      UINT8 gray = static_cast<UINT8>(Random(77, 83));
+      short dx = static_cast<short>(Random(-60, 60));
+      short dy = static_cast<short>(Random(-60, 60));
+      CV_IMAGE_ELEM(mask, UINT8, y, x) = mask_value;
+      CV_IMAGE_ELEM(darkness, float, y, x) = darkness_value;
+      CV_IMAGE_ELEM(edge, float, y, x) = edge_value;
+      CV_IMAGE_ELEM(smooth_gray, UINT8, y, x) = gray;
+      CV_IMAGE_ELEM(gradient_x, short, y, x) = dx;
+      CV_IMAGE_ELEM(gradient_y, short, y, x) = dy;
+      float_lanes[y * kWidth + x] = darkness_value < 0.1 &&
+                                    edge_value > 0.2 && mask_value > 200;
+      // The float edges square the 0. ~ 1. brightness and take the
+      // magnitude of the gradient.
+      double brightness = gray / 255.0;
+      fixed_lanes[y * kWidth + x] =
+          brightness * brightness < 0.1 &&
+          sqrt(static_cast<double>(dx * dx + dy * dy)) / 255.0 > 0.2 &&
+          mask_value > 200;
+    }
+  }
+  // Marked in two bands, as the tasks of ProcessContext do.
+  bool passed = true;
+  memset(image->imageData, 0, image->imageSize);
+  MarkLanePixels(darkness, edge, mask, 0, kRows / 2, top, image);
+  MarkLanePixels(darkness, edge, mask, kRows / 2, kRows, top, image);
+  passed = passed && CheckMagenta(image, top, float_lanes, "float lanes");
+  memset(image->imageData, 0, image->imageSize);
+  MarkLanePixels(smooth_gray, gradient_x, gradient_y, mask, 0, kRows / 2,
+                 top, image);
+  MarkLanePixels(smooth_gray, gradient_x, gradient_y, mask, kRows / 2, kRows,
+                 top, image);
+  passed = passed && CheckMagenta(image, top, fixed_lanes, "fixed lanes");
+  cvReleaseImage(&gradient_y);
+  cvReleaseImage(&gradient_x);
+  cvReleaseImage(&smooth_gray);
+  cvReleaseImage(&edge);
+  cvReleaseImage(&darkness);
+  cvReleaseImage(&mask);
+  cvReleaseImage(&image);
+  return passed;
+}
+
+}  // namespace
+
+int main() {
+  srand(1);
+  bool passed = CheckTrafficLights();
+  passed = CheckLanePixels() && passed;
+  puts(passed ? "The kernels match the reference." :
+                "The kernels do not match the reference.");
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,169 @@
+// Copyright 2016
+
+#include <math.h>
+#include <stdlib.h>
+#include <opencv/cv.h>
+#include "raspi_lane_tracker.h"
+
+namespace {
+
+// Theta resolution of the Hough transforms, one degree.
+const double kThetaStep = CV_PI / 180;
+// Mask value above which edge pixels vote.
+const int kMaskThreshold = 200;
+
+// Returns the index of the one degree step closest to theta.
+int ThetaIndex(float theta) {
+  return cvRound(theta / kThetaStep);
+}
+
+}  // namespace
+
+LaneTracker::LaneTracker() {
+  frames_since_search_ = 0;
+  masked_edges_ = NULL;
+}
+
+LaneTracker::~LaneTracker() {
+  cvReleaseImage(&masked_edges_);
+}
+
+void LaneTracker::Update(const IplImage* edge_image, const IplImage* mask,
+                         CvMemStorage* storage) {
+  CollectPoints(edge_image, mask);
+  if (!lines_.empty() && frames_since_search_ < kFullSearchInterval) {
+    ++frames_since_search_;
+    // Lines that converge on an earlier, stronger one are dropped, as in
+    // FullSearch.
+    size_t kept = 0;
+    for (size_t index = 0; index < lines_.size(); ++index) {
+      LaneLine line = lines_[index];
+      if (TrackLine(&line) && !IsTracked(line, kept))
+        lines_[kept++] = line;
+    }
+    lines_.resize(kept);
+    if (!lines_.empty())
+      return;
+  }
+  FullSearch(cvGetSize(edge_image), storage);
+}
+
+void LaneTracker::FullSearch(CvSize size, CvMemStorage* storage) {
+  frames_since_search_ = 0;
+  lines_.clear();
+  if (masked_edges_ == NULL || masked_edges_->width != size.width ||
+      masked_edges_->height != size.height) {
+    cvReleaseImage(&masked_edges_);
+    masked_edges_ = cvCreateImage(size, IPL_DEPTH_8U, 1);
+  }
+  // Drawing points_ leaves out the edges outside the mask, so that the same
+  // pixels vote as while tracking.
+  cvZero(masked_edges_);
+  for (size_t index = 0; index < points_.size(); ++index) {
+    UINT8* row = reinterpret_cast<UINT8*>(
+        masked_edges_->imageData + points_[index].y * masked_edges_->widthStep);
+    row[points_[index].x] = 255;
+  }
+  CvSeq* seq_lines = cvHoughLines2(masked_edges_, storage, CV_HOUGH_STANDARD,
+                                   1, kThetaStep, kMinVotes, 0, 0);
+  // Lines come strongest first. Lines close to a stronger one are the same
+  // lane, and are left for TrackLine to refine.
+  for (int k = 0; k < seq_lines->total &&
+       static_cast<int>(lines_.size()) < kMaxLines; ++k) {
+    float* found = reinterpret_cast<float*>(cvGetSeqElem(seq_lines, k));
+    LaneLine line;
+    line.rho = found[0];
+    line.theta = found[1];
+    // CV_HOUGH_STANDARD does not report the votes.
+    line.votes = CountVotes(line);
+    if (!IsTracked(line, lines_.size()))
+      lines_.push_back(line);
+  }
+}
+
+void LaneTracker::CollectPoints(const IplImage* edge_image,
+                                const IplImage* mask) {
+  points_.clear();
+  for (int y = 0; y < edge_image->height; ++y) {
+    const UINT8* edge_row = reinterpret_cast<const UINT8*>(
+        edge_image->imageData + y * edge_image->widthStep);
+    const UINT8* mask_row = reinterpret_cast<const UINT8*>(
+        mask->imageData + y * mask->widthStep);
+    for (int x = 0; x < edge_image->width; ++x) {
+      if (edge_row[x] != 0 && mask_row[x] > kMaskThreshold)
+        points_.push_back(cvPoint(x, y));
+    }
+  }
+}
+
+int LaneTracker::CountVotes(const LaneLine& line) const {
+  double cos_theta = cos(line.theta);
+  double sin_theta = sin(line.theta);
+  int rho = cvRound(line.rho);
+  int votes = 0;
+  for (size_t index = 0; index < points_.size(); ++index) {
+    if (cvRound(points_[index].x * cos_theta +
+                points_[index].y * sin_theta) == rho)
+      ++votes;
+  }
+  return votes;
+}
+
+bool LaneTracker::TrackLine(LaneLine* line) {
+  const int theta_count = 2 * kThetaWindow + 1;
+  const int rho_count = 2 * kRhoWindow + 1;
+  votes_.assign(theta_count * rho_count, 0);
+  int center_theta = ThetaIndex(line->theta);
+  int center_rho = cvRound(line->rho);
+  for (int t = 0; t < theta_count; ++t) {
+    // Thetas outside [0, CV_PI) are not wrapped here, so that rho stays
+    // continuous across the window.
+    double theta = (center_theta - kThetaWindow + t) * kThetaStep;
+    double cos_theta = cos(theta);
+    double sin_theta = sin(theta);
+    int* theta_votes = &votes_[t * rho_count];
+    for (size_t index = 0; index < points_.size(); ++index) {
+      int r = cvRound(points_[index].x * cos_theta +
+                      points_[index].y * sin_theta) - center_rho + kRhoWindow;
+      if (r >= 0 && r < rho_count)
+        ++theta_votes[r];
+    }
+  }
+  int best = 0;
+  for (int bin = 1; bin < theta_count * rho_count; ++bin) {
+    if (votes_[bin] > votes_[best])
+      best = bin;
+  }
+  if (votes_[best] < kMinVotes)
+    return false;
+  int theta_index = center_theta - kThetaWindow + best / rho_count;
+  int rho = center_rho - kRhoWindow + best % rho_count;
+  // Back to theta in [0, CV_PI). Half a turn flips the sign of rho.
+  if (theta_index < 0) {
+    theta_index += 180;
+    rho = -rho;
+  } else if (theta_index >= 180) {
+    theta_index -= 180;
+    rho = -rho;
+  }
+  line->rho = static_cast<float>(rho);
+  line->theta = static_cast<float>(theta_index * kThetaStep);
+  line->votes = votes_[best];
+  return true;
+}
+
+bool LaneTracker::IsTracked(const LaneLine& line, size_t count) const {
+  for (size_t index = 0; index < count; ++index) {
+    int theta_distance = abs(ThetaIndex(line.theta) -
+                             ThetaIndex(lines_[index].theta));
+    float rho_distance = fabs(line.rho - lines_[index].rho);
+    // Nearly vertical lines may sit on both ends of [0, CV_PI).
+    if (theta_distance > 90) {
+      theta_distance = 180 - theta_distance;
+      rho_distance = fabs(line.rho + lines_[index].rho);
+    }
+    if (theta_distance <= kThetaWindow && rho_distance <= kRhoWindow)
+      return true;
+  }
+  return false;
+}
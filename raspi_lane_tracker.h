@@ -0,0 +1,85 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_LANE_TRACKER_H_
+#define RASPICAMERA_RASPI_LANE_TRACKER_H_
+
+#include <vector>
+
+// A straight line x * cos(theta) + y * sin(theta) = rho, with theta in
+// [0, CV_PI), as returned by cvHoughLines2 in CV_HOUGH_STANDARD mode.
+struct LaneLine {
+  float rho;
+  float theta;
+  // Number of edge pixels inside the lane mask that voted for the line.
+  int votes;
+};
+
+// Finds the lane lines of consecutive frames. Lanes move little between
+// frames, so once lines are found, the next frame only votes for lines in a
+// small theta/rho window around each of them. A full Hough transform is run
+// on the first frame, every kFullSearchInterval frames, and whenever no line
+// is left, to find new or lost lanes. Either way only the edge pixels inside
+// the lane mask vote. Not thread safe.
+class LaneTracker {
+ public:
+  LaneTracker();
+  ~LaneTracker();
+  // Finds the lines of edge_image, a 1-channel IPL_DEPTH_8U image whose
+  // nonzero pixels are edges. mask MUST be a 1-channel IPL_DEPTH_8U image of
+  // the same size; only pixels with mask > 200 vote. storage is used by the
+  // full search and MUST NOT be NULL.
+  void Update(const IplImage* edge_image, const IplImage* mask,
+              CvMemStorage* storage);
+  // Forgets the lines, so that the next Update runs a full search. Called
+  // when the frame size changes.
+  void Reset() { lines_.clear(); }
+  // Returns the number of lines found by the last Update.
+  int get_line_count() const { return static_cast<int>(lines_.size()); }
+  // Returns the index-th line found by the last Update, strongest first.
+  const LaneLine& get_line(int index) const { return lines_[index]; }
+
+ private:
+  enum {
+    // Lines with fewer votes are ignored, as in the full Hough transform.
+    kMinVotes = 100,
+    // Maximum number of lines tracked.
+    kMaxLines = 4,
+    // Frames between full searches.
+    kFullSearchInterval = 30,
+    // Half widths of the window searched around a tracked line, in steps of
+    // one degree and one pixel.
+    kThetaWindow = 5,
+    kRhoWindow = 20
+  };
+  // Replaces lines_ with the strongest distinct lines of a full
+  // CV_HOUGH_STANDARD transform of points_, which are pixels of an image of
+  // size.
+  void FullSearch(CvSize size, CvMemStorage* storage);
+  // Collects the edge pixels of edge_image inside mask into points_.
+  void CollectPoints(const IplImage* edge_image, const IplImage* mask);
+  // Returns the number of points_ on line, with rho rounded to a pixel as
+  // the Hough transforms do.
+  int CountVotes(const LaneLine& line) const;
+  // Votes with points_ for the lines in the window around line and replaces
+  // it with the best one. Returns false if no line has kMinVotes votes.
+  bool TrackLine(LaneLine* line);
+  // Returns true if line is within the window of one of the first count
+  // lines_.
+  bool IsTracked(const LaneLine& line, size_t count) const;
+
+  LaneTracker(const LaneTracker&);
+  void operator=(const LaneTracker&);
+
+  std::vector<LaneLine> lines_;
+  // Frames since the last full search.
+  int frames_since_search_;
+  // Edge pixels voting while tracking. Keeps its capacity across frames.
+  std::vector<CvPoint> points_;
+  // Votes of the window of one line. Keeps its capacity across frames.
+  std::vector<int> votes_;
+  // points_ drawn on black for the full search, or NULL before the first
+  // one. Reallocated when the frame size changes.
+  IplImage* masked_edges_;
+};
+
+#endif  // RASPICAMERA_RASPI_LANE_TRACKER_H_
@@ -0,0 +1,155 @@
+// Copyright 2016
+
+#include "raspi_metrics.h"
+
+LONGLONG HistogramSnapshot::GetPercentile(int percent) const {
+  if (count == 0)
+    return 0;
+  // Rank of the percentile among the latencies, from 1.
+  LONGLONG rank = (count * percent + 99) / 100;
+  LONGLONG seen = 0;
+  for (int bucket = 0; bucket < kNumberOfBuckets - 1; ++bucket) {
+    seen += buckets[bucket];
+    if (seen >= rank)
+      return MIN((1LL << bucket) - 1, max);
+  }
+  return max;
+}
+
+LatencyHistogram::LatencyHistogram() {
+  count_ = 0;
+  sum_ = 0;
+  max_ = 0;
+  for (int bucket = 0; bucket < HistogramSnapshot::kNumberOfBuckets;
+       ++bucket)
+    buckets_[bucket] = 0;
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  ticks_per_second_ = frequency.QuadPart;
+}
+
+void LatencyHistogram::Add(LONGLONG microseconds) {
+  if (microseconds < 0)
+    microseconds = 0;
+  int bucket = 0;
+  for (LONGLONG rest = microseconds; rest != 0 &&
+       bucket < HistogramSnapshot::kNumberOfBuckets - 1; rest >>= 1)
+    ++bucket;
+  InterlockedIncrement64(&buckets_[bucket]);
+  InterlockedExchangeAdd64(&sum_, microseconds);
+  // A plain 64-bit read is not atomic on 32-bit targets, so max_ is read
+  // by the compare exchange itself.
+  LONGLONG max = InterlockedCompareExchange64(&max_, 0, 0);
+  while (max < microseconds) {
+    LONGLONG seen = InterlockedCompareExchange64(&max_, microseconds, max);
+    if (seen == max)
+      break;
+    max = seen;
+  }
+  // Counted last, so that a snapshot never has more latencies counted than
+  // bucketed.
+  InterlockedIncrement64(&count_);
+}
+
+void LatencyHistogram::AddSince(LONGLONG start) {
+  Add((GetTicks() - start) * 1000000 / ticks_per_second_);
+}
+
+void LatencyHistogram::GetSnapshot(HistogramSnapshot* snapshot) {
+  // A plain 64-bit read is not atomic on 32-bit targets.
+  snapshot->count = InterlockedCompareExchange64(&count_, 0, 0);
+  snapshot->sum = InterlockedCompareExchange64(&sum_, 0, 0);
+  snapshot->max = InterlockedCompareExchange64(&max_, 0, 0);
+  for (int bucket = 0; bucket < HistogramSnapshot::kNumberOfBuckets;
+       ++bucket)
+    snapshot->buckets[bucket] =
+        InterlockedCompareExchange64(&buckets_[bucket], 0, 0);
+}
+
+LONGLONG LatencyHistogram::GetTicks() {
+  LARGE_INTEGER ticks;
+  QueryPerformanceCounter(&ticks);
+  return ticks.QuadPart;
+}
+
+void WriteHistogram(FILE* file, const char* name,
+                    const HistogramSnapshot& snapshot) {
+  fprintf(file, "%s count=%lld mean_us=%lld p50_us=%lld p99_us=%lld "
+          "max_us=%lld\n", name, snapshot.count,
+          snapshot.count > 0 ? snapshot.sum / snapshot.count : 0,
+          snapshot.GetPercentile(50), snapshot.GetPercentile(99),
+          snapshot.max);
+}
+
+MetricsDumper::MetricsDumper(const char* file_name, DWORD interval) {
+  interval_ = interval;
+  thread_ = NULL;
+  start_ticks_ = LatencyHistogram::GetTicks();
+  InitializeCriticalSection(&lock_);
+  InitializeConditionVariable(&stop_);
+  stopping_ = false;
+  file_ = fopen(file_name, "a");
+  if (file_ == NULL) {
+    fprintf_s(stderr, kErrorMessage, "fopen", GetLastError());
+    return;
+  }
+  thread_ = CreateThread(
+      NULL, 0, (LPTHREAD_START_ROUTINE)DumpLoop, this, 0, NULL);
+  if (thread_ == NULL)
+    fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+}
+
+MetricsDumper::~MetricsDumper() {
+  EnterCriticalSection(&lock_);
+  stopping_ = true;
+  LeaveCriticalSection(&lock_);
+  WakeConditionVariable(&stop_);
+  if (thread_ != NULL) {
+    WaitForSingleObject(thread_, INFINITE);
+    CloseHandle(thread_);
+  }
+  if (file_ != NULL) {
+    Dump();
+    fclose(file_);
+  }
+  DeleteCriticalSection(&lock_);
+}
+
+void MetricsDumper::Add(Writer writer, void* context) {
+  Source source;
+  source.writer = writer;
+  source.context = context;
+  EnterCriticalSection(&lock_);
+  sources_.push_back(source);
+  LeaveCriticalSection(&lock_);
+}
+
+DWORD MetricsDumper::DumpLoop(LPVOID lpParam) {
+  MetricsDumper* dumper = static_cast<MetricsDumper*>(lpParam);
+  EnterCriticalSection(&dumper->lock_);
+  while (!dumper->stopping_) {
+    // Spurious wake ups only dump early.
+    if (!SleepConditionVariableCS(&dumper->stop_, &dumper->lock_,
+                                  dumper->interval_) &&
+        GetLastError() != ERROR_TIMEOUT) {
+      fprintf_s(stderr, kErrorMessage, "SleepConditionVariableCS",
+                GetLastError());
+      break;
+    }
+    if (!dumper->stopping_)
+      dumper->Dump();
+  }
+  LeaveCriticalSection(&dumper->lock_);
+  return TRUE;
+}
+
+void MetricsDumper::Dump() {
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  fprintf(file_, "# %.3f s\n",
+          static_cast<double>(LatencyHistogram::GetTicks() - start_ticks_) /
+          frequency.QuadPart);
+  for (size_t index = 0; index < sources_.size(); ++index)
+    sources_[index].writer(sources_[index].context, file_);
+  fflush(file_);
+}
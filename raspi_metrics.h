@@ -0,0 +1,107 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_METRICS_H_
+#define RASPICAMERA_RASPI_METRICS_H_
+
+#include <stdio.h>
+#include <vector>
+
+// Counts of a LatencyHistogram at one point in time.
+struct HistogramSnapshot {
+  enum {
+    // Bucket 0 counts latencies of 0 microseconds and bucket i > 0 latencies
+    // in [2^(i-1), 2^i) microseconds. The last bucket also counts everything
+    // longer.
+    kNumberOfBuckets = 32
+  };
+  // Returns an upper bound of the percent-th percentile in microseconds: the
+  // end of the bucket holding it, but at most max. 0 if count is 0.
+  LONGLONG GetPercentile(int percent) const;
+
+  LONGLONG count;
+  // Sum of the latencies in microseconds.
+  LONGLONG sum;
+  // Largest latency in microseconds.
+  LONGLONG max;
+  LONGLONG buckets[kNumberOfBuckets];
+};
+
+// Distribution of latencies in power-of-two buckets. Add takes a few
+// interlocked operations and no lock, so it can stay enabled on the frame
+// path and be called from any thread.
+class LatencyHistogram {
+ public:
+  // Constructor. The histogram starts empty.
+  LatencyHistogram();
+  // Adds a latency of microseconds.
+  void Add(LONGLONG microseconds);
+  // Adds the latency from the QueryPerformanceCounter ticks start to now.
+  void AddSince(LONGLONG start);
+  // Copies the counts to snapshot. Latencies added meanwhile may be partly
+  // copied. Can be called from any thread.
+  void GetSnapshot(HistogramSnapshot* snapshot);
+  // Returns the current QueryPerformanceCounter ticks, for AddSince.
+  static LONGLONG GetTicks();
+
+ private:
+  LatencyHistogram(const LatencyHistogram&);
+  void operator=(const LatencyHistogram&);
+
+  volatile LONGLONG count_;
+  volatile LONGLONG sum_;
+  volatile LONGLONG max_;
+  volatile LONGLONG buckets_[HistogramSnapshot::kNumberOfBuckets];
+  // QueryPerformanceFrequency.
+  LONGLONG ticks_per_second_;
+};
+
+// Writes snapshot as one line of a metrics dump: name, count, mean, 50th,
+// 99th percentile and max, in microseconds.
+void WriteHistogram(FILE* file, const char* name,
+                    const HistogramSnapshot& snapshot);
+
+// Appends the metrics of its sources to a file every interval milliseconds
+// on its own thread, so that they can be followed under production load.
+class MetricsDumper {
+ public:
+  // Function writing the metrics of context to file, one line per value.
+  // Called on the dumper thread.
+  typedef void (*Writer)(void* context, FILE* file);
+
+  // Constructor. Opens file_name for appending and starts the thread. On
+  // error, nothing is dumped.
+  MetricsDumper(const char* file_name, DWORD interval);
+  // Destructor. Writes a last dump, stops the thread and closes the file.
+  ~MetricsDumper();
+  // Adds a source to every following dump. context MUST outlive the
+  // object.
+  void Add(Writer writer, void* context);
+
+ private:
+  struct Source {
+    Writer writer;
+    void* context;
+  };
+  // Function called by thread_. Dumps every interval_ milliseconds until
+  // stopping_ is set.
+  static DWORD WINAPI DumpLoop(LPVOID lpParam);
+  // Writes every source to file_. Called within lock_.
+  void Dump();
+
+  MetricsDumper(const MetricsDumper&);
+  void operator=(const MetricsDumper&);
+
+  FILE* file_;
+  DWORD interval_;
+  HANDLE thread_;
+  // QueryPerformanceCounter at construction, which dumps are timed from.
+  LONGLONG start_ticks_;
+  // Guards the fields below.
+  CRITICAL_SECTION lock_;
+  // Signaled when stopping_ becomes true.
+  CONDITION_VARIABLE stop_;
+  std::vector<Source> sources_;
+  bool stopping_;
+};
+
+#endif  // RASPICAMERA_RASPI_METRICS_H_
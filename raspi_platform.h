@@ -0,0 +1,214 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_PLATFORM_H_
+#define RASPICAMERA_RASPI_PLATFORM_H_
+
+// Counterpart of stdafx.h for the POSIX build of the tools in the Makefile.
+// Force-included into every file, it maps the part of the Win32 API used by
+// the processing code (raspi_process, raspi_kernels, raspi_lane_tracker,
+// raspi_thread_pool, raspi_jpeg, raspi_frame and raspi_frame_pool) to
+// POSIX, so that the same sources build on Linux. The camera client itself
+// needs Winsock and stays Windows only; raspi_transport is its POSIX
+// counterpart.
+
+#ifdef _WIN32
+#error "Use stdafx.h on Windows."
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <iostream>
+#include <string>
+
+typedef uint8_t UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t INT32;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef long long LONGLONG;  // NOLINT(runtime/int)
+typedef int BOOL;
+typedef void* PVOID;
+typedef void* LPVOID;
+// Only threads are handles in the POSIX build. A handle points to the
+// pthread_t of the thread.
+typedef void* HANDLE;
+typedef DWORD (*LPTHREAD_START_ROUTINE)(LPVOID);
+typedef pthread_mutex_t CRITICAL_SECTION;
+typedef pthread_cond_t CONDITION_VARIABLE;
+typedef union {
+  LONGLONG QuadPart;
+} LARGE_INTEGER;
+
+#define TRUE 1
+#define FALSE 0
+#define INFINITE 0xFFFFFFFF
+#define ERROR_TIMEOUT 1460
+#define WINAPI
+#define fprintf_s fprintf
+
+// Error messages, defined by raspi_camera.h on Windows.
+// Takes two format arguments. The function name and the error code.
+const char* const kErrorMessage = "%s failed with error: 0x%08x\n";
+// Takes three format arguments. The function name, the caller function name,
+// and the error code.
+const char* const kErrorMessageIn = "%s in %s failed with error: 0x%08x\n";
+// Takes three format arguments. The function name, the argument value(%s),
+// and the error code.
+const char* const kErrorMessageFor = "%s for %s failed with error: 0x%08x\n";
+
+inline DWORD GetLastError() { return static_cast<DWORD>(errno); }
+
+// Critical sections are recursive, as on Windows.
+inline void InitializeCriticalSection(CRITICAL_SECTION* lock) {
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(lock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+}
+inline void DeleteCriticalSection(CRITICAL_SECTION* lock) {
+  pthread_mutex_destroy(lock);
+}
+inline void EnterCriticalSection(CRITICAL_SECTION* lock) {
+  pthread_mutex_lock(lock);
+}
+inline void LeaveCriticalSection(CRITICAL_SECTION* lock) {
+  pthread_mutex_unlock(lock);
+}
+
+// Condition variables are never destroyed on Windows, nor here.
+inline void InitializeConditionVariable(CONDITION_VARIABLE* condition) {
+  pthread_cond_init(condition, NULL);
+}
+// Returns FALSE with the error code ERROR_TIMEOUT once timeout milliseconds
+// have passed.
+inline BOOL SleepConditionVariableCS(CONDITION_VARIABLE* condition,
+                                     CRITICAL_SECTION* lock, DWORD timeout) {
+  if (timeout == INFINITE)
+    return pthread_cond_wait(condition, lock) == 0;
+  timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  int error = pthread_cond_timedwait(condition, lock, &deadline);
+  if (error == 0)
+    return TRUE;
+  errno = error == ETIMEDOUT ? ERROR_TIMEOUT : error;
+  return FALSE;
+}
+inline void WakeConditionVariable(CONDITION_VARIABLE* condition) {
+  pthread_cond_signal(condition);
+}
+inline void WakeAllConditionVariable(CONDITION_VARIABLE* condition) {
+  pthread_cond_broadcast(condition);
+}
+
+// The Interlocked functions are full barriers, as on Windows.
+inline LONG InterlockedIncrement(volatile LONG* value) {
+  return __sync_add_and_fetch(value, 1);
+}
+inline LONG InterlockedDecrement(volatile LONG* value) {
+  return __sync_sub_and_fetch(value, 1);
+}
+inline LONG InterlockedExchange(volatile LONG* target, LONG value) {
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+inline LONG InterlockedExchangeAdd(volatile LONG* addend, LONG value) {
+  return __sync_fetch_and_add(addend, value);
+}
+inline LONG InterlockedCompareExchange(volatile LONG* destination,
+                                       LONG exchange, LONG comparand) {
+  return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+inline LONGLONG InterlockedExchange64(volatile LONGLONG* target,
+                                      LONGLONG value) {
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+inline LONGLONG InterlockedIncrement64(volatile LONGLONG* value) {
+  return __sync_add_and_fetch(value, 1);
+}
+inline LONGLONG InterlockedCompareExchange64(volatile LONGLONG* destination,
+                                             LONGLONG exchange,
+                                             LONGLONG comparand) {
+  return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+inline LONGLONG InterlockedExchangeAdd64(volatile LONGLONG* addend,
+                                         LONGLONG value) {
+  return __sync_fetch_and_add(addend, value);
+}
+inline PVOID InterlockedCompareExchangePointer(PVOID volatile* destination,
+                                               PVOID exchange,
+                                               PVOID comparand) {
+  return __sync_val_compare_and_swap(destination, comparand, exchange);
+}
+
+// Ticks are nanoseconds of CLOCK_MONOTONIC.
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency) {
+  frequency->QuadPart = 1000000000;
+  return TRUE;
+}
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER* counter) {
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  counter->QuadPart = static_cast<LONGLONG>(now.tv_sec) * 1000000000 +
+                      now.tv_nsec;
+  return TRUE;
+}
+
+// Arguments of PosixThreadMain.
+struct PosixThreadStart {
+  LPTHREAD_START_ROUTINE routine;
+  LPVOID parameter;
+};
+
+inline void* PosixThreadMain(void* argument) {
+  PosixThreadStart start = *static_cast<PosixThreadStart*>(argument);
+  delete static_cast<PosixThreadStart*>(argument);
+  start.routine(start.parameter);
+  return NULL;
+}
+
+// Only the routine and its parameter are supported. Returns NULL and sets
+// the error code on failure.
+inline HANDLE CreateThread(void*, size_t, LPTHREAD_START_ROUTINE routine,
+                           LPVOID parameter, DWORD, DWORD*) {
+  pthread_t* thread = new pthread_t;
+  PosixThreadStart* start = new PosixThreadStart;
+  start->routine = routine;
+  start->parameter = parameter;
+  int error = pthread_create(thread, NULL, PosixThreadMain, start);
+  if (error != 0) {
+    delete start;
+    delete thread;
+    errno = error;
+    return NULL;
+  }
+  return thread;
+}
+// Only waits for threads, with an INFINITE timeout.
+inline DWORD WaitForSingleObject(HANDLE thread, DWORD) {
+  pthread_join(*static_cast<pthread_t*>(thread), NULL);
+  return 0;
+}
+inline BOOL CloseHandle(HANDLE thread) {
+  delete static_cast<pthread_t*>(thread);
+  return TRUE;
+}
+
+#include <opencv/highgui.h>
+#include "raspi_frame.h"
+#include "raspi_frame_pool.h"
+#include "raspi_receive_ring.h"
+
+#endif  // RASPICAMERA_RASPI_PLATFORM_H_
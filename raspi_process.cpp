@@ -0,0 +1,481 @@
+// Copyright 2016
+
+#include <opencv/cv.h>
+#include <opencv/cxcore.h>
+#include "raspi_process.h"
+
+namespace {
+
+// Assign a mask.
+void MaskField(IplImage *mask, IplImage *roiImage) {
+  CvPoint pt1, pt2;
+  pt1.x = roiImage->width / 2;
+  pt1.y = 0;
+  pt2.x = 0;
+  pt2.y = roiImage->height / 4;
+  cvLine(mask, pt1, pt2, cvScalar(0), 2, 8);
+  pt1.x = 0;
+  pt1.y = 0;
+  pt2.x = 0;
+  pt2.y = roiImage->height / 4;
+  cvLine(mask, pt1, pt2, cvScalar(0), 2, 8);
+  pt1.x = roiImage->width;
+  pt1.y = 0;
+  pt2.x = roiImage->width;
+  pt2.y = roiImage->height / 4;
+  cvLine(mask, pt1, pt2, cvScalar(0), 2, 8);
+  pt1.x = 0;
+  pt1.y = 0;
+  pt2.x = roiImage->width;
+  pt2.y = 0;
+  cvLine(mask, pt1, pt2, cvScalar(0), 2, 8);
+  pt1.x = roiImage->width / 2;
+  pt1.y = 0;
+  pt2.x = roiImage->width;
+  pt2.y = roiImage->height / 4;
+  cvLine(mask, pt1, pt2, cvScalar(0), 2, 8);
+  CvScalar lo_diff = cvScalarAll(10);
+  CvScalar up_diff = cvScalarAll(10);
+  CvConnectedComp comp;
+  int floodFlags = 4 | CV_FLOODFILL_FIXED_RANGE;
+  cvFloodFill(mask, cvPoint(5, 5), cvScalar(0),
+              lo_diff, up_diff, &comp, floodFlags);
+  cvFloodFill(mask, cvPoint(roiImage->width - 5, 5), cvScalar(0),
+              lo_diff, up_diff, &comp, floodFlags);
+}
+
+}  // namespace
+
+const ProcessContext::StageInfo ProcessContext::kStages[kNumberOfStages] = {
+  {"gray", 0, kGrayData},
+  {"gradient", kGrayData, kGradientData},
+  {"canny", kGrayData, kEdgeData},
+  {"tiles", 0, kTileData},
+  {"traffic_lights", kTileData, kTrafficLights},
+  {"lane_pixels", kGradientData, kLanePixels},
+  {"lane_lines", kEdgeData, kLaneLines}
+};
+
+int ProcessContext::GetActiveStages(int results) {
+  int needed = results;
+  int active_stages = 0;
+  for (int stage = kNumberOfStages - 1; stage >= 0; --stage) {
+    if (kStages[stage].outputs & needed) {
+      active_stages |= 1 << stage;
+      needed |= kStages[stage].inputs;
+    }
+  }
+  return active_stages;
+}
+
+ProcessContext::ProcessContext(const char* mask_file, EdgeMode edge_mode,
+                               ThreadPool* thread_pool) {
+  mask_file_ = mask_file;
+  edge_mode_ = edge_mode;
+  thread_pool_ = thread_pool;
+  source_image_ = NULL;
+  result_image_ = NULL;
+  luma_ = NULL;
+  blue_chroma_ = NULL;
+  red_chroma_ = NULL;
+  active_stages_ = 0;
+  for (int stage = 0; stage < kNumberOfStages; ++stage)
+    stage_ticks_[stage] = 0;
+  LARGE_INTEGER frequency;
+  QueryPerformanceFrequency(&frequency);
+  ticks_per_second_ = frequency.QuadPart;
+  size_ = cvSize(0, 0);
+  roi_image_ = NULL;
+  gray_image_ = NULL;
+  img_32f_ = NULL;
+  smooth_image_ = NULL;
+  diff_x_ = NULL;
+  diff_y_ = NULL;
+  mag_ = NULL;
+  edge_image_ = NULL;
+  lane_gray_image_ = NULL;
+  mask_ = NULL;
+  storage_ = cvCreateMemStorage(0);
+  tiles_ = NULL;
+}
+
+ProcessContext::~ProcessContext() {
+  Release();
+  cvReleaseMemStorage(&storage_);
+}
+
+void ProcessContext::SetChromaRanges(const ChromaRange* ranges) {
+  chroma_table_.Build(ranges);
+}
+
+double ProcessContext::GetStageSeconds(Stage stage) {
+  return static_cast<double>(stage_ticks_[stage]) / ticks_per_second_;
+}
+
+void ProcessContext::WriteMetrics(void* context, FILE* file) {
+  ProcessContext* process_context = static_cast<ProcessContext*>(context);
+  HistogramSnapshot snapshot;
+  process_context->GetProcessLatency(&snapshot);
+  WriteHistogram(file, "process", snapshot);
+  for (int stage = 0; stage < kNumberOfStages; ++stage) {
+    process_context->GetStageLatency(static_cast<Stage>(stage), &snapshot);
+    std::string name = std::string("process.") +
+                       GetStageName(static_cast<Stage>(stage));
+    WriteHistogram(file, name.c_str(), snapshot);
+  }
+}
+
+LONGLONG ProcessContext::GetTicks() {
+  LARGE_INTEGER ticks;
+  QueryPerformanceCounter(&ticks);
+  return ticks.QuadPart;
+}
+
+void ProcessContext::EndStage(Stage stage, LONGLONG* start) {
+  LONGLONG end = GetTicks();
+  InterlockedExchangeAdd64(&stage_ticks_[stage], end - *start);
+  *start = end;
+}
+
+void ProcessContext::Release() {
+  cvReleaseImage(&roi_image_);
+  cvReleaseImage(&gray_image_);
+  cvReleaseImage(&img_32f_);
+  cvReleaseImage(&smooth_image_);
+  cvReleaseImage(&diff_x_);
+  cvReleaseImage(&diff_y_);
+  cvReleaseImage(&mag_);
+  cvReleaseImage(&edge_image_);
+  cvReleaseImage(&lane_gray_image_);
+  cvReleaseImage(&mask_);
+  delete[] tiles_;
+  tiles_ = NULL;
+  size_ = cvSize(0, 0);
+}
+
+void ProcessContext::Allocate(CvSize size) {
+  if (size.width == size_.width && size.height == size_.height)
+    return;
+  Release();
+  size_ = size;
+  lane_tracker_.Reset();
+  // Rectangular roi for lane detection.
+  CvSize roi_size = cvSize(size.width, size.height / 2);
+  roi_image_ = cvCreateImage(roi_size, IPL_DEPTH_8U, 3);
+  gray_image_ = cvCreateImage(roi_size, IPL_DEPTH_8U, 1);
+  if (edge_mode_ == kFixedPointEdges) {
+    smooth_image_ = cvCreateImage(roi_size, IPL_DEPTH_8U, 1);
+    diff_x_ = cvCreateImage(roi_size, IPL_DEPTH_16S, 1);
+    diff_y_ = cvCreateImage(roi_size, IPL_DEPTH_16S, 1);
+  } else {
+    img_32f_ = cvCreateImage(roi_size, IPL_DEPTH_32F, 1);
+    diff_x_ = cvCreateImage(roi_size, IPL_DEPTH_32F, 1);
+    diff_y_ = cvCreateImage(roi_size, IPL_DEPTH_32F, 1);
+    mag_ = cvCreateImage(roi_size, IPL_DEPTH_32F, 1);
+  }
+  edge_image_ = cvCreateImage(roi_size, IPL_DEPTH_8U, 1);
+  lane_gray_image_ = cvCreateImage(roi_size, IPL_DEPTH_8U, 1);
+  mask_ = cvCreateImage(roi_size, IPL_DEPTH_8U, 1);
+  BuildMask();
+  tiles_ = new TileColorSums[CountTiles(size.height / 2, kTileSize) *
+                             CountTiles(size.width, kTileSize)];
+}
+
+void ProcessContext::BuildMask() {
+  IplImage* loaded_mask = NULL;
+  if (mask_file_ != NULL)
+    loaded_mask = cvLoadImage(mask_file_, CV_LOAD_IMAGE_GRAYSCALE);
+  if (loaded_mask != NULL) {
+    cvResize(loaded_mask, mask_, CV_INTER_NN);
+    cvReleaseImage(&loaded_mask);
+    return;
+  }
+  // Set mask to be white.
+  cvSet(mask_, cvScalar(255));
+  MaskField(mask_, roi_image_);
+}
+
+void ProcessContext::Process(const IplImage* source_image, int results,
+                             IplImage* result_image) {
+  luma_ = NULL;
+  blue_chroma_ = NULL;
+  red_chroma_ = NULL;
+  ProcessImage(source_image, results, result_image);
+}
+
+void ProcessContext::Process(RasPiFrame* frame, int results,
+                             IplImage* result_image) {
+  luma_ = frame->get_plane(RasPiFrame::kLuma);
+  blue_chroma_ = frame->get_plane(RasPiFrame::kBlueChroma);
+  red_chroma_ = frame->get_plane(RasPiFrame::kRedChroma);
+  if (luma_ == NULL) {
+    ProcessImage(frame->get_image(), results, result_image);
+  } else if (frame->get_converted_image() != NULL &&
+             (results & kDrawnResults)) {
+    // A frame that is displayed has been converted already. It is copied
+    // rather than converted a second time.
+    ProcessImage(frame->get_converted_image(), results, result_image);
+  } else {
+    if (results & kDrawnResults) {
+      // OpenCV orders the channels Y, Cr, Cb.
+      cvMerge(luma_, red_chroma_, blue_chroma_, NULL, result_image);
+      cvCvtColor(result_image, result_image, CV_YCrCb2BGR);
+    }
+    ProcessImage(NULL, results, result_image);
+  }
+  luma_ = NULL;
+  blue_chroma_ = NULL;
+  red_chroma_ = NULL;
+}
+
+void ProcessContext::ProcessImage(const IplImage* source_image, int results,
+                                  IplImage* result_image) {
+  LONGLONG process_start = GetTicks();
+  Allocate(cvGetSize(result_image));
+  if (source_image != NULL)
+    cvCopy(source_image, result_image, 0);
+  source_image_ = source_image;
+  result_image_ = result_image;
+  active_stages_ = GetActiveStages(results);
+  for (int stage = 0; stage < kNumberOfStages; ++stage)
+    stage_ticks_[stage] = 0;
+  // The upper half of the image is searched for traffic lights and the lower
+  // half for lanes. The halves are independent, so the lane edges are found
+  // while the traffic light tiles are summed, one tile row per task.
+  int tile_rows = 0;
+  if (IsActive(kTileStage))
+    tile_rows = CountTiles(result_image->height / 2, kTileSize);
+  RunTasks(1 + tile_rows, FindEdgesOrSumTileRow);
+  // Drawn before the lane pixels, which may paint over the circles.
+  if (IsActive(kTrafficLightStage)) {
+    LONGLONG start = GetTicks();
+    DrawTrafficLights();
+    EndStage(kTrafficLightStage, &start);
+  }
+  // The lane pixels are marked in bands of rows while the lines are found.
+  int lane_bands = 0;
+  if (IsActive(kLanePixelStage))
+    lane_bands = CountTiles(result_image->height / 2, kLaneBandRows);
+  RunTasks(1 + lane_bands, FindLinesOrMarkLaneBand);
+  source_image_ = NULL;
+  result_image_ = NULL;
+  for (int stage = 0; stage < kNumberOfStages; ++stage) {
+    if (IsActive(static_cast<Stage>(stage)))
+      stage_latencies_[stage].Add(stage_ticks_[stage] * 1000000 /
+                                  ticks_per_second_);
+  }
+  process_latency_.AddSince(process_start);
+}
+
+void ProcessContext::RunTasks(int count, ThreadPool::Task task) {
+  if (thread_pool_ != NULL) {
+    thread_pool_->ParallelFor(count, task, this);
+  } else {
+    for (int index = 0; index < count; ++index)
+      task(this, index);
+  }
+}
+
+void ProcessContext::FindEdgesOrSumTileRow(void* context, int index) {
+  ProcessContext* process_context = static_cast<ProcessContext*>(context);
+  if (index == 0) {
+    process_context->FindEdges();
+  } else {
+    // Traffic light color detection.
+    // Detect color only from the upper half of the image.
+    // First divide the image into 40x40 areas and sum the pixels of each
+    // color inside every area.
+    LONGLONG start = GetTicks();
+    if (process_context->blue_chroma_ != NULL) {
+      SumTrafficLightColors(process_context->blue_chroma_,
+                            process_context->red_chroma_, kTileSize,
+                            process_context->chroma_table_, index - 1, index,
+                            process_context->tiles_);
+    } else {
+      SumTrafficLightColors(process_context->source_image_, kTileSize,
+                            process_context->chroma_table_, index - 1, index,
+                            process_context->tiles_);
+    }
+    process_context->EndStage(kTileStage, &start);
+  }
+}
+
+void ProcessContext::FindLinesOrMarkLaneBand(void* context, int index) {
+  ProcessContext* process_context = static_cast<ProcessContext*>(context);
+  if (index == 0) {
+    process_context->FindLines();
+  } else {
+    LONGLONG start = GetTicks();
+    int first_row = (index - 1) * kLaneBandRows;
+    process_context->MarkLanes(first_row, first_row + kLaneBandRows);
+    process_context->EndStage(kLanePixelStage, &start);
+  }
+}
+
+void ProcessContext::FindEdges() {
+  // Rectangular roi for traffic light detection.
+  // cvRectangle(result_image, cvPoint(0, 0),
+  //             cvPoint(source_image->width-1, (source_image->height / 2)-1),
+  //                     CV_RGB(0, 255, 0), 2);
+  // Rectangular roi for lane detection.
+  // cvRectangle(result_image, cvPoint(0, source_image->height/2),
+  //             cvPoint(source_image->width-1, source_image->height-1),
+  //                     CV_RGB(0, 0, 255), 2);
+  if (!IsActive(kGrayStage))
+    return;
+  LONGLONG start = GetTicks();
+  // Rectangular roi for lane detection.
+  CvRect roi = cvRect(0, result_image_->height / 2, result_image_->width,
+                      result_image_->height / 2);
+  if (luma_ != NULL) {
+    // The Y plane is already the 0 ~ 255 gray scale image.
+    CvMat luma_roi;
+    cvGetSubRect(luma_, &luma_roi, roi);
+    cvCopy(&luma_roi, gray_image_);
+  } else {
+    cvSetImageROI(result_image_, roi);
+    // The image inside the roi.
+    cvCopy(result_image_, roi_image_);
+    cvResetImageROI(result_image_);
+    // Convert roi_image_ to 0 ~ 255 gray scale image.
+    cvCvtColor(roi_image_, gray_image_, CV_BGR2GRAY);
+  }
+  EndStage(kGrayStage, &start);
+  if (IsActive(kGradientStage) && edge_mode_ == kFixedPointEdges) {
+    // Sobel edge detection on the smoothed 8-bit image. The magnitude and
+    // the brightness are thresholded by MarkLanePixels in fixed point.
+    cvSmooth(gray_image_, smooth_image_, CV_GAUSSIAN, 5);
+    cvSobel(smooth_image_, diff_x_, 1, 0, 3);
+    cvSobel(smooth_image_, diff_y_, 0, 1, 3);
+  } else if (IsActive(kGradientStage)) {
+    // Divide the gray_image_ data by 255.
+    cvConvertScale(gray_image_, img_32f_, 1.0 / 255.0, 0);
+    cvSmooth(img_32f_, img_32f_, CV_GAUSSIAN, 5);
+    // Sobel edge detection.
+    cvSobel(img_32f_, diff_x_, 1, 0, 3);
+    cvSobel(img_32f_, diff_y_, 0, 1, 3);
+    // Magnitude of the gradient. The orientation is never used.
+    cvCartToPolar(diff_x_, diff_y_, mag_, NULL, 1);
+    // Square the img_32f_ image data to emphasize brightness.
+    cvPow(img_32f_, img_32f_, 2);
+  }
+  if (IsActive(kGradientStage))
+    EndStage(kGradientStage, &start);
+  // Canny edge detection.
+  if (IsActive(kCannyStage)) {
+    cvCanny(gray_image_, edge_image_, 50, 200, 3);
+    EndStage(kCannyStage, &start);
+  }
+}
+
+void ProcessContext::DrawTrafficLights() {
+  int x = 0, y = 0;
+  // red, yellow, green structs for detecting colors of traffic lights.
+  ColorDetect red, yellow, green;
+  red.count = 1;
+  red.average_x = 0;
+  red.average_y = 0;
+  yellow.count = 1;
+  yellow.average_x = 0;
+  yellow.average_y = 0;
+  green.count = 1;
+  green.average_x = 0;
+  green.average_y = 0;
+  int tile_columns = CountTiles(result_image_->width, kTileSize);
+  for (y = 0; y < result_image_->height / 2; y += kTileSize) {
+    for (x = 0; x < result_image_->width; x += kTileSize) {
+      const TileColorSums& tile =
+          tiles_[(y / kTileSize) * tile_columns + x / kTileSize];
+      red.count += tile.colors[kRed].count;
+      red.average_x += tile.colors[kRed].sum_x;
+      red.average_y += tile.colors[kRed].sum_y;
+      yellow.count += tile.colors[kYellow].count;
+      yellow.average_x += tile.colors[kYellow].sum_x;
+      yellow.average_y += tile.colors[kYellow].sum_y;
+      green.count += tile.colors[kGreen].count;
+      green.average_x += tile.colors[kGreen].sum_x;
+      green.average_y += tile.colors[kGreen].sum_y;
+      // Calculate the average of the coordinates.
+      red.average_x /= red.count;
+      red.average_y /= red.count;
+      yellow.average_x /= yellow.count;
+      yellow.average_y /= yellow.count;
+      green.average_x /= green.count;
+      green.average_y /= green.count;
+      // Draw a circle with the center at the average location of the pixels
+      // with the corresponding color.
+      if (red.count > 100) {
+        cvCircle(result_image_, cvPoint(red.average_x, red.average_y),
+                 7, CV_RGB(255, 0, 0), 2);
+        // cvRectangle(result_image, cvPoint(x, y),
+        //             cvPoint(x+row, y+col), CV_RGB(255, 0, 0), 2);
+      }
+      if (yellow.count > 100) {
+        cvCircle(result_image_, cvPoint(yellow.average_x, yellow.average_y),
+                 7, CV_RGB(255, 255, 0), 2);
+        // cvRectangle(result_image, cvPoint(x, y),
+        //             cvPoint(x+row, y+col), CV_RGB(255, 255, 0), 2);
+      }
+      if (green.count > 80) {
+        cvCircle(result_image_, cvPoint(green.average_x, green.average_y),
+                 7, CV_RGB(0, 255, 0), 2);
+        // cvRectangle(result_image, cvPoint(x, y),
+        //             cvPoint(x+row, y+col), CV_RGB(0, 255, 0), 2);
+      }
+      red.count = 1;
+      yellow.count = 1;
+      green.count = 1;
+    }
+  }
+}
+
+void ProcessContext::MarkLanes(int first_row, int last_row) {
+  // Lane detection on the lower half of the image.
+  if (edge_mode_ == kFixedPointEdges) {
+    MarkLanePixels(smooth_image_, diff_x_, diff_y_, mask_, first_row,
+                   last_row, result_image_->height / 2, result_image_);
+  } else {
+    MarkLanePixels(img_32f_, mag_, mask_, first_row, last_row,
+                   result_image_->height / 2, result_image_);
+  }
+}
+
+void ProcessContext::FindLines() {
+  if (!IsActive(kLaneLineStage))
+    return;
+  LONGLONG start = GetTicks();
+  // Set lane_gray_image_ to be white.
+  cvSet(lane_gray_image_, cvScalar(255));
+  // Turn edge_image_ into straight lines. The tracker only runs a full
+  // CV_HOUGH_STANDARD transform now and then, and otherwise searches around
+  // the lines of the previous frame.
+  cvClearMemStorage(storage_);
+  lane_tracker_.Update(edge_image_, mask_, storage_);
+  for (int k = 0; k < lane_tracker_.get_line_count(); ++k) {
+    float rho, theta;
+    float c, s;
+    float x0, y0;
+    rho = lane_tracker_.get_line(k).rho;
+    theta = lane_tracker_.get_line(k).theta;
+    // drawing line
+    c = cos(theta);
+    s = sin(theta);
+    x0 = rho*c;
+    y0 = rho*s;
+    CvPoint pt1, pt2;
+    pt1.x = cvRound(x0 + 1000 * (-s));
+    pt1.y = cvRound(y0 + 1000 * (c));
+    pt2.x = cvRound(x0 - 1000 * (-s));
+    pt2.y = cvRound(y0 - 1000 * (c));
+    cvLine(lane_gray_image_, pt1, pt2, CV_RGB(255, 255, 255), 3, 8);
+  }
+  // CV_HOUGH_PROBABILISTIC MODE
+  CvSeq* seq_lines = cvHoughLines2(edge_image_, storage_,
+                                   CV_HOUGH_PROBABILISTIC,
+                                   1, CV_PI / 180, 80, 30, 3);
+  for (int k = 0; k < seq_lines->total; ++k) {
+    CvPoint* line = reinterpret_cast<CvPoint*>(cvGetSeqElem(seq_lines, k));
+    cvLine(lane_gray_image_, line[0], line[1], cvScalar(0), 3, 8);
+  }
+  EndStage(kLaneLineStage, &start);
+}
@@ -0,0 +1,242 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_PROCESS_H_
+#define RASPICAMERA_RASPI_PROCESS_H_
+
+#include "raspi_kernels.h"
+#include "raspi_lane_tracker.h"
+#include "raspi_metrics.h"
+#include "raspi_thread_pool.h"
+
+// struct used to store information about pixels of a certain color.
+struct ColorDetect {
+  // number of pixels of the corresponding color
+  int count;
+  // the average x coordinate of the corresponding color
+  int average_x;
+  // the average y coordinate of the corresponding color
+  int average_y;
+};
+
+// Detects traffic lights and lanes in camera images. Owns every intermediate
+// image of the processing, sized for the last frame, so that processing
+// frames of the same size allocates nothing. Not thread safe, but a frame
+// can be processed by the threads of a ThreadPool.
+class ProcessContext {
+ public:
+  // How lane pixels are found.
+  enum EdgeMode {
+    // Smooth and differentiate a 0. ~ 1. IPL_DEPTH_32F gray image.
+    kFloatEdges,
+    // Smooth the 8-bit gray image and differentiate it into IPL_DEPTH_16S
+    // images, then threshold with integer bounds equivalent to the float
+    // ones. Moves a quarter of the data of kFloatEdges.
+    kFixedPointEdges
+  };
+  // Results Process can produce, combined with |.
+  enum Result {
+    // Circles around the traffic lights, drawn on the result image.
+    kTrafficLights = 1 << 0,
+    // Lane pixels, painted magenta on the result image.
+    kLanePixels = 1 << 1,
+    // Lane lines, available from get_lane_tracker() and drawn on
+    // get_lane_lines_image().
+    kLaneLines = 1 << 2,
+    kAllResults = kTrafficLights | kLanePixels | kLaneLines,
+    // The results drawn on the result image.
+    kDrawnResults = kTrafficLights | kLanePixels
+  };
+  // Stages of Process, in the order they run.
+  enum Stage {
+    kGrayStage,
+    kGradientStage,
+    kCannyStage,
+    kTileStage,
+    kTrafficLightStage,
+    kLanePixelStage,
+    kLaneLineStage,
+    kNumberOfStages
+  };
+
+  // Constructor. mask_file is the name of an optional image of the lane mask.
+  // Lanes are only searched where it is brighter than 200. If mask_file is
+  // NULL or cannot be loaded, the mask is drawn by MaskField. If thread_pool
+  // is not NULL, Process splits each frame across its threads; the result is
+  // the same as without. thread_pool MUST outlive the object.
+  ProcessContext(const char* mask_file, EdgeMode edge_mode,
+                 ThreadPool* thread_pool);
+  // Destructor. Releases all the images.
+  ~ProcessContext();
+  // Rebuilds the traffic light color table from ranges, indexed by
+  // TrafficLightColor. ranges MUST hold kNumberOfColors entries.
+  void SetChromaRanges(const ChromaRange* ranges);
+  // Copies source_image to result_image and computes results, a bit set of
+  // Result. Only the stages results depend on are run. result_image MUST be
+  // a 3-channel IPL_DEPTH_8U image of the same size as source_image, and may
+  // be reused across calls. The intermediate images are only reallocated
+  // when the size changes.
+  void Process(const IplImage* source_image, int results,
+               IplImage* result_image);
+  // Same as above, for frame->get_image(). result_image MUST have the size
+  // frame->get_size(). If frame was decoded as YCbCr, it is not converted:
+  // the gray image and the traffic light colors are taken from its planes,
+  // and result_image is filled only if results include kDrawnResults: copied
+  // from the BGR image if frame->get_image() was called before, converted
+  // from the planes otherwise. Otherwise result_image is left as it is.
+  void Process(RasPiFrame* frame, int results, IplImage* result_image);
+  // Returns the lane lines found by the last Process call with kLaneLines.
+  const LaneTracker& get_lane_tracker() { return lane_tracker_; }
+  // Returns the image the lane lines of the last Process call with
+  // kLaneLines were drawn on, or NULL before the first call.
+  const IplImage* get_lane_lines_image() { return lane_gray_image_; }
+  // Returns the time stage took in the last Process call, in seconds, or 0
+  // if it did not run. Stages split into tasks report the sum over their
+  // tasks, which exceeds the elapsed time when the tasks run in parallel.
+  double GetStageSeconds(Stage stage);
+  // Copies the distribution of the time stage took per Process call that
+  // ran it, as GetStageSeconds, to snapshot. Can be called from any thread.
+  void GetStageLatency(Stage stage, HistogramSnapshot* snapshot) {
+    stage_latencies_[stage].GetSnapshot(snapshot);
+  }
+  // Copies the distribution of the elapsed time of Process calls to
+  // snapshot. Can be called from any thread.
+  void GetProcessLatency(HistogramSnapshot* snapshot) {
+    process_latency_.GetSnapshot(snapshot);
+  }
+  // MetricsDumper::Writer writing the latencies of the ProcessContext
+  // context.
+  static void WriteMetrics(void* context, FILE* file);
+  // Returns the name of stage.
+  static const char* GetStageName(Stage stage) { return kStages[stage].name; }
+  // Returns the bit set of the stages (1 << Stage) that results, a bit set of
+  // Result, depend on.
+  static int GetActiveStages(int results);
+
+ private:
+  // Intermediate data passed between stages. Stages take and produce bit
+  // sets of Data and Result.
+  enum Data {
+    // gray_image_.
+    kGrayData = 1 << 3,
+    // img_32f_ and mag_, or smooth_image_, diff_x_ and diff_y_.
+    kGradientData = 1 << 4,
+    // edge_image_.
+    kEdgeData = 1 << 5,
+    // tiles_.
+    kTileData = 1 << 6
+  };
+  struct StageInfo {
+    const char* name;
+    int inputs;
+    int outputs;
+  };
+  enum {
+    // Width and height of the areas searched for traffic lights.
+    kTileSize = 40,
+    // Number of lane roi rows marked by one task.
+    kLaneBandRows = 32
+  };
+  // Allocates the intermediate images for frames of size, unless they
+  // already have that size.
+  void Allocate(CvSize size);
+  // Releases all the intermediate images.
+  void Release();
+  // Builds mask_ from mask_file_, or with MaskField if it cannot be loaded.
+  void BuildMask();
+  // Body of Process. Uses the planes in luma_, blue_chroma_ and red_chroma_
+  // if they are not NULL, in which case source_image may be NULL and
+  // result_image is not filled from it.
+  void ProcessImage(const IplImage* source_image, int results,
+                    IplImage* result_image);
+  // Calls task(this, index) for every index in [0, count), on thread_pool_
+  // if there is one.
+  void RunTasks(int count, ThreadPool::Task task);
+  // Task of the first phase. Index 0 runs FindEdges, index i > 0 sums the
+  // traffic light colors of tile row i - 1.
+  static void FindEdgesOrSumTileRow(void* context, int index);
+  // Task of the second phase. Index 0 runs FindLines, index i > 0 runs
+  // MarkLanes on the i-th band of kLaneBandRows rows.
+  static void FindLinesOrMarkLaneBand(void* context, int index);
+  // Returns the current time in QueryPerformanceCounter ticks.
+  static LONGLONG GetTicks();
+  // Adds the ticks since *start to the time of stage and sets *start to the
+  // current time. Can be called from any task.
+  void EndStage(Stage stage, LONGLONG* start);
+  // Returns true if stage runs for the current frame.
+  bool IsActive(Stage stage) { return (active_stages_ & (1 << stage)) != 0; }
+  // Runs the active stages among kGrayStage, kGradientStage and kCannyStage
+  // on the lower half of result_image_.
+  void FindEdges();
+  // Draws circles on result_image_ where tiles_ hold enough traffic light
+  // colors. Tile rows are visited in order, so the drawing is deterministic.
+  void DrawTrafficLights();
+  // Paints the lane pixels of the lane roi rows [first_row, last_row) on
+  // result_image_.
+  void MarkLanes(int first_row, int last_row);
+  // Finds straight lines in edge_image_ with lane_tracker_ and draws them on
+  // lane_gray_image_.
+  void FindLines();
+
+  ProcessContext(const ProcessContext&);
+  void operator=(const ProcessContext&);
+
+  const char* mask_file_;
+  EdgeMode edge_mode_;
+  ThreadPool* thread_pool_;
+  // Images of the frame being processed, or NULL outside of Process.
+  const IplImage* source_image_;
+  IplImage* result_image_;
+  // Planes of the frame being processed, or NULL if it is only available as
+  // BGR.
+  const IplImage* luma_;
+  const IplImage* blue_chroma_;
+  const IplImage* red_chroma_;
+  // Stages run for the frame being processed.
+  int active_stages_;
+  // Ticks spent in each stage during the last Process call, indexed by
+  // Stage. Added to with InterlockedExchangeAdd64.
+  volatile LONGLONG stage_ticks_[kNumberOfStages];
+  // QueryPerformanceFrequency.
+  LONGLONG ticks_per_second_;
+  // stage_ticks_ of every Process call, for the stages it ran.
+  LatencyHistogram stage_latencies_[kNumberOfStages];
+  LatencyHistogram process_latency_;
+  // Size of the frames the images below are allocated for. Images not used
+  // by edge_mode_ are NULL.
+  CvSize size_;
+  // Lower half of the result image. A 3-channel color image.
+  IplImage* roi_image_;
+  // roi_image_ in 0 ~ 255 gray scale. A 1-channel IPL_DEPTH_8U image.
+  IplImage* gray_image_;
+  // gray_image_ in 0. ~ 1. gray scale. A 1-channel IPL_DEPTH_32F image.
+  // kFloatEdges only.
+  IplImage* img_32f_;
+  // Smoothed gray_image_. kFixedPointEdges only.
+  IplImage* smooth_image_;
+  // Differentiation results of img_32f_ (IPL_DEPTH_32F) or smooth_image_
+  // (IPL_DEPTH_16S) by x and y.
+  IplImage* diff_x_;
+  IplImage* diff_y_;
+  // Magnitude of the differentiation results. kFloatEdges only.
+  IplImage* mag_;
+  // Canny edges of gray_image_.
+  IplImage* edge_image_;
+  // Lines found by the Hough transforms.
+  IplImage* lane_gray_image_;
+  // Mask of the lane roi. Only depends on the size.
+  IplImage* mask_;
+  // Storage of the Hough transform results. Cleared every frame.
+  CvMemStorage* storage_;
+  // Lines of the previous frames.
+  LaneTracker lane_tracker_;
+  // Traffic light color sums of the tiles of the upper half.
+  TileColorSums* tiles_;
+  // Maps the Cb and Cr of a pixel to its traffic light colors.
+  ChromaTable chroma_table_;
+
+  // Inputs and outputs of the stages, indexed by Stage. Every stage comes
+  // after the stages producing its inputs.
+  static const StageInfo kStages[kNumberOfStages];
+};
+
+#endif  // RASPICAMERA_RASPI_PROCESS_H_
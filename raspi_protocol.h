@@ -0,0 +1,71 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_PROTOCOL_H_
+#define RASPICAMERA_RASPI_PROTOCOL_H_
+
+// Wire protocol between the Raspberry Pi camera server and its clients,
+// RasPiCamera and the POSIX tools alike. Only needs the UINT typedefs of
+// Windows or raspi_platform.h.
+//
+// Every message starts with a MessageHeader in network byte order. The
+// client sends kConfigure once, then kRequestSerial messages at any time;
+// the server sends frames. A kReceiveImageV2 frame header is followed by a
+// FrameInfo. A frame of length 0 ends the stream.
+
+// header for configuration. the speed of light.
+const UINT32 kConfigure = 299792458U;
+// header for receiving image. the first ten digits of pi
+const UINT32 kReceiveImage = 3141592653U;
+// header for receiving image with FrameInfo.
+// the first ten digits of the golden ratio
+const UINT32 kReceiveImageV2 = 1618033988U;
+// header for sending serial requests.
+// the first ten digits of Euler's number
+const UINT32 kRequestSerial = 2718281828U;
+// Newest FrameInfo version.
+const UINT16 kProtocolVersion = 2;
+// Line of the configuration asking the server for kReceiveImageV2 frames.
+const char* const kProtocolVersion2Line = "protocol_version=2\n";
+// Largest frame header accepted, FrameInfo and later extensions included, so
+// that a corrupt FrameInfo cannot make the stream skip a whole frame.
+const UINT16 kMaxFrameHeaderSize = 256;
+
+#pragma pack(push, 1)
+struct MessageHeader {
+  UINT32 header;
+  UINT32 length;
+};
+struct FrameInfo {
+  // version of the header, at least 2
+  UINT16 version;
+  // size of the whole header from MessageHeader on. Later versions may
+  // append fields, which are skipped.
+  UINT16 header_size;
+  // sequence number of the frame on the Raspberry Pi
+  UINT64 sequence;
+  // capture time, in microseconds since 1970-01-01 UTC
+  UINT64 capture_time;
+};
+#pragma pack(pop)
+
+// Returns value in network byte order.
+inline UINT64 HostToNetwork64(UINT64 value) {
+  UINT64 result;
+  UINT8* bytes = reinterpret_cast<UINT8*>(&result);
+  for (int byte = 7; byte >= 0; --byte) {
+    bytes[byte] = static_cast<UINT8>(value);
+    value >>= 8;
+  }
+  return result;
+}
+
+// Returns value, in network byte order, in host byte order.
+inline UINT64 NetworkToHost64(UINT64 value) {
+  const UINT8* bytes = reinterpret_cast<const UINT8*>(&value);
+  UINT64 result = 0;
+  for (int byte = 0; byte < 8; ++byte)
+    result = (result << 8) | bytes[byte];
+  return result;
+}
+
+#endif  // RASPICAMERA_RASPI_PROTOCOL_H_
@@ -0,0 +1,81 @@
+// Copyright 2016
+
+#include "raspi_receive_ring.h"
+#include <algorithm>
+
+ReceiveRing::ReceiveRing(int capacity) {
+  buffer_ = NULL;
+  capacity_ = MAX(capacity, kMinCapacity);
+  read_ = 0;
+  size_ = 0;
+}
+
+ReceiveRing::~ReceiveRing() {
+  free(buffer_);
+}
+
+char* ReceiveRing::GetFreeSpace(int* size) {
+  if (buffer_ == NULL) {
+    buffer_ = static_cast<char*>(malloc(capacity_));
+    if (buffer_ == NULL) {
+      *size = 0;
+      return NULL;
+    }
+  }
+  // A short remainder, typically a partial header, is cheaper to move than
+  // to wrap.
+  if (size_ <= kMaxCompaction)
+    Compact();
+  int write = read_ + size_;
+  if (write < capacity_) {
+    *size = capacity_ - write;
+    return buffer_ + write;
+  }
+  write -= capacity_;
+  *size = read_ - write;
+  return buffer_ + write;
+}
+
+void ReceiveRing::Commit(int size) {
+  size_ += size;
+}
+
+const char* ReceiveRing::Peek(int size, char* scratch) {
+  if (read_ + size <= capacity_)
+    return buffer_ + read_;
+  int first = capacity_ - read_;
+  memcpy(scratch, buffer_ + read_, first);
+  memcpy(scratch + first, buffer_, size - first);
+  return scratch;
+}
+
+int ReceiveRing::Read(char* destination, int size) {
+  size = MIN(size, size_);
+  if (size == 0)
+    return 0;
+  const char* data = Peek(size, destination);
+  if (data != destination)
+    memcpy(destination, data, size);
+  Consume(size);
+  return size;
+}
+
+void ReceiveRing::Consume(int size) {
+  size_ -= size;
+  read_ += size;
+  if (read_ >= capacity_)
+    read_ -= capacity_;
+  // An empty ring starts over, so the next parts are contiguous.
+  if (size_ == 0)
+    read_ = 0;
+}
+
+void ReceiveRing::Compact() {
+  if (read_ == 0)
+    return;
+  if (read_ + size_ <= capacity_)
+    memmove(buffer_, buffer_ + read_, size_);
+  else
+    std::rotate(buffer_, buffer_ + read_, buffer_ + capacity_);
+  read_ = 0;
+}
@@ -0,0 +1,68 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_RECEIVE_RING_H_
+#define RASPICAMERA_RASPI_RECEIVE_RING_H_
+
+// A ring buffer between a socket and the frame parser, so that one recv
+// brings in as much as the socket holds, often several headers and small
+// frames at once, instead of one call per header and per image. Parts are
+// read in place when they are contiguous and copied out only when they wrap.
+// Owned by one thread; the ring itself does not lock.
+class ReceiveRing {
+ public:
+  enum {
+    // Default capacity in bytes.
+    kDefaultCapacity = 256 * 1024,
+    // Smallest capacity in bytes, so that any frame header fits.
+    kMinCapacity = 4 * 1024,
+    // Buffered data up to this many bytes is moved to the start of the
+    // buffer before receiving, so that parts rarely wrap.
+    kMaxCompaction = 4 * 1024
+  };
+
+  // Constructor. capacity is raised to kMinCapacity if it is smaller. The
+  // buffer is allocated by the first GetFreeSpace.
+  explicit ReceiveRing(int capacity = kDefaultCapacity);
+  // Destructor. Frees the buffer.
+  ~ReceiveRing();
+  // Returns the capacity in bytes.
+  int get_capacity() { return capacity_; }
+  // Returns the number of bytes buffered.
+  int get_size() { return size_; }
+  // Returns the number of bytes that can be buffered contiguously from the
+  // first buffered byte on. A part of at most this size is contiguous once
+  // it is completely buffered.
+  int get_contiguous_capacity() { return capacity_ - read_; }
+  // Returns where the next bytes received should go, and sets *size to the
+  // number of bytes that fit there. *size is 0 if the ring is full. Returns
+  // NULL if the buffer cannot be allocated.
+  char* GetFreeSpace(int* size);
+  // Adds size bytes written at the last GetFreeSpace to the buffered data.
+  void Commit(int size);
+  // Returns a pointer to the first size buffered bytes, which MUST be
+  // buffered. Points into the ring if they are contiguous; otherwise they
+  // are copied to scratch, which is returned. The data is valid until the
+  // next Consume or GetFreeSpace.
+  const char* Peek(int size, char* scratch);
+  // Copies up to size buffered bytes to destination and consumes them.
+  // Returns the number of bytes copied.
+  int Read(char* destination, int size);
+  // Discards the first size buffered bytes.
+  void Consume(int size);
+  // Moves the buffered bytes to the start of the buffer, so that
+  // get_contiguous_capacity() becomes get_capacity().
+  void Compact();
+
+ private:
+  ReceiveRing(const ReceiveRing&);
+  void operator=(const ReceiveRing&);
+
+  char* buffer_;
+  int capacity_;
+  // Offset of the first buffered byte.
+  int read_;
+  // Number of bytes buffered from read_ on, wrapping at capacity_.
+  int size_;
+};
+
+#endif  // RASPICAMERA_RASPI_RECEIVE_RING_H_
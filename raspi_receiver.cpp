@@ -0,0 +1,186 @@
+// Copyright 2016
+
+// Headless receiver for load testing the POSIX transport. Connects to one or
+// more camera servers (e.g. raspi_simulator) on a single EventLoop thread,
+// checks the received frames, and reports the frame rate, throughput, stalls
+// and skipped frames of every stream each second. Built by the Makefile.
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "raspi_tools.h"
+#include "raspi_transport.h"
+
+namespace {
+
+const char* kUsage =
+    "Usage: %s [-t seconds] [-c file] [-1] [-T milliseconds]\n"
+    "       [-E milliseconds] [-k text] [-b bytes] [-R bytes]\n"
+    "       address:port...\n"
+    "Receives frames from every address:port until all the streams end or\n"
+    "seconds seconds pass.\n"
+    "  -c  camera configuration file to send (default: empty)\n"
+    "  -1  ask for version 1 frame headers\n"
+    "  -T  milliseconds without data counted as a stall (default: 1000)\n"
+    "  -E  milliseconds without data after which a stream fails\n"
+    "      (default: 10000)\n"
+    "  -k  send text as a serial request to every stream each second\n"
+    "  -b  capacity of the receive ring buffers (default: 262144)\n"
+    "  -R  SO_RCVBUF of the sockets (default: system default)\n";
+
+// A stream and what the receiver learned about its frames.
+struct Receiver {
+  FrameStream* stream;
+  // Frames not starting with a JPEG start of image marker.
+  volatile LONG bad_frames;
+  // Counters at the last report.
+  StreamStats reported;
+};
+
+// FrameStream::FrameHandler checking that the frame looks like a JPEG.
+void OnFrame(void* context, const StreamFrame& frame) {
+  const UINT8* data = frame.data->data.ptr;
+  if (frame.data->cols < 2 || data[0] != 0xFF || data[1] != 0xD8)
+    InterlockedIncrement(&static_cast<Receiver*>(context)->bad_frames);
+}
+
+const char* GetStatusName(FrameStream::Status status) {
+  switch (status) {
+    case FrameStream::kConnecting:
+      return "connecting";
+    case FrameStream::kOK:
+      return "ok";
+    case FrameStream::kEnd:
+      return "end";
+    default:
+      return "error";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Reports show up as they happen even when piped.
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  double time_limit = 0;
+  std::string configuration;
+  FrameStream::Options options;
+  const char* serial_request = NULL;
+  int option;
+  while ((option = getopt(argc, argv, "t:c:1T:E:k:b:R:")) != -1) {
+    switch (option) {
+      case 't':
+        time_limit = atof(optarg);
+        break;
+      case 'c': {
+        std::vector<UINT8> data;
+        if (!ReadFile(optarg, &data)) {
+          fprintf(stderr, "Cannot read %s.\n", optarg);
+          return EXIT_FAILURE;
+        }
+        configuration.assign(data.begin(), data.end());
+        break;
+      }
+      case '1':
+        options.protocol_version = 1;
+        break;
+      case 'T':
+        options.stall_timeout = static_cast<DWORD>(atol(optarg));
+        break;
+      case 'E':
+        options.timeout = static_cast<DWORD>(atol(optarg));
+        break;
+      case 'k':
+        serial_request = optarg;
+        break;
+      case 'b':
+        options.receive_buffer_size = atoi(optarg);
+        break;
+      case 'R':
+        options.socket_receive_buffer = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, kUsage, argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, kUsage, argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  EventLoop loop;
+  if (!loop.is_open())
+    return EXIT_FAILURE;
+  std::vector<Receiver> receivers(argc - optind);
+  for (size_t index = 0; index < receivers.size(); ++index) {
+    std::string endpoint = argv[optind + index];
+    size_t colon = endpoint.rfind(':');
+    if (colon == std::string::npos) {
+      fprintf(stderr, "Expected address:port, got %s.\n", endpoint.c_str());
+      receivers.resize(index);
+      break;
+    }
+    Receiver* receiver = &receivers[index];
+    receiver->bad_frames = 0;
+    memset(&receiver->reported, 0, sizeof(receiver->reported));
+    receiver->stream = new FrameStream(
+        &loop, endpoint.substr(0, colon).c_str(),
+        endpoint.substr(colon + 1).c_str(), configuration, OnFrame, receiver,
+        options);
+  }
+
+  double start = GetSeconds();
+  double last_report = start;
+  bool running = receivers.size() == static_cast<size_t>(argc - optind);
+  while (running) {
+    usleep(1000000);
+    double now = GetSeconds();
+    running = time_limit <= 0 || now - start < time_limit;
+    bool streaming = false;
+    for (size_t index = 0; index < receivers.size(); ++index) {
+      Receiver* receiver = &receivers[index];
+      FrameStream::Status status = receiver->stream->get_status();
+      streaming = streaming || status == FrameStream::kConnecting ||
+                  status == FrameStream::kOK;
+      if (serial_request != NULL)
+        receiver->stream->RequestSerial(serial_request,
+                                        strlen(serial_request));
+      StreamStats stats;
+      receiver->stream->GetStats(&stats);
+      LONGLONG frames =
+          stats.frames_received - receiver->reported.frames_received;
+      LONGLONG recv_calls =
+          stats.recv_calls - receiver->reported.recv_calls;
+      printf("%s %s: %lld frames, %.1f frames/s, %.1f MiB/s, %.2f recv/frame, "
+             "%lld in place, %lld stalls (%lld ms, longest %lld ms), "
+             "%lld skipped, %d bad\n",
+             receiver->stream->get_name().c_str(), GetStatusName(status),
+             stats.frames_received, frames / (now - last_report),
+             (stats.bytes_received - receiver->reported.bytes_received) /
+                 (now - last_report) / (1024 * 1024),
+             frames > 0 ? static_cast<double>(recv_calls) / frames : 0.0,
+             stats.frames_in_place,
+             stats.stalls, stats.stalled_milliseconds,
+             stats.longest_stall_milliseconds, stats.sender_skipped_frames,
+             static_cast<int>(receiver->bad_frames));
+      receiver->reported = stats;
+    }
+    last_report = now;
+    running = running && streaming;
+  }
+
+  // Nothing blocks on a socket, so the streams stop at once.
+  double stop_start = GetSeconds();
+  bool failed = receivers.size() != static_cast<size_t>(argc - optind);
+  for (size_t index = 0; index < receivers.size(); ++index) {
+    failed = failed ||
+             receivers[index].stream->get_status() == FrameStream::kError ||
+             receivers[index].bad_frames > 0;
+    delete receivers[index].stream;
+  }
+  printf("Stopped %d streams in %.3f ms.\n",
+         static_cast<int>(receivers.size()),
+         (GetSeconds() - stop_start) * 1000);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
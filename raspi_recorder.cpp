@@ -0,0 +1,141 @@
+// Copyright 2016
+
+#include <string.h>
+
+FrameRecorder::FrameRecorder(const char* file_name,
+                             UINT32 max_pending_bytes) {
+  writer_thread_ = NULL;
+  max_pending_bytes_ = max_pending_bytes;
+  LARGE_INTEGER ticks;
+  QueryPerformanceCounter(&ticks);
+  start_ticks_ = ticks.QuadPart;
+  QueryPerformanceFrequency(&ticks);
+  ticks_per_second_ = ticks.QuadPart;
+  next_offset_ = sizeof(RecordingHeader);
+  failed_ = false;
+  dropped_frames_ = 0;
+  InitializeCriticalSection(&lock_);
+  InitializeConditionVariable(&batch_ready_);
+  stopping_ = false;
+  file_ = CreateFileA(file_name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                      FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+                      NULL);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    fprintf_s(stderr, kErrorMessageFor, "CreateFile", file_name,
+              GetLastError());
+    return;
+  }
+  RecordingHeader header;
+  header.magic = kRecordingMagic;
+  header.version = kRecordingVersion;
+  FILETIME start_time;
+  GetSystemTimeAsFileTime(&start_time);
+  header.start_time = (static_cast<UINT64>(start_time.dwHighDateTime) << 32) |
+                      start_time.dwLowDateTime;
+  if (!Write(&header, sizeof(header)))
+    return;
+  writer_thread_ = CreateThread(
+      NULL, 0, (LPTHREAD_START_ROUTINE)WriterLoop, this, 0, NULL);
+  if (writer_thread_ == NULL) {
+    fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+    failed_ = true;
+  }
+}
+
+FrameRecorder::~FrameRecorder() {
+  if (writer_thread_ != NULL) {
+    EnterCriticalSection(&lock_);
+    stopping_ = true;
+    LeaveCriticalSection(&lock_);
+    WakeConditionVariable(&batch_ready_);
+    WaitForSingleObject(writer_thread_, INFINITE);
+    CloseHandle(writer_thread_);
+    if (!failed_)
+      WriteIndex();
+  }
+  if (file_ != INVALID_HANDLE_VALUE && CloseHandle(file_) == 0)
+    fprintf_s(stderr, kErrorMessage, "CloseHandle", GetLastError());
+  DeleteCriticalSection(&lock_);
+}
+
+bool FrameRecorder::Append(const CvMat* image, LONGLONG sequence) {
+  if (!is_open() || writer_thread_ == NULL) {
+    InterlockedIncrement(&dropped_frames_);
+    return false;
+  }
+  LARGE_INTEGER ticks;
+  QueryPerformanceCounter(&ticks);
+  RecordedFrame frame;
+  frame.offset = next_offset_;
+  frame.sequence = sequence;
+  frame.timestamp = (ticks.QuadPart - start_ticks_) * 1000000 /
+                    ticks_per_second_;
+  frame.size = static_cast<UINT32>(image->cols);
+  EnterCriticalSection(&lock_);
+  if (pending_.size() + sizeof(frame) + frame.size > max_pending_bytes_) {
+    LeaveCriticalSection(&lock_);
+    InterlockedIncrement(&dropped_frames_);
+    return false;
+  }
+  bool was_empty = pending_.empty();
+  const UINT8* header = reinterpret_cast<const UINT8*>(&frame);
+  pending_.insert(pending_.end(), header, header + sizeof(frame));
+  pending_.insert(pending_.end(), image->data.ptr,
+                  image->data.ptr + frame.size);
+  LeaveCriticalSection(&lock_);
+  if (was_empty)
+    WakeConditionVariable(&batch_ready_);
+  index_.push_back(frame);
+  next_offset_ += sizeof(frame) + frame.size;
+  return true;
+}
+
+DWORD FrameRecorder::WriterLoop(LPVOID lpParam) {
+  FrameRecorder* recorder = static_cast<FrameRecorder*>(lpParam);
+  std::vector<UINT8> batch;
+  EnterCriticalSection(&recorder->lock_);
+  while (TRUE) {
+    while (recorder->pending_.empty() && !recorder->stopping_)
+      SleepConditionVariableCS(&recorder->batch_ready_, &recorder->lock_,
+                               INFINITE);
+    if (recorder->pending_.empty())
+      break;
+    batch.swap(recorder->pending_);
+    LeaveCriticalSection(&recorder->lock_);
+    // After a failure the batches are still taken, so Append keeps seeing
+    // room, but they are thrown away.
+    if (!recorder->failed_)
+      recorder->Write(&batch[0], batch.size());
+    batch.clear();
+    EnterCriticalSection(&recorder->lock_);
+  }
+  LeaveCriticalSection(&recorder->lock_);
+  return TRUE;
+}
+
+bool FrameRecorder::Write(const void* data, size_t size) {
+  const char* buffer = static_cast<const char*>(data);
+  while (size > 0) {
+    DWORD written = 0;
+    if (WriteFile(file_, buffer, static_cast<DWORD>(size), &written, NULL) ==
+        0) {
+      fprintf_s(stderr, kErrorMessage, "WriteFile", GetLastError());
+      failed_ = true;
+      return false;
+    }
+    buffer += written;
+    size -= written;
+  }
+  return true;
+}
+
+void FrameRecorder::WriteIndex() {
+  RecordingFooter footer;
+  footer.index_offset = next_offset_;
+  footer.frame_count = static_cast<UINT32>(index_.size());
+  footer.magic = kRecordingMagic;
+  if (!index_.empty() &&
+      !Write(&index_[0], index_.size() * sizeof(index_[0])))
+    return;
+  Write(&footer, sizeof(footer));
+}
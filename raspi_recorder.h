@@ -0,0 +1,75 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_RECORDER_H_
+#define RASPICAMERA_RASPI_RECORDER_H_
+
+#include <vector>
+#include "raspi_recording.h"
+
+// Writes received frames to a recording file (see raspi_recording.h) on a
+// writer thread. Append only copies the frame into the pending batch, so the
+// receiving thread never waits for the disk; the writer takes the whole batch
+// at once and writes it with a single WriteFile call.
+class FrameRecorder {
+ public:
+  enum {
+    // Default limit of the bytes waiting for the writer (64 MiB).
+    kDefaultMaxPendingBytes = 64 * 1024 * 1024
+  };
+
+  // Constructor. Creates file_name, replacing any existing file, and starts
+  // the writer thread. Frames are dropped while more than max_pending_bytes
+  // wait for the writer. On error, is_open() returns false.
+  FrameRecorder(const char* file_name, UINT32 max_pending_bytes);
+  // Destructor. Writes the pending frames, the index and the footer, and
+  // closes the file.
+  ~FrameRecorder();
+  // Returns true if the file was created and no write has failed.
+  bool is_open() { return file_ != INVALID_HANDLE_VALUE && !failed_; }
+  // Appends the frame held by image, a 1-row CV_8UC1 matrix, with sequence
+  // and the current time. Returns false if the frame was dropped because the
+  // writer is behind or has failed. MUST be called from one thread at a time.
+  bool Append(const CvMat* image, LONGLONG sequence);
+  // Returns the number of frames dropped by Append. Can be called from any
+  // thread.
+  LONG get_dropped_frames() { return dropped_frames_; }
+
+ private:
+  // Function called by writer_thread_. Writes batches until stopping_ is
+  // set and the last batch is written.
+  static DWORD WINAPI WriterLoop(LPVOID lpParam);
+  // Writes size bytes of data at the end of the file. Sets failed_ and
+  // returns false on error.
+  bool Write(const void* data, size_t size);
+  // Writes the index and the footer after the frames.
+  void WriteIndex();
+
+  FrameRecorder(const FrameRecorder&);
+  void operator=(const FrameRecorder&);
+
+  HANDLE file_;
+  HANDLE writer_thread_;
+  UINT32 max_pending_bytes_;
+  // QueryPerformanceCounter at the start of the recording, and its frequency.
+  LONGLONG start_ticks_;
+  LONGLONG ticks_per_second_;
+  // Offset the next appended frame will be written at. Only used by Append.
+  UINT64 next_offset_;
+  // Headers of the appended frames. Only used by Append until the writer
+  // has stopped.
+  std::vector<RecordedFrame> index_;
+  // Set by the writer when a write fails. Append drops frames from then on.
+  volatile bool failed_;
+  volatile LONG dropped_frames_;
+  // Guards the fields below.
+  CRITICAL_SECTION lock_;
+  // Signaled when pending_ becomes non-empty or stopping_ becomes true.
+  CONDITION_VARIABLE batch_ready_;
+  // Frames waiting for the writer, already laid out as in the file. Swapped
+  // with the writer's buffer, so both keep their capacity.
+  std::vector<UINT8> pending_;
+  // Set by the destructor to stop writer_thread_.
+  bool stopping_;
+};
+
+#endif  // RASPICAMERA_RASPI_RECORDER_H_
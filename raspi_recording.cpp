@@ -0,0 +1,133 @@
+// Copyright 2016
+
+#include <string.h>
+
+Recording::Recording(const char* file_name) {
+  file_ = INVALID_HANDLE_VALUE;
+  mapping_ = NULL;
+  view_ = NULL;
+  size_ = 0;
+  header_ = NULL;
+  file_ = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    fprintf_s(stderr, kErrorMessageFor, "CreateFile", file_name,
+              GetLastError());
+    return;
+  }
+  LARGE_INTEGER file_size;
+  if (GetFileSizeEx(file_, &file_size) == 0) {
+    fprintf_s(stderr, kErrorMessage, "GetFileSizeEx", GetLastError());
+    return;
+  }
+  size_ = static_cast<ULONGLONG>(file_size.QuadPart);
+  if (size_ < sizeof(RecordingHeader) ||
+      size_ > static_cast<SIZE_T>(-1)) {
+    fprintf_s(stderr, "%s is not a recording that can be mapped.\n",
+              file_name);
+    return;
+  }
+  mapping_ = CreateFileMapping(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping_ == NULL) {
+    fprintf_s(stderr, kErrorMessage, "CreateFileMapping", GetLastError());
+    return;
+  }
+  const UINT8* view = static_cast<const UINT8*>(
+      MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+  if (view == NULL) {
+    fprintf_s(stderr, kErrorMessage, "MapViewOfFile", GetLastError());
+    return;
+  }
+  header_ = reinterpret_cast<const RecordingHeader*>(view);
+  if (header_->magic != kRecordingMagic ||
+      header_->version != kRecordingVersion) {
+    fprintf_s(stderr, "%s is not a recording of version %d.\n", file_name,
+              kRecordingVersion);
+    UnmapViewOfFile(view);
+    header_ = NULL;
+    return;
+  }
+  view_ = view;
+  if (!ReadIndex()) {
+    fprintf_s(stderr, "%s has no valid index. Scanning the frames.\n",
+              file_name);
+    ScanFrames();
+  }
+}
+
+Recording::~Recording() {
+  if (view_ != NULL)
+    UnmapViewOfFile(view_);
+  if (mapping_ != NULL)
+    CloseHandle(mapping_);
+  if (file_ != INVALID_HANDLE_VALUE)
+    CloseHandle(file_);
+}
+
+void Recording::GetFrameData(int index, CvMat* matrix) {
+  const RecordedFrame& frame = index_[index];
+  const UINT8* data = view_ + static_cast<size_t>(frame.offset) + sizeof(frame);
+  cvInitMatHeader(matrix, 1, frame.size, CV_8UC1, const_cast<UINT8*>(data));
+}
+
+int Recording::FindFrame(LONGLONG timestamp) {
+  // Frames are recorded in the order they are received.
+  int first = 0;
+  int last = get_frame_count();
+  while (first < last) {
+    int middle = first + (last - first) / 2;
+    if (index_[middle].timestamp < timestamp)
+      first = middle + 1;
+    else
+      last = middle;
+  }
+  return first;
+}
+
+bool Recording::ReadIndex() {
+  if (size_ < sizeof(RecordingHeader) + sizeof(RecordingFooter))
+    return false;
+  const RecordingFooter* footer = reinterpret_cast<const RecordingFooter*>(
+      view_ + static_cast<size_t>(size_) - sizeof(RecordingFooter));
+  ULONGLONG index_end = size_ - sizeof(RecordingFooter);
+  if (footer->magic != kRecordingMagic ||
+      footer->index_offset < sizeof(RecordingHeader) ||
+      footer->index_offset > index_end ||
+      index_end - footer->index_offset !=
+          static_cast<ULONGLONG>(footer->frame_count) * sizeof(RecordedFrame))
+    return false;
+  // Every frame lies before the index, so a non-empty index cannot start
+  // before the first frame ends. The checks below subtract from it.
+  if (footer->frame_count > 0 &&
+      footer->index_offset < sizeof(RecordingHeader) + sizeof(RecordedFrame))
+    return false;
+  const RecordedFrame* entries = reinterpret_cast<const RecordedFrame*>(
+      view_ + static_cast<size_t>(footer->index_offset));
+  index_.assign(entries, entries + footer->frame_count);
+  for (size_t index = 0; index < index_.size(); ++index) {
+    const RecordedFrame& frame = index_[index];
+    if (frame.offset < sizeof(RecordingHeader) ||
+        frame.offset > footer->index_offset - sizeof(frame) ||
+        frame.size > footer->index_offset - sizeof(frame) - frame.offset ||
+        memcmp(view_ + static_cast<size_t>(frame.offset), &frame,
+               sizeof(frame)) != 0) {
+      index_.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+void Recording::ScanFrames() {
+  index_.clear();
+  ULONGLONG offset = sizeof(RecordingHeader);
+  while (size_ - offset >= sizeof(RecordedFrame)) {
+    RecordedFrame frame;
+    memcpy(&frame, view_ + static_cast<size_t>(offset), sizeof(frame));
+    if (frame.offset != offset ||
+        frame.size > size_ - offset - sizeof(frame))
+      break;
+    index_.push_back(frame);
+    offset += sizeof(frame) + frame.size;
+  }
+}
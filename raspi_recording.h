@@ -0,0 +1,103 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_RECORDING_H_
+#define RASPICAMERA_RASPI_RECORDING_H_
+
+#include <vector>
+
+// Layout of a recording file, written by FrameRecorder. Integers are
+// little-endian.
+//
+//   RecordingHeader
+//   RecordedFrame followed by its size bytes of JPEG data, once per frame
+//   RecordedFrame of every frame again, in order, as the index
+//   RecordingFooter
+//
+// The index and the footer are written when the recording is closed. If they
+// are missing, e.g. after a crash, Recording rebuilds the index by walking
+// the frames.
+#pragma pack(push, 1)
+struct RecordingHeader {
+  // kRecordingMagic.
+  UINT32 magic;
+  // kRecordingVersion.
+  UINT32 version;
+  // Wall clock time at the start of the recording, as a FILETIME.
+  UINT64 start_time;
+};
+struct RecordedFrame {
+  // Offset of this structure from the start of the file. Lets the index
+  // point to the frame.
+  UINT64 offset;
+  // Sequence number given to the frame by RasPiCamera.
+  LONGLONG sequence;
+  // Microseconds since the start of the recording when the frame was
+  // received.
+  LONGLONG timestamp;
+  // Size of the JPEG data in bytes.
+  UINT32 size;
+};
+struct RecordingFooter {
+  // Offset of the index from the start of the file.
+  UINT64 index_offset;
+  // Number of frames in the index.
+  UINT32 frame_count;
+  // kRecordingMagic. Lets a complete recording be told from a truncated one.
+  UINT32 magic;
+};
+#pragma pack(pop)
+
+enum {
+  // "RPCR" in little-endian order.
+  kRecordingMagic = 0x52435052,
+  kRecordingVersion = 1
+};
+
+// A recording file mapped into memory. Frames can be read in any order,
+// without copying them out of the mapping. The whole file is mapped, so
+// recordings are limited by the address space on 32-bit builds.
+class Recording {
+ public:
+  // Constructor. Maps file_name and reads its index. On error, is_open()
+  // returns false.
+  explicit Recording(const char* file_name);
+  // Destructor. Unmaps the file.
+  ~Recording();
+  // Returns true if the recording was mapped.
+  bool is_open() { return view_ != NULL; }
+  // Returns the wall clock time at the start of the recording, as a
+  // FILETIME.
+  UINT64 get_start_time() { return header_->start_time; }
+  // Returns the number of frames.
+  int get_frame_count() { return static_cast<int>(index_.size()); }
+  // Returns the header of frame index, in [0, get_frame_count()).
+  const RecordedFrame& get_frame(int index) { return index_[index]; }
+  // Initializes matrix as a 1 x size CV_8UC1 header over the JPEG data of
+  // frame index. The data stays valid until the object is destroyed.
+  void GetFrameData(int index, CvMat* matrix);
+  // Returns the index of the first frame received at or after timestamp,
+  // or get_frame_count() if there is none.
+  int FindFrame(LONGLONG timestamp);
+
+ private:
+  // Reads the index at the end of the file. Returns false if the footer is
+  // missing or the index is inconsistent with the file.
+  bool ReadIndex();
+  // Rebuilds the index by walking the frames from the header, up to the
+  // first incomplete frame.
+  void ScanFrames();
+
+  Recording(const Recording&);
+  void operator=(const Recording&);
+
+  HANDLE file_;
+  HANDLE mapping_;
+  // The mapped file, or NULL.
+  const UINT8* view_;
+  ULONGLONG size_;
+  const RecordingHeader* header_;
+  // Copy of the index, so that frames can be checked once against the file.
+  std::vector<RecordedFrame> index_;
+};
+
+#endif  // RASPICAMERA_RASPI_RECORDING_H_
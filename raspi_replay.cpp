@@ -0,0 +1,251 @@
+// Copyright 2016
+
+// Headless benchmark of the frame processing. Replays JPEG files through the
+// decoding and ProcessContext as the camera client runs them, without a
+// Raspberry Pi, and reports the latency percentiles of each step, the frame
+// rate and the peak memory use. Built by the Makefile.
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <opencv/cv.h>
+#include <opencv/cxcore.h>
+#include "raspi_jpeg.h"
+#include "raspi_process.h"
+#include "raspi_tools.h"
+
+namespace {
+
+const char* kUsage =
+    "Usage: %s [-n frames] [-t seconds] [-s scale] [-y] [-f] [-j threads]\n"
+    "       [-r results] [path...]\n"
+    "Decodes and processes the JPEG files in path, and in the directories in\n"
+    "path, in a loop until frames frames or seconds seconds have been\n"
+    "processed. frames defaults to 1000 without -t and to no limit with -t;\n"
+    "-n 0 also means no limit, and needs -t. path defaults to lena.jpg.\n"
+    "  -s  decode at 1/scale of the size: 1, 2, 4 or 8 (default: 1)\n"
+    "  -y  decode into Y, Cb and Cr planes (Options::decode_ycbcr)\n"
+    "  -f  find lane pixels with kFloatEdges instead of kFixedPointEdges\n"
+    "  -j  number of pool threads besides this one (default: cores - 1)\n"
+    "  -r  bit set of ProcessContext::Result to compute (default: 7)\n";
+
+// Most latencies a LatencySeries keeps.
+const size_t kMaxLatencySamples = 10000;
+
+// Latencies of the processed frames and their percentiles, in seconds. Keeps
+// a uniform sample of at most kMaxLatencySamples of them, allocated up front,
+// so that long runs do not add to the reported peak memory use.
+class LatencySeries {
+ public:
+  LatencySeries() {
+    samples_.reserve(kMaxLatencySamples);
+    count_ = 0;
+    max_ = 0;
+  }
+  // Adds the latency of a frame.
+  void Add(double seconds) {
+    max_ = MAX(max_, seconds);
+    ++count_;
+    if (samples_.size() < kMaxLatencySamples) {
+      samples_.push_back(seconds);
+      return;
+    }
+    // Reservoir sampling: the count_-th latency replaces a random sample
+    // with probability kMaxLatencySamples / count_.
+    size_t slot = static_cast<size_t>(rand() % count_);
+    if (slot < kMaxLatencySamples)
+      samples_[slot] = seconds;
+  }
+  // Prints the 50th and 99th percentiles and the maximum on one row of the
+  // report, in milliseconds. Prints nothing if no latency was added.
+  void Print(const char* name) {
+    if (samples_.empty())
+      return;
+    std::sort(samples_.begin(), samples_.end());
+    printf("%-16s %10.3f %10.3f %10.3f\n", name, Percentile(50) * 1000,
+           Percentile(99) * 1000, max_ * 1000);
+  }
+
+ private:
+  // Returns the nearest-rank percentile of the sorted samples_.
+  double Percentile(int percent) {
+    size_t rank = (samples_.size() * percent + 99) / 100;
+    return samples_[rank == 0 ? 0 : rank - 1];
+  }
+
+  std::vector<double> samples_;
+  // Number of latencies added, and the largest of them.
+  long count_;
+  double max_;
+};
+
+// Returns true if name ends with a JPEG extension.
+bool IsJpegName(const std::string& name) {
+  size_t dot = name.rfind('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string extension = name.substr(dot + 1);
+  for (size_t index = 0; index < extension.size(); ++index)
+    extension[index] = static_cast<char>(tolower(extension[index]));
+  return extension == "jpg" || extension == "jpeg";
+}
+
+// Appends path to paths if it is a file, or the JPEG files it holds, in
+// name order, if it is a directory.
+void ListJpegFiles(const char* path, std::vector<std::string>* paths) {
+  DIR* directory = opendir(path);
+  if (directory == NULL) {
+    paths->push_back(path);
+    return;
+  }
+  std::vector<std::string> names;
+  while (dirent* entry = readdir(directory)) {
+    if (IsJpegName(entry->d_name))
+      names.push_back(std::string(path) + "/" + entry->d_name);
+  }
+  closedir(directory);
+  std::sort(names.begin(), names.end());
+  paths->insert(paths->end(), names.begin(), names.end());
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Negative until -n is given.
+  int frame_limit = -1;
+  double time_limit = 0;
+  int scale = 1;
+  bool ycbcr = false;
+  ProcessContext::EdgeMode edge_mode = ProcessContext::kFixedPointEdges;
+  int thread_count = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)) - 1;
+  int results = ProcessContext::kAllResults;
+  int option;
+  while ((option = getopt(argc, argv, "n:t:s:yfj:r:")) != -1) {
+    switch (option) {
+      case 'n':
+        frame_limit = atoi(optarg);
+        break;
+      case 't':
+        time_limit = atof(optarg);
+        break;
+      case 's':
+        scale = atoi(optarg);
+        break;
+      case 'y':
+        ycbcr = true;
+        break;
+      case 'f':
+        edge_mode = ProcessContext::kFloatEdges;
+        break;
+      case 'j':
+        thread_count = atoi(optarg);
+        break;
+      case 'r':
+        results = atoi(optarg) & ProcessContext::kAllResults;
+        break;
+      default:
+        fprintf(stderr, kUsage, argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+    fprintf(stderr, kUsage, argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (frame_limit < 0)
+    frame_limit = time_limit > 0 ? 0 : 1000;
+  if (frame_limit == 0 && time_limit <= 0) {
+    fprintf(stderr, kUsage, argv[0]);
+    return EXIT_FAILURE;
+  }
+  std::vector<std::string> paths;
+  for (int index = optind; index < argc; ++index)
+    ListJpegFiles(argv[index], &paths);
+  if (optind == argc)
+    paths.push_back("lena.jpg");
+  // The files are read up front, so that the disk is not measured.
+  std::vector<std::vector<UINT8> > files(paths.size());
+  for (size_t index = 0; index < paths.size(); ++index) {
+    if (!ReadFile(paths[index].c_str(), &files[index]) ||
+        files[index].empty()) {
+      fprintf(stderr, "Cannot read %s.\n", paths[index].c_str());
+      return EXIT_FAILURE;
+    }
+  }
+  if (files.empty()) {
+    fprintf(stderr, "No JPEG files found.\n");
+    return EXIT_FAILURE;
+  }
+
+  ThreadPool thread_pool(MAX(thread_count, 0));
+  ProcessContext context(NULL, edge_mode, &thread_pool);
+  int active_stages = ProcessContext::GetActiveStages(results);
+  LatencySeries decode_latencies, process_latencies, frame_latencies;
+  LatencySeries stage_latencies[ProcessContext::kNumberOfStages];
+  IplImage* result_image = NULL;
+  int frames = 0;
+  double start = GetSeconds();
+  double now = start;
+  while ((frame_limit == 0 || frames < frame_limit) &&
+         (time_limit <= 0 || now - start < time_limit)) {
+    std::vector<UINT8>& file = files[frames % files.size()];
+    CvMat buffer = cvMat(1, static_cast<int>(file.size()), CV_8UC1, &file[0]);
+    double decode_start = now;
+    RasPiFrame* frame = DecodeFrame(&buffer, scale, ycbcr, frames);
+    if (frame == NULL) {
+      fprintf(stderr, "Cannot decode %s.\n",
+              paths[frames % files.size()].c_str());
+      cvReleaseImage(&result_image);
+      return EXIT_FAILURE;
+    }
+    double process_start = GetSeconds();
+    // Planes are not converted to BGR unless results are drawn.
+    CvSize size = frame->get_size();
+    if (result_image == NULL || result_image->width != size.width ||
+        result_image->height != size.height) {
+      cvReleaseImage(&result_image);
+      result_image = cvCreateImage(size, IPL_DEPTH_8U, 3);
+    }
+    context.Process(frame, results, result_image);
+    frame->Release();
+    now = GetSeconds();
+    decode_latencies.Add(process_start - decode_start);
+    process_latencies.Add(now - process_start);
+    frame_latencies.Add(now - decode_start);
+    for (int stage = 0; stage < ProcessContext::kNumberOfStages; ++stage) {
+      if (active_stages & (1 << stage)) {
+        stage_latencies[stage].Add(context.GetStageSeconds(
+            static_cast<ProcessContext::Stage>(stage)));
+      }
+    }
+    ++frames;
+  }
+  cvReleaseImage(&result_image);
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%d frames of %d files, scale %d, %s, %s edges, %d threads\n",
+         frames, static_cast<int>(files.size()), scale,
+         ycbcr ? "YCbCr" : "BGR",
+         edge_mode == ProcessContext::kFixedPointEdges ? "fixed-point" :
+                                                         "float",
+         thread_pool.get_thread_count() + 1);
+  printf("%-16s %10s %10s %10s\n", "ms", "p50", "p99", "max");
+  decode_latencies.Print("decode");
+  // Stages split into tasks add up the time of their tasks.
+  for (int stage = 0; stage < ProcessContext::kNumberOfStages; ++stage) {
+    stage_latencies[stage].Print(ProcessContext::GetStageName(
+        static_cast<ProcessContext::Stage>(stage)));
+  }
+  process_latencies.Print("process");
+  frame_latencies.Print("frame");
+  if (frames > 0)
+    printf("%.1f frames per second\n", frames / (now - start));
+  // ru_maxrss is in KiB on Linux.
+  printf("peak RSS %.1f MiB\n", usage.ru_maxrss / 1024.0);
+  return EXIT_SUCCESS;
+}
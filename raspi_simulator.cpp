@@ -0,0 +1,347 @@
+// Copyright 2016
+
+// Stand-in for the Raspberry Pi camera server, for load testing RasPiCamera
+// over loopback. Speaks the wire protocol of RasPiCamera: it takes the
+// kConfigure blob, streams kReceiveImage frames at a set rate and size, and
+// logs the kRequestSerial commands. Faults can be injected to exercise the
+// error paths of Connect, Recv and ImageLoop. Built by the Makefile; point
+// kCameraAddr and kCameraPort at it.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "raspi_protocol.h"
+#include "raspi_tools.h"
+
+namespace {
+
+// Header of kReceiveImageV2 frames, in network byte order.
+#pragma pack(push, 1)
+struct HeaderV2 {
+  MessageHeader header;
+  FrameInfo info;
+};
+#pragma pack(pop)
+
+const char* kUsage =
+    "Usage: %s [-p port] [-r rate] [-n frames] [-s size] [-1] [-S frames]\n"
+    "       [-T milliseconds] [-w bytes] [-W microseconds] [-B frames]\n"
+    "       [-D frames] [jpeg...]\n"
+    "Serves the JPEG files (default: lena.jpg) in a loop to one RasPiCamera\n"
+    "at a time.\n"
+    "  -p  port to listen on (default: 12345)\n"
+    "  -r  frames per second; 0 sends as fast as possible (default: 30)\n"
+    "  -n  frames to send before a zero-length end frame; 0 never ends\n"
+    "  -s  pad every frame with zeros to at least size bytes\n"
+    "  -1  send version 1 headers even if the client asks for version 2\n"
+    "Faults:\n"
+    "  -S  stall for -T milliseconds (default: 2000) before every S-th frame\n"
+    "  -w  send frames in writes of at most bytes bytes, -W microseconds\n"
+    "      apart (default: 100), so that they arrive in pieces\n"
+    "  -B  send a bad header instead of every B-th frame\n"
+    "  -D  skip the sequence number of every D-th frame, as if the camera\n"
+    "      dropped it (version 2 headers only)\n";
+
+struct SimulatorOptions {
+  int port;
+  double rate;
+  int frame_limit;
+  UINT32 min_size;
+  bool version1_only;
+  int stall_every;
+  int stall_milliseconds;
+  int write_size;
+  int write_delay;
+  int bad_header_every;
+  int skip_every;
+};
+
+// Returns the current time in microseconds since 1970-01-01 UTC.
+UINT64 GetUnixTime() {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return static_cast<UINT64>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+// Sleeps until the GetSeconds() time deadline.
+void SleepUntil(double deadline) {
+  double remaining = deadline - GetSeconds();
+  if (remaining > 0)
+    usleep(static_cast<useconds_t>(remaining * 1000000));
+}
+
+// Sends size bytes of data to client in writes of at most write_size bytes,
+// write_delay microseconds apart, or at once if write_size is 0. Returns
+// false if the connection is lost.
+bool SendAll(int client, const void* data, size_t size, int write_size,
+             int write_delay) {
+  const char* buffer = static_cast<const char*>(data);
+  while (size > 0) {
+    size_t length = size;
+    if (write_size > 0) {
+      length = MIN(size, static_cast<size_t>(write_size));
+      usleep(write_delay);
+    }
+    ssize_t sent = send(client, buffer, length, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      fprintf_s(stderr, kErrorMessage, "send", GetLastError());
+      return false;
+    }
+    buffer += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+// Receives size bytes from client into data. Returns false if the
+// connection is closed or lost first.
+bool RecvAll(int client, void* data, size_t size) {
+  char* buffer = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t received = recv(client, buffer, size, 0);
+    if (received <= 0)
+      return false;
+    buffer += received;
+    size -= received;
+  }
+  return true;
+}
+
+// Receives a message from client into header and payload. Returns false if
+// the connection is closed or lost first.
+bool RecvMessage(int client, MessageHeader* header, std::string* payload) {
+  if (!RecvAll(client, header, sizeof(*header)))
+    return false;
+  header->header = ntohl(header->header);
+  header->length = ntohl(header->length);
+  payload->resize(header->length);
+  return header->length == 0 || RecvAll(client, &(*payload)[0],
+                                        header->length);
+}
+
+// Entry point of the thread logging the serial requests of a client, whose
+// socket is passed as lpParam. Ends when the connection is closed.
+DWORD WINAPI SerialLoop(LPVOID lpParam) {
+  int client = static_cast<int>(reinterpret_cast<intptr_t>(lpParam));
+  MessageHeader header;
+  std::string payload;
+  while (RecvMessage(client, &header, &payload)) {
+    if (header.header == kRequestSerial) {
+      printf("serial request: \"%s\"\n", payload.c_str());
+    } else {
+      printf("unexpected request header %u of %u bytes\n", header.header,
+             header.length);
+    }
+  }
+  return TRUE;
+}
+
+// Serves frames to client until the connection is lost or the frame limit
+// is reached.
+void Serve(int client, const SimulatorOptions& options,
+           const std::vector<std::vector<UINT8> >& frames) {
+  MessageHeader header;
+  std::string configuration;
+  if (!RecvMessage(client, &header, &configuration))
+    return;
+  if (header.header != kConfigure) {
+    printf("expected the configuration, got header %u\n", header.header);
+    return;
+  }
+  bool version2 =
+      !options.version1_only &&
+      configuration.find(kProtocolVersion2Line) != std::string::npos;
+  printf("configuration of %u bytes, sending version %d headers\n",
+         header.length, version2 ? 2 : 1);
+  HANDLE serial_thread = CreateThread(
+      NULL, 0, (LPTHREAD_START_ROUTINE)SerialLoop,
+      reinterpret_cast<LPVOID>(static_cast<intptr_t>(client)), 0, NULL);
+  if (serial_thread == NULL)
+    fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+
+  std::vector<UINT8> padding;
+  HeaderV2 header_v2;
+  header_v2.info.version = htons(2);
+  header_v2.info.header_size = htons(sizeof(header_v2));
+  UINT64 sequence = 0;
+  double start = GetSeconds();
+  double next_frame = start;
+  double report_start = start;
+  int report_frames = 0;
+  double report_bytes = 0;
+  for (int count = 1; options.frame_limit == 0 ||
+                      count <= options.frame_limit; ++count) {
+    const std::vector<UINT8>& frame = frames[(count - 1) % frames.size()];
+    if (options.rate > 0) {
+      SleepUntil(next_frame);
+      next_frame += 1 / options.rate;
+    }
+    if (options.stall_every > 0 && count % options.stall_every == 0) {
+      printf("stalling for %d ms before frame %d\n",
+             options.stall_milliseconds, count);
+      usleep(options.stall_milliseconds * 1000);
+      // The rate resumes from now instead of catching up.
+      next_frame = GetSeconds();
+    }
+    UINT32 size = MAX(static_cast<UINT32>(frame.size()), options.min_size);
+    ++sequence;
+    if (options.skip_every > 0 && count % options.skip_every == 0)
+      ++sequence;
+    header.header = htonl(version2 ? kReceiveImageV2 : kReceiveImage);
+    if (options.bad_header_every > 0 &&
+        count % options.bad_header_every == 0) {
+      printf("sending a bad header instead of frame %d\n", count);
+      header.header = htonl(kReceiveImage ^ 0xFF);
+    }
+    header.length = htonl(size);
+    header_v2.header = header;
+    header_v2.info.sequence = HostToNetwork64(sequence);
+    // The frames are stored, so they are captured when they are sent.
+    header_v2.info.capture_time = HostToNetwork64(GetUnixTime());
+    padding.assign(size - frame.size(), 0);
+    if (!SendAll(client, version2 ? static_cast<void*>(&header_v2) : &header,
+                 version2 ? sizeof(header_v2) : sizeof(header),
+                 options.write_size, options.write_delay) ||
+        !SendAll(client, &frame[0], frame.size(), options.write_size,
+                 options.write_delay) ||
+        (!padding.empty() &&
+         !SendAll(client, &padding[0], padding.size(), options.write_size,
+                  options.write_delay)))
+      break;
+    ++report_frames;
+    report_bytes += (version2 ? sizeof(header_v2) : sizeof(header)) + size;
+    double now = GetSeconds();
+    if (now - report_start >= 1) {
+      printf("%d frames, %.1f frames/s, %.1f MiB/s\n", count,
+             report_frames / (now - report_start),
+             report_bytes / (now - report_start) / (1024 * 1024));
+      report_start = now;
+      report_frames = 0;
+      report_bytes = 0;
+    }
+    if (count == options.frame_limit) {
+      printf("sending the end frame after %d frames\n", count);
+      // Both versions end with an empty version 1 frame.
+      header.header = htonl(kReceiveImage);
+      header.length = 0;
+      SendAll(client, &header, sizeof(header), 0, 0);
+    }
+  }
+  // Lets the client see the end of the stream, then waits for it to close
+  // the connection, which ends the serial thread.
+  shutdown(client, SHUT_WR);
+  if (serial_thread != NULL) {
+    WaitForSingleObject(serial_thread, INFINITE);
+    CloseHandle(serial_thread);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Logs show up as they happen even when piped.
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  SimulatorOptions options;
+  options.port = 12345;
+  options.rate = 30;
+  options.frame_limit = 0;
+  options.min_size = 0;
+  options.version1_only = false;
+  options.stall_every = 0;
+  options.stall_milliseconds = 2000;
+  options.write_size = 0;
+  options.write_delay = 100;
+  options.bad_header_every = 0;
+  options.skip_every = 0;
+  int option;
+  while ((option = getopt(argc, argv, "p:r:n:s:1S:T:w:W:B:D:")) != -1) {
+    switch (option) {
+      case 'p':
+        options.port = atoi(optarg);
+        break;
+      case 'r':
+        options.rate = atof(optarg);
+        break;
+      case 'n':
+        options.frame_limit = atoi(optarg);
+        break;
+      case 's':
+        options.min_size = static_cast<UINT32>(atol(optarg));
+        break;
+      case '1':
+        options.version1_only = true;
+        break;
+      case 'S':
+        options.stall_every = atoi(optarg);
+        break;
+      case 'T':
+        options.stall_milliseconds = atoi(optarg);
+        break;
+      case 'w':
+        options.write_size = atoi(optarg);
+        break;
+      case 'W':
+        options.write_delay = atoi(optarg);
+        break;
+      case 'B':
+        options.bad_header_every = atoi(optarg);
+        break;
+      case 'D':
+        options.skip_every = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, kUsage, argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  std::vector<std::vector<UINT8> > frames;
+  for (int index = optind; index < argc || frames.empty(); ++index) {
+    const char* path = index < argc ? argv[index] : "lena.jpg";
+    frames.push_back(std::vector<UINT8>());
+    if (!ReadFile(path, &frames.back()) || frames.back().empty()) {
+      fprintf(stderr, "Cannot read %s.\n", path);
+      return EXIT_FAILURE;
+    }
+  }
+
+  int listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (listener < 0) {
+    fprintf_s(stderr, kErrorMessage, "socket", GetLastError());
+    return EXIT_FAILURE;
+  }
+  int reuse = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+  address.sin_port = htons(static_cast<uint16_t>(options.port));
+  if (bind(listener, reinterpret_cast<sockaddr*>(&address),
+           sizeof(address)) != 0 ||
+      listen(listener, 1) != 0) {
+    fprintf_s(stderr, kErrorMessage, "bind", GetLastError());
+    close(listener);
+    return EXIT_FAILURE;
+  }
+  printf("Listening on port %d with %d frames.\n", options.port,
+         static_cast<int>(frames.size()));
+  while (TRUE) {
+    sockaddr_in client_address;
+    socklen_t client_address_size = sizeof(client_address);
+    int client = accept(listener,
+                        reinterpret_cast<sockaddr*>(&client_address),
+                        &client_address_size);
+    if (client < 0) {
+      fprintf_s(stderr, kErrorMessage, "accept", GetLastError());
+      continue;
+    }
+    printf("Connection from %s:%d\n", inet_ntoa(client_address.sin_addr),
+           ntohs(client_address.sin_port));
+    Serve(client, options, frames);
+    close(client);
+    printf("Connection closed.\n");
+  }
+}
@@ -0,0 +1,141 @@
+// Copyright 2016
+
+// Headless station receiving and processing the frames of several cameras
+// (e.g. raspi_simulator) with a CameraManager. Reports the frame rate, the
+// dropped frames and the queueing and processing latencies of every camera
+// each second. Built by the Makefile.
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "raspi_camera_manager.h"
+#include "raspi_tools.h"
+
+namespace {
+
+const char* kUsage =
+    "Usage: %s [-t seconds] [-c file] [-l loops] [-j workers] [-s scale]\n"
+    "       [-y] [-m file] address:port...\n"
+    "Receives and processes the frames of every address:port until all the\n"
+    "streams end or seconds seconds pass.\n"
+    "  -c  camera configuration file to send (default: empty)\n"
+    "  -l  threads receiving the frames (default: 1)\n"
+    "  -j  threads decoding and processing the frames (default: 2)\n"
+    "  -s  decode at 1/scale of the size: 1, 2, 4 or 8 (default: 1)\n"
+    "  -y  decode to Y, Cb and Cr planes, which are only converted to BGR\n"
+    "      to draw the traffic lights and lane pixels on\n"
+    "  -m  append the metrics to file every second\n";
+
+const char* GetStatusName(FrameStream::Status status) {
+  switch (status) {
+    case FrameStream::kConnecting:
+      return "connecting";
+    case FrameStream::kOK:
+      return "ok";
+    case FrameStream::kEnd:
+      return "end";
+    default:
+      return "error";
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  // Reports show up as they happen even when piped.
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  double time_limit = 0;
+  std::string configuration;
+  CameraManager::Options options;
+  const char* metrics_file = NULL;
+  int option;
+  while ((option = getopt(argc, argv, "t:c:l:j:s:ym:")) != -1) {
+    switch (option) {
+      case 't':
+        time_limit = atof(optarg);
+        break;
+      case 'c': {
+        std::vector<UINT8> data;
+        if (!ReadFile(optarg, &data)) {
+          fprintf(stderr, "Cannot read %s.\n", optarg);
+          return EXIT_FAILURE;
+        }
+        configuration.assign(data.begin(), data.end());
+        break;
+      }
+      case 'l':
+        options.loop_count = atoi(optarg);
+        break;
+      case 'j':
+        options.worker_count = atoi(optarg);
+        break;
+      case 's':
+        options.decode_scale = atoi(optarg);
+        break;
+      case 'y':
+        options.decode_ycbcr = true;
+        break;
+      case 'm':
+        metrics_file = optarg;
+        break;
+      default:
+        fprintf(stderr, kUsage, argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind == argc) {
+    fprintf(stderr, kUsage, argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::string> endpoints(argv + optind, argv + argc);
+  CameraManager manager(endpoints, configuration, NULL, NULL, options);
+  if (!manager.is_open())
+    return EXIT_FAILURE;
+  MetricsDumper* metrics_dumper = NULL;
+  if (metrics_file != NULL) {
+    metrics_dumper = new MetricsDumper(metrics_file, 1000);
+    metrics_dumper->Add(CameraManager::WriteMetrics, &manager);
+  }
+
+  std::vector<LONGLONG> reported(manager.get_camera_count(), 0);
+  double start = GetSeconds();
+  double last_report = start;
+  bool running = true;
+  while (running) {
+    usleep(1000000);
+    double now = GetSeconds();
+    running = time_limit <= 0 || now - start < time_limit;
+    bool streaming = false;
+    for (int index = 0; index < manager.get_camera_count(); ++index) {
+      CameraStatus status;
+      manager.GetStatus(index, &status);
+      streaming = streaming || status.status == FrameStream::kConnecting ||
+                  status.status == FrameStream::kOK;
+      printf("%s %s: %lld received, %.1f processed/s, %lld dropped, "
+             "%lld bad, queue p50 %.2f ms p99 %.2f ms, process p50 %.2f ms "
+             "p99 %.2f ms\n",
+             manager.get_name(index).c_str(), GetStatusName(status.status),
+             status.stream.frames_received,
+             (status.frames_processed - reported[index]) /
+                 (now - last_report),
+             status.frames_dropped, status.decode_failures,
+             status.queue_latency.GetPercentile(50) / 1000.0,
+             status.queue_latency.GetPercentile(99) / 1000.0,
+             status.process_latency.GetPercentile(50) / 1000.0,
+             status.process_latency.GetPercentile(99) / 1000.0);
+      reported[index] = status.frames_processed;
+    }
+    last_report = now;
+    running = running && streaming;
+  }
+
+  delete metrics_dumper;
+  bool failed = false;
+  for (int index = 0; index < manager.get_camera_count(); ++index) {
+    CameraStatus status;
+    manager.GetStatus(index, &status);
+    failed = failed || status.status == FrameStream::kError;
+  }
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
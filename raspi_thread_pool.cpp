@@ -0,0 +1,94 @@
+// Copyright 2016
+
+#include "raspi_thread_pool.h"
+
+ThreadPool::ThreadPool(int thread_count) {
+  thread_count_ = 0;
+  threads_ = NULL;
+  task_ = NULL;
+  context_ = NULL;
+  count_ = 0;
+  next_index_ = 0;
+  loop_number_ = 0;
+  busy_threads_ = 0;
+  stopping_ = false;
+  InitializeCriticalSection(&lock_);
+  InitializeConditionVariable(&loop_ready_);
+  InitializeConditionVariable(&loop_done_);
+  if (thread_count <= 0)
+    return;
+  threads_ = new HANDLE[thread_count];
+  for (int index = 0; index < thread_count; ++index) {
+    threads_[index] = CreateThread(
+        NULL, 0, (LPTHREAD_START_ROUTINE)WorkerLoop, this, 0, NULL);
+    if (threads_[index] == NULL) {
+      fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+      break;
+    }
+    ++thread_count_;
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  EnterCriticalSection(&lock_);
+  stopping_ = true;
+  LeaveCriticalSection(&lock_);
+  WakeAllConditionVariable(&loop_ready_);
+  for (int index = 0; index < thread_count_; ++index) {
+    WaitForSingleObject(threads_[index], INFINITE);
+    CloseHandle(threads_[index]);
+  }
+  delete[] threads_;
+  DeleteCriticalSection(&lock_);
+}
+
+void ThreadPool::ParallelFor(int count, Task task, void* context) {
+  if (thread_count_ == 0 || count <= 1) {
+    for (int index = 0; index < count; ++index)
+      task(context, index);
+    return;
+  }
+  EnterCriticalSection(&lock_);
+  task_ = task;
+  context_ = context;
+  count_ = count;
+  next_index_ = 0;
+  busy_threads_ = thread_count_;
+  ++loop_number_;
+  LeaveCriticalSection(&lock_);
+  WakeAllConditionVariable(&loop_ready_);
+  RunTasks();
+  EnterCriticalSection(&lock_);
+  while (busy_threads_ > 0)
+    SleepConditionVariableCS(&loop_done_, &lock_, INFINITE);
+  LeaveCriticalSection(&lock_);
+}
+
+void ThreadPool::RunTasks() {
+  while (TRUE) {
+    int index = static_cast<int>(InterlockedIncrement(&next_index_)) - 1;
+    if (index >= count_)
+      return;
+    task_(context_, index);
+  }
+}
+
+DWORD WINAPI ThreadPool::WorkerLoop(LPVOID lpParam) {
+  ThreadPool* pool = static_cast<ThreadPool*>(lpParam);
+  LONG loop_number = 0;
+  EnterCriticalSection(&pool->lock_);
+  while (TRUE) {
+    while (!pool->stopping_ && pool->loop_number_ == loop_number)
+      SleepConditionVariableCS(&pool->loop_ready_, &pool->lock_, INFINITE);
+    if (pool->stopping_)
+      break;
+    loop_number = pool->loop_number_;
+    LeaveCriticalSection(&pool->lock_);
+    pool->RunTasks();
+    EnterCriticalSection(&pool->lock_);
+    if (--pool->busy_threads_ == 0)
+      WakeConditionVariable(&pool->loop_done_);
+  }
+  LeaveCriticalSection(&pool->lock_);
+  return TRUE;
+}
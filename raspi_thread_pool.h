@@ -0,0 +1,61 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_THREAD_POOL_H_
+#define RASPICAMERA_RASPI_THREAD_POOL_H_
+
+// A fixed set of threads running the indices of a loop in parallel. The
+// calling thread takes part in every loop, so a pool of thread_count threads
+// uses thread_count + 1 cores.
+class ThreadPool {
+ public:
+  // Function run for each index of a loop. context is passed through from
+  // ParallelFor.
+  typedef void (*Task)(void* context, int index);
+
+  // Constructor. Starts thread_count threads. If a thread cannot be created,
+  // the pool runs with the threads created so far. With 0 threads,
+  // ParallelFor runs the loop on the calling thread.
+  explicit ThreadPool(int thread_count);
+  // Destructor. Waits for the threads to end.
+  ~ThreadPool();
+  // Returns the number of threads of the pool.
+  int get_thread_count() { return thread_count_; }
+  // Calls task(context, index) for every index in [0, count), and returns
+  // once all the calls have returned. Idle threads take the next index in
+  // increasing order, so long tasks should have small indices. MUST NOT be
+  // called from a task or from two threads at once.
+  void ParallelFor(int count, Task task, void* context);
+
+ private:
+  // Function called by threads_. Runs the tasks of each loop until
+  // stopping_ is set.
+  static DWORD WINAPI WorkerLoop(LPVOID lpParam);
+  // Takes indices of the current loop and runs them until none are left.
+  void RunTasks();
+
+  ThreadPool(const ThreadPool&);
+  void operator=(const ThreadPool&);
+
+  int thread_count_;
+  HANDLE* threads_;
+  // Guards the fields below, except next_index_.
+  CRITICAL_SECTION lock_;
+  // Signaled when a loop starts or stopping_ becomes true.
+  CONDITION_VARIABLE loop_ready_;
+  // Signaled when the last thread finishes its part of a loop.
+  CONDITION_VARIABLE loop_done_;
+  // The current loop.
+  Task task_;
+  void* context_;
+  int count_;
+  // Next index of the current loop to run. Taken with InterlockedIncrement.
+  volatile LONG next_index_;
+  // Incremented when a loop starts, so threads see every loop once.
+  LONG loop_number_;
+  // Number of threads that have not finished the current loop.
+  int busy_threads_;
+  // Set by the destructor to stop threads_.
+  bool stopping_;
+};
+
+#endif  // RASPICAMERA_RASPI_THREAD_POOL_H_
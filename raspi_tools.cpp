@@ -0,0 +1,25 @@
+// Copyright 2016
+
+#include "raspi_tools.h"
+
+double GetSeconds() {
+  LARGE_INTEGER ticks, frequency;
+  QueryPerformanceCounter(&ticks);
+  QueryPerformanceFrequency(&frequency);
+  return static_cast<double>(ticks.QuadPart) / frequency.QuadPart;
+}
+
+bool ReadFile(const char* path, std::vector<UINT8>* data) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf_s(stderr, kErrorMessage, "fopen", GetLastError());
+    return false;
+  }
+  data->clear();
+  UINT8 buffer[65536];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data->insert(data->end(), buffer, buffer + length);
+  fclose(file);
+  return true;
+}
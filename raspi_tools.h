@@ -0,0 +1,16 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_TOOLS_H_
+#define RASPICAMERA_RASPI_TOOLS_H_
+
+// Helpers shared by the headless tools of the Makefile.
+
+#include <vector>
+
+// Returns the current time in seconds.
+double GetSeconds();
+// Reads the whole file at path into data. Returns false if it cannot be
+// read.
+bool ReadFile(const char* path, std::vector<UINT8>* data);
+
+#endif  // RASPICAMERA_RASPI_TOOLS_H_
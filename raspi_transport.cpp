@@ -0,0 +1,603 @@
+// Copyright 2016
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include "raspi_transport.h"
+
+EventLoop::EventLoop() {
+  wake_ = -1;
+  thread_ = NULL;
+  running_ = NULL;
+  stopping_ = false;
+  InitializeCriticalSection(&lock_);
+  InitializeConditionVariable(&idle_);
+  epoll_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_ < 0) {
+    fprintf_s(stderr, kErrorMessage, "epoll_create1", GetLastError());
+    return;
+  }
+  wake_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wake_ < 0) {
+    fprintf_s(stderr, kErrorMessage, "eventfd", GetLastError());
+    return;
+  }
+  // The wake up event is the only one without a stream.
+  epoll_event event;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, wake_, &event) != 0) {
+    fprintf_s(stderr, kErrorMessage, "epoll_ctl", GetLastError());
+    return;
+  }
+  thread_ = CreateThread(
+      NULL, 0, (LPTHREAD_START_ROUTINE)LoopThread, this, 0, NULL);
+  if (thread_ == NULL)
+    fprintf_s(stderr, kErrorMessage, "CreateThread", GetLastError());
+}
+
+EventLoop::~EventLoop() {
+  EnterCriticalSection(&lock_);
+  stopping_ = true;
+  LeaveCriticalSection(&lock_);
+  if (thread_ != NULL) {
+    Wake();
+    WaitForSingleObject(thread_, INFINITE);
+    CloseHandle(thread_);
+  }
+  if (wake_ >= 0)
+    close(wake_);
+  if (epoll_ >= 0)
+    close(epoll_);
+  DeleteCriticalSection(&lock_);
+}
+
+void EventLoop::Add(FrameStream* stream, int events) {
+  EnterCriticalSection(&lock_);
+  streams_.push_back(stream);
+  LeaveCriticalSection(&lock_);
+  epoll_event event;
+  event.events = events;
+  event.data.ptr = stream;
+  if (epoll_ctl(epoll_, EPOLL_CTL_ADD, stream->socket_, &event) != 0)
+    fprintf_s(stderr, kErrorMessage, "epoll_ctl", GetLastError());
+  // The timers of the stream start now.
+  Wake();
+}
+
+void EventLoop::Remove(FrameStream* stream) {
+  // Fails harmlessly if the stream already deregistered itself.
+  epoll_ctl(epoll_, EPOLL_CTL_DEL, stream->socket_, NULL);
+  EnterCriticalSection(&lock_);
+  streams_.erase(std::remove(streams_.begin(), streams_.end(), stream),
+                 streams_.end());
+  while (running_ == stream)
+    SleepConditionVariableCS(&idle_, &lock_, INFINITE);
+  LeaveCriticalSection(&lock_);
+}
+
+void EventLoop::Modify(FrameStream* stream, int events) {
+  epoll_event event;
+  event.events = events;
+  event.data.ptr = stream;
+  if (epoll_ctl(epoll_, EPOLL_CTL_MOD, stream->socket_, &event) != 0)
+    fprintf_s(stderr, kErrorMessage, "epoll_ctl", GetLastError());
+}
+
+void EventLoop::Wake() {
+  uint64_t one = 1;
+  // Only fails if the counter is about to overflow, in which case the loop
+  // is awake anyway.
+  ssize_t result = write(wake_, &one, sizeof(one));
+  (void)result;
+}
+
+DWORD EventLoop::LoopThread(LPVOID lpParam) {
+  EventLoop* loop = static_cast<EventLoop*>(lpParam);
+  epoll_event events[kMaxEvents];
+  int timeout = -1;
+  while (TRUE) {
+    int count = epoll_wait(loop->epoll_, events, kMaxEvents, timeout);
+    if (count < 0) {
+      if (errno == EINTR)
+        continue;
+      fprintf_s(stderr, kErrorMessage, "epoll_wait", GetLastError());
+      break;
+    }
+    EnterCriticalSection(&loop->lock_);
+    bool stopping = loop->stopping_;
+    LeaveCriticalSection(&loop->lock_);
+    if (stopping)
+      break;
+    timeout = loop->PollStreams(events, count);
+  }
+  return TRUE;
+}
+
+int EventLoop::PollStreams(const epoll_event* events, int count) {
+  for (int index = 0; index < count; ++index) {
+    if (events[index].data.ptr == NULL) {
+      uint64_t value;
+      ssize_t result = read(wake_, &value, sizeof(value));
+      (void)result;
+    }
+  }
+  // Every stream is polled, with or without events, so that its timers and
+  // the output queued since the last poll are handled.
+  EnterCriticalSection(&lock_);
+  std::vector<FrameStream*> streams(streams_);
+  LeaveCriticalSection(&lock_);
+  LONGLONG now = FrameStream::GetMilliseconds();
+  LONGLONG next_timer = -1;
+  for (size_t stream_index = 0; stream_index < streams.size();
+       ++stream_index) {
+    FrameStream* stream = streams[stream_index];
+    EnterCriticalSection(&lock_);
+    bool added = std::find(streams_.begin(), streams_.end(), stream) !=
+                 streams_.end();
+    if (added)
+      running_ = stream;
+    LeaveCriticalSection(&lock_);
+    // Removed meanwhile, and maybe already deleted.
+    if (!added)
+      continue;
+    // A stream removed and another added at the same address within one
+    // epoll_wait may get the events of the first. Polling without data
+    // only costs an EAGAIN.
+    int stream_events = 0;
+    for (int index = 0; index < count; ++index) {
+      if (events[index].data.ptr == stream)
+        stream_events |= events[index].events;
+    }
+    LONGLONG timer = stream->Poll(stream_events, now);
+    if (timer >= 0 && (next_timer < 0 || timer < next_timer))
+      next_timer = timer;
+    EnterCriticalSection(&lock_);
+    running_ = NULL;
+    LeaveCriticalSection(&lock_);
+    WakeAllConditionVariable(&idle_);
+  }
+  if (next_timer < 0)
+    return -1;
+  return static_cast<int>(MAX(next_timer - FrameStream::GetMilliseconds(),
+                              0LL));
+}
+
+FrameStream::Options::Options() {
+  max_frame_size = kDefaultMaxFrameSize;
+  protocol_version = 2;
+  stall_timeout = kDefaultStallTimeout;
+  timeout = kDefaultTimeout;
+  receive_buffer_size = ReceiveRing::kDefaultCapacity;
+  socket_receive_buffer = 0;
+}
+
+FrameStream::FrameStream(EventLoop* loop, const char* address,
+                         const char* port, const std::string& configuration,
+                         FrameHandler handler, void* context,
+                         const Options& options)
+    : frame_pool_(1, options.max_frame_size),
+      ring_(options.receive_buffer_size) {
+  loop_ = loop;
+  name_ = std::string(address) + ":" + port;
+  socket_ = -1;
+  status_ = kConnecting;
+  handler_ = handler;
+  context_ = context;
+  stall_timeout_ = options.stall_timeout;
+  timeout_ = options.timeout;
+  state_ = kReceivingHeader;
+  part_ = NULL;
+  part_remaining_ = 0;
+  sequence_ = 0;
+  sender_sequence_ = 0;
+  last_receive_ = GetMilliseconds();
+  receiving_ = false;
+  stalled_ = false;
+  registered_events_ = 0;
+  InitializeCriticalSection(&output_lock_);
+  bytes_received_ = 0;
+  recv_calls_ = 0;
+  frames_received_ = 0;
+  frames_in_place_ = 0;
+  sender_skipped_frames_ = 0;
+  stalls_ = 0;
+  stalled_milliseconds_ = 0;
+  longest_stall_milliseconds_ = 0;
+  ExpectPart(kReceivingHeader, &header_, sizeof(header_));
+
+  // Servers that do not know the line ignore it, as with RasPiCamera.
+  std::string message = configuration;
+  if (options.protocol_version >= 2) {
+    if (!message.empty() && message[message.size() - 1] != '\n')
+      message += '\n';
+    message += kProtocolVersion2Line;
+  }
+  MessageHeader header;
+  header.header = htonl(kConfigure);
+  header.length = htonl(static_cast<UINT32>(message.size()));
+  output_.assign(reinterpret_cast<const char*>(&header), sizeof(header));
+  output_ += message;
+
+  // Only the name is resolved synchronously.
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_protocol = IPPROTO_TCP;
+  addrinfo* addresses = NULL;
+  int result = getaddrinfo(address, port, &hints, &addresses);
+  if (result != 0) {
+    fprintf_s(stderr, "getaddrinfo for %s failed: %s\n", name_.c_str(),
+              gai_strerror(result));
+    status_ = kError;
+    return;
+  }
+  for (addrinfo* entry = addresses; entry != NULL; entry = entry->ai_next) {
+    socket_ = socket(entry->ai_family,
+                     entry->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     entry->ai_protocol);
+    if (socket_ < 0)
+      continue;
+    // Set before connecting, so that the TCP window scale can grow to it.
+    if (options.socket_receive_buffer > 0 &&
+        setsockopt(socket_, SOL_SOCKET, SO_RCVBUF,
+                   &options.socket_receive_buffer,
+                   sizeof(options.socket_receive_buffer)) != 0)
+      fprintf_s(stderr, kErrorMessageFor, "setsockopt", "SO_RCVBUF",
+                GetLastError());
+    // Serial requests are small and latency bound, as in RasPiCamera.
+    int no_delay = 1;
+    if (setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, &no_delay,
+                   sizeof(no_delay)) != 0)
+      fprintf_s(stderr, kErrorMessageFor, "setsockopt", "TCP_NODELAY",
+                GetLastError());
+    if (connect(socket_, entry->ai_addr, entry->ai_addrlen) == 0 ||
+        errno == EINPROGRESS)
+      break;
+    close(socket_);
+    socket_ = -1;
+  }
+  freeaddrinfo(addresses);
+  if (socket_ < 0) {
+    fprintf_s(stderr, kErrorMessageFor, "connect", name_.c_str(),
+              GetLastError());
+    status_ = kError;
+    return;
+  }
+  // Writable once connected.
+  registered_events_ = EPOLLOUT;
+  loop_->Add(this, registered_events_);
+}
+
+FrameStream::~FrameStream() {
+  if (socket_ >= 0) {
+    loop_->Remove(this);
+    close(socket_);
+  }
+  DeleteCriticalSection(&output_lock_);
+}
+
+void FrameStream::GetStats(StreamStats* stats) {
+  // A plain 64-bit read is not atomic on 32-bit targets.
+  stats->bytes_received = InterlockedCompareExchange64(&bytes_received_, 0, 0);
+  stats->recv_calls = InterlockedCompareExchange64(&recv_calls_, 0, 0);
+  stats->frames_in_place = InterlockedCompareExchange64(&frames_in_place_,
+                                                        0, 0);
+  stats->frames_received = InterlockedCompareExchange64(&frames_received_,
+                                                        0, 0);
+  stats->sender_skipped_frames = InterlockedCompareExchange64(
+      &sender_skipped_frames_, 0, 0);
+  stats->stalls = InterlockedCompareExchange64(&stalls_, 0, 0);
+  stats->stalled_milliseconds = InterlockedCompareExchange64(
+      &stalled_milliseconds_, 0, 0);
+  stats->longest_stall_milliseconds = InterlockedCompareExchange64(
+      &longest_stall_milliseconds_, 0, 0);
+}
+
+bool FrameStream::RequestSerial(const char* data, int len) {
+  MessageHeader header;
+  header.header = htonl(kRequestSerial);
+  header.length = htonl(static_cast<UINT32>(len));
+  EnterCriticalSection(&output_lock_);
+  bool queued = (status_ == kConnecting || status_ == kOK) &&
+                output_.size() + sizeof(header) + len <= kMaxPendingOutput;
+  if (queued) {
+    // Header and data leave in one write.
+    output_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    output_.append(data, len);
+  }
+  LeaveCriticalSection(&output_lock_);
+  if (queued)
+    loop_->Wake();
+  return queued;
+}
+
+LONGLONG FrameStream::Poll(int events, LONGLONG now) {
+  if (status_ == kConnecting) {
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+      FinishConnect();
+  } else if (status_ == kOK && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+    Receive(now);
+  }
+  if (status_ == kOK)
+    Flush();
+  if (status_ != kConnecting && status_ != kOK)
+    return -1;
+  LONGLONG idle = now - last_receive_;
+  if (idle >= timeout_) {
+    fprintf_s(stderr, "%s: nothing received for %lld ms.\n", name_.c_str(),
+              idle);
+    EndStall(now);
+    Stop(kError);
+    return -1;
+  }
+  // Stalls only count once bytes flow.
+  bool timing_stalls = status_ == kOK && receiving_;
+  if (timing_stalls && !stalled_ && idle >= stall_timeout_) {
+    stalled_ = true;
+    InterlockedIncrement64(&stalls_);
+  }
+  if (timing_stalls && !stalled_)
+    return last_receive_ + stall_timeout_;
+  return last_receive_ + timeout_;
+}
+
+void FrameStream::FinishConnect() {
+  int error = 0;
+  socklen_t error_size = sizeof(error);
+  if (getsockopt(socket_, SOL_SOCKET, SO_ERROR, &error, &error_size) != 0)
+    error = errno;
+  if (error != 0) {
+    fprintf_s(stderr, kErrorMessageFor, "connect", name_.c_str(), error);
+    Stop(kError);
+    return;
+  }
+  status_ = kOK;
+  // The timeout restarts once connected.
+  last_receive_ = GetMilliseconds();
+  registered_events_ = EPOLLIN;
+  loop_->Modify(this, registered_events_);
+}
+
+void FrameStream::Receive(LONGLONG now) {
+  UINT32 received = 0;
+  while (status_ == kOK && received < kMaxBytesPerPoll) {
+    // The rest of an image the ring cannot hold skips the copy through it.
+    // ParseRing has emptied the ring into the image by then.
+    bool direct = state_ == kReceivingImage && part_ != NULL &&
+                  part_remaining_ >= static_cast<UINT32>(ring_.get_capacity());
+    char* buffer = part_;
+    int size = static_cast<int>(part_remaining_);
+    if (!direct) {
+      buffer = ring_.GetFreeSpace(&size);
+      if (buffer == NULL) {
+        fprintf_s(stderr, "%s: cannot allocate the receive buffer.\n",
+                  name_.c_str());
+        Stop(kError);
+        return;
+      }
+    }
+    ssize_t result = recv(socket_, buffer, size, 0);
+    InterlockedIncrement64(&recv_calls_);
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      fprintf_s(stderr, kErrorMessageIn, "recv", name_.c_str(),
+                GetLastError());
+      Stop(kError);
+      return;
+    }
+    if (result == 0) {
+      fprintf_s(stderr, "%s: connection closed by peer.\n", name_.c_str());
+      Stop(kError);
+      return;
+    }
+    received += static_cast<UINT32>(result);
+    if (direct) {
+      part_ += result;
+      part_remaining_ -= static_cast<UINT32>(result);
+      if (part_remaining_ == 0)
+        DeliverFrame(frame_pool_.Get(0), false);
+    } else {
+      ring_.Commit(static_cast<int>(result));
+      ParseRing();
+    }
+  }
+  if (received == 0)
+    return;
+  InterlockedExchangeAdd64(&bytes_received_, received);
+  EndStall(now);
+  last_receive_ = now;
+  receiving_ = true;
+}
+
+void FrameStream::ParseRing() {
+  while (status_ == kOK && ring_.get_size() > 0) {
+    if (state_ != kReceivingImage) {
+      // Headers are parsed where they lie, unless they wrap.
+      if (static_cast<UINT32>(ring_.get_size()) < part_remaining_)
+        return;
+      UINT32 size = part_remaining_;
+      FinishPart(ring_.Peek(size, part_));
+      ring_.Consume(size);
+      continue;
+    }
+    if (part_ == NULL) {
+      UINT32 length = part_remaining_;
+      // Images the ring can hold are handed out in place. Moving the part
+      // already buffered costs less than copying the whole image out.
+      if (length <= static_cast<UINT32>(ring_.get_capacity())) {
+        if (length > static_cast<UINT32>(ring_.get_contiguous_capacity()))
+          ring_.Compact();
+        if (static_cast<UINT32>(ring_.get_size()) < length)
+          return;
+        cvInitMatHeader(&view_, 1, length, CV_8UC1,
+                        const_cast<char*>(ring_.Peek(length, NULL)));
+        DeliverFrame(&view_, true);
+        ring_.Consume(length);
+        continue;
+      }
+      CvMat* image = frame_pool_.Reserve(0, length);
+      if (image == NULL) {
+        fprintf_s(stderr, "%s: frame of %u bytes cannot be received.\n",
+                  name_.c_str(), length);
+        Stop(kError);
+        return;
+      }
+      ExpectPart(kReceivingImage, image->data.ptr, length);
+    }
+    int copied = ring_.Read(part_, part_remaining_);
+    part_ += copied;
+    part_remaining_ -= copied;
+    if (part_remaining_ == 0)
+      DeliverFrame(frame_pool_.Get(0), false);
+  }
+}
+
+void FrameStream::EndStall(LONGLONG now) {
+  if (!stalled_)
+    return;
+  LONGLONG stall = now - last_receive_;
+  InterlockedExchangeAdd64(&stalled_milliseconds_, stall);
+  // Only this thread writes it, but GetStats reads it atomically.
+  if (stall > InterlockedCompareExchange64(&longest_stall_milliseconds_,
+                                           0, 0))
+    InterlockedExchange64(&longest_stall_milliseconds_, stall);
+  stalled_ = false;
+}
+
+void FrameStream::FinishPart(const char* data) {
+  switch (state_) {
+    case kReceivingHeader: {
+      const MessageHeader* header =
+          reinterpret_cast<const MessageHeader*>(data);
+      header_.header = ntohl(header->header);
+      header_.length = ntohl(header->length);
+      if (header_.header == kReceiveImageV2) {
+        ExpectPart(kReceivingFrameInfo, &info_, sizeof(info_));
+        return;
+      }
+      if (header_.header != kReceiveImage) {
+        fprintf_s(stderr, "%s: bad frame header %u.\n", name_.c_str(),
+                  header_.header);
+        Stop(kError);
+        return;
+      }
+      info_.sequence = 0;
+      info_.capture_time = 0;
+      break;
+    }
+    case kReceivingFrameInfo: {
+      const FrameInfo* info = reinterpret_cast<const FrameInfo*>(data);
+      info_.version = ntohs(info->version);
+      info_.header_size = ntohs(info->header_size);
+      info_.sequence = NetworkToHost64(info->sequence);
+      info_.capture_time = NetworkToHost64(info->capture_time);
+      UINT16 header_size = sizeof(MessageHeader) + sizeof(FrameInfo);
+      if (info_.version < 2 || info_.header_size < header_size ||
+          info_.header_size > kMaxFrameHeaderSize) {
+        fprintf_s(stderr, "%s: bad frame header version %u of %u bytes.\n",
+                  name_.c_str(), info_.version, info_.header_size);
+        Stop(kError);
+        return;
+      }
+      if (info_.header_size > header_size) {
+        ExpectPart(kReceivingExtension, extension_,
+                   info_.header_size - header_size);
+        return;
+      }
+      break;
+    }
+    default:
+      break;
+  }
+  // The header is complete. The image follows.
+  if (header_.length == 0) {
+    Stop(kEnd);
+    return;
+  }
+  if (header_.length > frame_pool_.get_max_frame_size()) {
+    fprintf_s(stderr, "%s: frame of %u bytes exceeds the maximum of %u.\n",
+              name_.c_str(), header_.length,
+              frame_pool_.get_max_frame_size());
+    Stop(kError);
+    return;
+  }
+  // Where the image goes is decided by ParseRing once it arrives.
+  ExpectPart(kReceivingImage, NULL, header_.length);
+}
+
+void FrameStream::DeliverFrame(const CvMat* data, bool in_place) {
+  StreamFrame frame;
+  frame.data = data;
+  frame.sequence = ++sequence_;
+  frame.sender_sequence = info_.sequence;
+  frame.capture_time = static_cast<LONGLONG>(info_.capture_time);
+  InterlockedIncrement64(&frames_received_);
+  if (in_place)
+    InterlockedIncrement64(&frames_in_place_);
+  if (info_.sequence != 0) {
+    if (sender_sequence_ != 0 && info_.sequence > sender_sequence_ + 1)
+      InterlockedExchangeAdd64(
+          &sender_skipped_frames_,
+          static_cast<LONGLONG>(info_.sequence - sender_sequence_ - 1));
+    sender_sequence_ = info_.sequence;
+  }
+  handler_(context_, frame);
+  ExpectPart(kReceivingHeader, &header_, sizeof(header_));
+}
+
+void FrameStream::ExpectPart(ReceiveState state, void* buffer, UINT32 size) {
+  state_ = state;
+  part_ = static_cast<char*>(buffer);
+  part_remaining_ = size;
+}
+
+void FrameStream::Flush() {
+  EnterCriticalSection(&output_lock_);
+  size_t sent = 0;
+  while (sent < output_.size()) {
+    ssize_t result = send(socket_, output_.data() + sent,
+                          output_.size() - sent, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      fprintf_s(stderr, kErrorMessageIn, "send", name_.c_str(),
+                GetLastError());
+      LeaveCriticalSection(&output_lock_);
+      Stop(kError);
+      return;
+    }
+    sent += result;
+  }
+  output_.erase(0, sent);
+  int events = output_.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+  LeaveCriticalSection(&output_lock_);
+  if (events != registered_events_) {
+    registered_events_ = events;
+    loop_->Modify(this, events);
+  }
+}
+
+void FrameStream::Stop(Status status) {
+  // No more events; the socket stays open until the destructor, so that
+  // its descriptor cannot be reused meanwhile.
+  epoll_ctl(loop_->epoll_, EPOLL_CTL_DEL, socket_, NULL);
+  EnterCriticalSection(&output_lock_);
+  status_ = status;
+  output_.clear();
+  LeaveCriticalSection(&output_lock_);
+}
+
+LONGLONG FrameStream::GetMilliseconds() {
+  LARGE_INTEGER ticks, frequency;
+  QueryPerformanceCounter(&ticks);
+  QueryPerformanceFrequency(&frequency);
+  return ticks.QuadPart / (frequency.QuadPart / 1000);
+}
@@ -0,0 +1,274 @@
+// Copyright 2016
+
+#ifndef RASPICAMERA_RASPI_TRANSPORT_H_
+#define RASPICAMERA_RASPI_TRANSPORT_H_
+
+// Non-blocking client side of the camera protocol (see raspi_protocol.h) for
+// the POSIX tools. One EventLoop thread drives any number of FrameStreams
+// with epoll, so a connection needs no thread of its own, no call ever
+// blocks on a socket, and every wait is bounded by the timers of the loop
+// instead of SO_RCVTIMEO. Linux only; RasPiCamera is the Windows client.
+
+#include <string>
+#include <vector>
+#include "raspi_protocol.h"
+
+class FrameStream;
+struct epoll_event;
+
+// A thread waiting on the sockets of its FrameStreams and running their
+// state machines as data arrives, as the sockets drain, and as their
+// timers expire.
+class EventLoop {
+ public:
+  // Constructor. Creates the epoll instance and starts the thread. On
+  // error, is_open() returns false.
+  EventLoop();
+  // Destructor. Stops the thread without waiting on any socket. Every
+  // FrameStream of the loop MUST be destroyed first.
+  ~EventLoop();
+  // Returns true if the thread is running.
+  bool is_open() { return thread_ != NULL; }
+
+ private:
+  friend class FrameStream;
+  enum {
+    // number of epoll events taken at once
+    kMaxEvents = 64
+  };
+  // Starts polling stream, whose socket is registered for events. Can be
+  // called from any thread.
+  void Add(FrameStream* stream, int events);
+  // Stops polling stream. Returns once the loop thread is not running it
+  // and never will again. MUST NOT be called from the loop thread.
+  void Remove(FrameStream* stream);
+  // Changes the events stream is registered for. Called by the loop
+  // thread.
+  void Modify(FrameStream* stream, int events);
+  // Makes the loop thread poll every stream now. Can be called from any
+  // thread.
+  void Wake();
+  // Function called by thread_. Runs the loop until stopping_ is set.
+  static DWORD WINAPI LoopThread(LPVOID lpParam);
+  // Polls every stream with the events that are ready for it. Returns the
+  // epoll_wait timeout until the earliest timer of the streams.
+  int PollStreams(const epoll_event* events, int count);
+
+  EventLoop(const EventLoop&);
+  void operator=(const EventLoop&);
+
+  int epoll_;
+  // eventfd written by Wake and the destructor.
+  int wake_;
+  HANDLE thread_;
+  // Guards the fields below.
+  CRITICAL_SECTION lock_;
+  // Signaled when the loop thread is done running a stream.
+  CONDITION_VARIABLE idle_;
+  std::vector<FrameStream*> streams_;
+  // The stream the loop thread is running, or NULL.
+  FrameStream* running_;
+  // Set by the destructor to stop thread_.
+  bool stopping_;
+};
+
+// Counters of a FrameStream since its construction. Safe to read from any
+// thread.
+struct StreamStats {
+  LONGLONG bytes_received;
+  // recv calls made to receive them
+  LONGLONG recv_calls;
+  LONGLONG frames_received;
+  // frames handed to the FrameHandler straight from the receive ring,
+  // without being copied
+  LONGLONG frames_in_place;
+  // frames the Raspberry Pi skipped, from the gaps in the sequence numbers
+  // of version 2 headers
+  LONGLONG sender_skipped_frames;
+  // times no byte arrived for Options::stall_timeout milliseconds
+  LONGLONG stalls;
+  // total and longest time from the last byte before a stall to the first
+  // byte after it, in milliseconds
+  LONGLONG stalled_milliseconds;
+  LONGLONG longest_stall_milliseconds;
+};
+
+// A frame received by a FrameStream.
+struct StreamFrame {
+  // The JPEG data, a 1-row CV_8UC1 matrix. Only valid during the call to
+  // the FrameHandler.
+  const CvMat* data;
+  // Sequence number of the frame on the stream, from 1.
+  LONGLONG sequence;
+  // Sequence number of the frame on the Raspberry Pi, or 0 for version 1
+  // headers.
+  UINT64 sender_sequence;
+  // Capture time in microseconds since 1970-01-01 UTC, or 0 if unknown.
+  LONGLONG capture_time;
+};
+
+// Connection to one Raspberry Pi camera server, run by an EventLoop as a
+// state machine: it connects, sends the configuration, then reads whatever
+// arrives into a ReceiveRing, parsing the frame headers where they lie and
+// handing out the images in place when they fit, and writes serial requests
+// as the socket accepts them.
+class FrameStream {
+ public:
+  enum Status { kConnecting, kOK, kEnd, kError };
+
+  // Function called on the loop thread for every received frame. context
+  // is passed through from the constructor. MUST NOT destroy the stream.
+  typedef void (*FrameHandler)(void* context, const StreamFrame& frame);
+
+  // Optional settings of FrameStream. The constructor sets every field to
+  // its default value.
+  struct Options {
+    Options();
+    // Frames larger than this many bytes are regarded as an error.
+    UINT32 max_frame_size;
+    // Frame header version asked of the server, as
+    // RasPiCamera::Options::protocol_version.
+    int protocol_version;
+    // Milliseconds without any byte received after which a stall is
+    // counted, once the first byte has arrived.
+    DWORD stall_timeout;
+    // Milliseconds without any byte received, or to connect, after which
+    // the stream fails.
+    DWORD timeout;
+    // As RasPiCamera::Options::receive_buffer_size. Frames smaller than it
+    // are usually handed to the FrameHandler in place.
+    int receive_buffer_size;
+    // As RasPiCamera::Options::socket_receive_buffer.
+    int socket_receive_buffer;
+  };
+
+  // Constructor. Starts connecting to address and port on loop, which MUST
+  // outlive the object, and queues configuration, the content of the
+  // camera configuration file. handler is called with context for every
+  // frame. On error, the status is kError.
+  FrameStream(EventLoop* loop, const char* address, const char* port,
+              const std::string& configuration, FrameHandler handler,
+              void* context, const Options& options = Options());
+  // Destructor. Stops the stream at once and closes the connection.
+  ~FrameStream();
+  // Returns the current status. kEnd once the server has ended the stream.
+  Status get_status() { return status_; }
+  // Returns "address:port".
+  const std::string& get_name() { return name_; }
+  // Copies the counters to stats, which MUST NOT be NULL. Can be called
+  // from any thread.
+  void GetStats(StreamStats* stats);
+  // Queues a request to the Raspberry Pi to send len characters from data
+  // through its serial output. Never blocks. Returns false if the stream
+  // has ended or failed, or if too much output is already queued. Can be
+  // called from any thread.
+  bool RequestSerial(const char* data, int len);
+
+ private:
+  friend class EventLoop;
+  // Parts of a frame, received in this order.
+  enum ReceiveState {
+    kReceivingHeader,
+    kReceivingFrameInfo,
+    kReceivingExtension,
+    kReceivingImage
+  };
+  enum {
+    // Default value of Options::max_frame_size (16 MiB).
+    kDefaultMaxFrameSize = 16 * 1024 * 1024,
+    // Default value of Options::stall_timeout.
+    kDefaultStallTimeout = 1000,
+    // Default value of Options::timeout, as RasPiCamera::kTimedout.
+    kDefaultTimeout = 10000,
+    // Most bytes received by one Poll, so that one fast stream cannot
+    // starve the others of the loop.
+    kMaxBytesPerPoll = 1024 * 1024,
+    // Most bytes of serial requests waiting to be written.
+    kMaxPendingOutput = 64 * 1024
+  };
+  // Called by the loop thread with the epoll events that are ready, 0 if
+  // none. Advances the state machine and checks the timers. Returns the
+  // time of the next timer in GetMilliseconds() time, or -1 if none.
+  LONGLONG Poll(int events, LONGLONG now);
+  // Completes the connection once the socket is writable.
+  void FinishConnect();
+  // Receives what the socket holds, up to kMaxBytesPerPoll bytes, into
+  // ring_, or straight into the image for the rest of a large one.
+  void Receive(LONGLONG now);
+  // Parses the parts buffered in ring_ and hands out the complete frames.
+  void ParseRing();
+  // Adds the stall in progress, if any, to the stall counters.
+  void EndStall(LONGLONG now);
+  // Called with the content of a complete header part. Moves to the next
+  // part.
+  void FinishPart(const char* data);
+  // Calls handler_ with the image data, which is in ring_ if in_place is
+  // set, and starts receiving the next header.
+  void DeliverFrame(const CvMat* data, bool in_place);
+  // Starts receiving size bytes. buffer holds header parts that wrap around
+  // ring_, and receives the images larger than ring_; it is NULL until
+  // ParseRing knows where the image goes.
+  void ExpectPart(ReceiveState state, void* buffer, UINT32 size);
+  // Writes the queued output until the socket is full, and registers for
+  // EPOLLOUT while some remains.
+  void Flush();
+  // Stops the stream with status, deregistering the socket.
+  void Stop(Status status);
+  // Returns the current monotonic time in milliseconds.
+  static LONGLONG GetMilliseconds();
+
+  FrameStream(const FrameStream&);
+  void operator=(const FrameStream&);
+
+  EventLoop* loop_;
+  std::string name_;
+  int socket_;
+  volatile Status status_;
+  FrameHandler handler_;
+  void* context_;
+  DWORD stall_timeout_;
+  DWORD timeout_;
+  // The fields below are only used by the loop thread.
+  ReceiveState state_;
+  // Where the rest of the current part goes, and how much of it is left.
+  // Header parts are received whole, so part_remaining_ is their size.
+  char* part_;
+  UINT32 part_remaining_;
+  MessageHeader header_;
+  FrameInfo info_;
+  char extension_[kMaxFrameHeaderSize];
+  // Sequence number of the last frame on the stream, and on the server.
+  LONGLONG sequence_;
+  UINT64 sender_sequence_;
+  // GetMilliseconds() when the last byte was received, or when connecting
+  // started.
+  LONGLONG last_receive_;
+  // Set once the first byte has been received. Stalls are only counted from
+  // then on, so that the server starting up is not one.
+  bool receiving_;
+  // Set while no byte has been received for stall_timeout_ milliseconds.
+  bool stalled_;
+  // Events the socket is registered for.
+  int registered_events_;
+  // Receive buffer of the images that are not handed out in place. Keeps
+  // its capacity across frames.
+  FramePool frame_pool_;
+  ReceiveRing ring_;
+  // Header of the images handed out in place.
+  CvMat view_;
+  // Guards output_.
+  CRITICAL_SECTION output_lock_;
+  // Messages waiting to be written, in wire format.
+  std::string output_;
+  // Fields of StreamStats, updated with interlocked operations.
+  volatile LONGLONG bytes_received_;
+  volatile LONGLONG recv_calls_;
+  volatile LONGLONG frames_received_;
+  volatile LONGLONG frames_in_place_;
+  volatile LONGLONG sender_skipped_frames_;
+  volatile LONGLONG stalls_;
+  volatile LONGLONG stalled_milliseconds_;
+  volatile LONGLONG longest_stall_milliseconds_;
+};
+
+#endif  // RASPICAMERA_RASPI_TRANSPORT_H_
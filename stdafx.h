@@ -20,6 +20,13 @@
 #include <winsock2.h>
 #include <windows.h>
 #include <opencv/highgui.h>
+#include "raspi_frame.h"
+#include "raspi_frame_pool.h"
+#include "raspi_receive_ring.h"
+#include "raspi_metrics.h"
+#include "raspi_recording.h"
+#include "raspi_recorder.h"
+#include "raspi_protocol.h"
 #include "raspi_camera.h"
 
 #endif  // RASPICAMERA_STDAFX_H_